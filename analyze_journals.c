@@ -0,0 +1,448 @@
+// Merges the membership journals of a stress test run and reports convergence,
+// failure detection latency and false positives
+// Usage: analyze_journals <scenario file>
+//
+// The scenario file is written by stress_test.py, one event per line:
+//   START <ts_ns> <TCP> <UDP>   node forked
+//   KILL <ts_ns> <TCP> <UDP>    node sent SIGINT
+//   ROUND <ts_ns>               expected configuration checkpoint
+// Journals are read from <TCP>_<UDP>.journal in the current directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "journal.h"
+#include "port_index.h"
+
+#define EVENT_START 0
+#define EVENT_KILL 1
+#define EVENT_ROUND 2
+#define EVENT_RECORD 3
+
+struct event
+{
+    long long ts_ns;
+    int seq; // keeps scenario order for equal timestamps
+    int kind;
+    int owner;  // node whose journal holds the record, or the started/killed node
+    int member; // node the record is about, -1 if it never took part in the scenario
+    int type;
+};
+
+struct node
+{
+    int tcp_port, udp_port;
+    int alive;
+
+    // current view, keyed by port_key, values are node indexes
+    struct port_index view;
+    int correct, extra;
+
+    // failure detection, for killed nodes
+    long long kill_ts, first_detection_ts, disseminated_ts;
+    int holders; // alive nodes that still list this node
+};
+
+struct node *nodes;
+int cnt_nodes, nodes_capacity;
+struct port_index node_by_ports;
+
+struct event *events;
+int cnt_events, events_capacity;
+
+int cnt_alive, cnt_converged;
+long long last_change_ts, converged_ts = -1;
+int false_positives_detector, false_positives_gossip, false_suspicions;
+
+void push_event(long long ts_ns, int kind, int owner, int member, int type)
+{
+    if (cnt_events == events_capacity)
+    {
+        events_capacity = events_capacity ? 2 * events_capacity : 1024;
+        events = (struct event *)realloc(events, sizeof(struct event) * events_capacity);
+    }
+
+    struct event *e = &events[cnt_events];
+    e->ts_ns = ts_ns;
+    e->seq = cnt_events;
+    e->kind = kind;
+    e->owner = owner;
+    e->member = member;
+    e->type = type;
+    cnt_events++;
+}
+
+int find_or_add_node(int tcp_port, int udp_port)
+{
+    int idx = port_index_get(&node_by_ports, port_key(tcp_port, udp_port));
+    if (idx != -1)
+        return idx;
+
+    if (cnt_nodes == nodes_capacity)
+    {
+        nodes_capacity = nodes_capacity ? 2 * nodes_capacity : 64;
+        nodes = (struct node *)realloc(nodes, sizeof(struct node) * nodes_capacity);
+    }
+
+    struct node *n = &nodes[cnt_nodes];
+    memset(n, 0, sizeof(*n));
+    n->tcp_port = tcp_port;
+    n->udp_port = udp_port;
+    n->kill_ts = n->first_detection_ts = n->disseminated_ts = -1;
+    init_port_index(&n->view, 16);
+
+    port_index_put(&node_by_ports, port_key(tcp_port, udp_port), cnt_nodes);
+    return cnt_nodes++;
+}
+
+void read_scenario(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        printf("Failed to open scenario file %s\n", filename);
+        exit(1);
+    }
+
+    char kind[16];
+    long long ts_ns;
+    int tcp_port, udp_port;
+    while (fscanf(f, "%15s %lld", kind, &ts_ns) == 2)
+    {
+        if (strcmp(kind, "ROUND") == 0)
+        {
+            push_event(ts_ns, EVENT_ROUND, -1, -1, 0);
+            continue;
+        }
+
+        if (fscanf(f, "%d %d", &tcp_port, &udp_port) != 2)
+            break;
+        int idx = find_or_add_node(tcp_port, udp_port);
+        push_event(ts_ns, strcmp(kind, "START") == 0 ? EVENT_START : EVENT_KILL, idx, idx, 0);
+    }
+    fclose(f);
+}
+
+void read_journal(int owner)
+{
+    char filename[32];
+    sprintf(filename, "%d_%d.journal", nodes[owner].tcp_port, nodes[owner].udp_port);
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+        printf("Missing journal %s\n", filename);
+        return;
+    }
+
+    struct journal_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != JOURNAL_MAGIC ||
+        header.version != JOURNAL_VERSION || header.record_size != sizeof(struct journal_record))
+    {
+        printf("Bad journal header in %s\n", filename);
+        fclose(f);
+        return;
+    }
+
+    struct journal_record records[256];
+    size_t cnt;
+    while ((cnt = fread(records, sizeof(struct journal_record), 256, f)) > 0)
+    {
+        for (size_t i = 0; i < cnt; i++)
+        {
+            int member = -1;
+            if (records[i].type != JOURNAL_RESET)
+                member = port_index_get(&node_by_ports, port_key(records[i].tcp_port, records[i].udp_port));
+            push_event(records[i].ts_ns, EVENT_RECORD, owner, member, records[i].type);
+        }
+    }
+    fclose(f);
+}
+
+int compare_events(const void *a, const void *b)
+{
+    const struct event *x = (const struct event *)a, *y = (const struct event *)b;
+    if (x->ts_ns != y->ts_ns)
+        return x->ts_ns < y->ts_ns ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+int is_converged(struct node *n)
+{
+    return n->alive && n->extra == 0 && n->correct == cnt_alive - 1;
+}
+
+void recount_converged()
+{
+    cnt_converged = 0;
+    for (int i = 0; i < cnt_nodes; i++)
+        cnt_converged += is_converged(&nodes[i]);
+}
+
+// wraps a change to one node's counters, keeping cnt_converged up to date
+#define UPDATE_NODE(n, change)            \
+    do                                    \
+    {                                     \
+        cnt_converged -= is_converged(n); \
+        change;                           \
+        cnt_converged += is_converged(n); \
+    } while (0)
+
+void lost_holder(int member, long long ts_ns)
+{
+    if (nodes[member].alive || nodes[member].kill_ts < 0)
+        return;
+
+    nodes[member].holders--;
+    if (nodes[member].holders == 0 && nodes[member].disseminated_ts < 0)
+        nodes[member].disseminated_ts = ts_ns;
+}
+
+void add_to_view(struct node *owner, int member)
+{
+    if (nodes[member].alive)
+        owner->correct++;
+    else
+    {
+        owner->extra++;
+        if (nodes[member].kill_ts >= 0)
+            nodes[member].holders++;
+    }
+}
+
+void remove_from_view(struct node *owner, int member, long long ts_ns)
+{
+    if (nodes[member].alive)
+        owner->correct--;
+    else
+    {
+        owner->extra--;
+        lost_holder(member, ts_ns);
+    }
+}
+
+void apply_record(struct event *e)
+{
+    struct node *owner = &nodes[e->owner];
+    if (!owner->alive)
+        return;
+
+    if (e->type == JOURNAL_RESET)
+    {
+        for (int slot = 0; slot < owner->view.capacity; slot++)
+            if (owner->view.keys[slot] != -1)
+                lost_holder(owner->view.values[slot], e->ts_ns);
+        clear_port_index(&owner->view);
+        UPDATE_NODE(owner, owner->correct = owner->extra = 0);
+        return;
+    }
+
+    // records about nodes outside the scenario cannot be judged
+    if (e->member == -1 || e->member == e->owner)
+        return;
+
+    // suspects stay members, only suspicions of live nodes are worth counting
+    if (e->type == JOURNAL_SUSPECT)
+    {
+        false_suspicions += nodes[e->member].alive;
+        return;
+    }
+
+    long long key = port_key(nodes[e->member].tcp_port, nodes[e->member].udp_port);
+    int present = port_index_get(&owner->view, key) != -1;
+
+    if (e->type == JOURNAL_JOIN)
+    {
+        if (present)
+            return;
+        port_index_put(&owner->view, key, e->member);
+        UPDATE_NODE(owner, add_to_view(owner, e->member));
+        return;
+    }
+
+    // JOURNAL_DEAD or JOURNAL_REMOVED
+    if (!present)
+        return;
+
+    struct node *member = &nodes[e->member];
+    if (member->alive)
+    {
+        if (e->type == JOURNAL_DEAD)
+            false_positives_detector++;
+        else
+            false_positives_gossip++;
+    }
+    else if (member->kill_ts >= 0 && member->first_detection_ts < 0)
+        member->first_detection_ts = e->ts_ns;
+
+    port_index_remove(&owner->view, key);
+    UPDATE_NODE(owner, remove_from_view(owner, e->member, e->ts_ns));
+}
+
+void apply_start(struct event *e)
+{
+    struct node *n = &nodes[e->owner];
+    n->alive = 1;
+    cnt_alive++;
+
+    long long key = port_key(n->tcp_port, n->udp_port);
+    for (int i = 0; i < cnt_nodes; i++)
+        if (nodes[i].alive && i != e->owner && port_index_get(&nodes[i].view, key) != -1)
+        {
+            nodes[i].extra--;
+            nodes[i].correct++;
+        }
+    recount_converged();
+}
+
+void apply_kill(struct event *e)
+{
+    struct node *n = &nodes[e->owner];
+    n->alive = 0;
+    n->kill_ts = e->ts_ns;
+    cnt_alive--;
+
+    // the killed node no longer holds anything
+    for (int slot = 0; slot < n->view.capacity; slot++)
+        if (n->view.keys[slot] != -1)
+            lost_holder(n->view.values[slot], e->ts_ns);
+
+    long long key = port_key(n->tcp_port, n->udp_port);
+    n->holders = 0;
+    for (int i = 0; i < cnt_nodes; i++)
+        if (nodes[i].alive && port_index_get(&nodes[i].view, key) != -1)
+        {
+            nodes[i].correct--;
+            nodes[i].extra++;
+            n->holders++;
+        }
+    if (n->holders == 0)
+        n->disseminated_ts = e->ts_ns;
+    recount_converged();
+}
+
+void report_round(int idx_round, long long ts_ns)
+{
+    printf("\nRound %d:\n", idx_round);
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        struct node *n = &nodes[i];
+        if (!n->alive)
+            continue;
+
+        if (is_converged(n))
+            printf("Node (%d, %d): OK\n", n->tcp_port, n->udp_port);
+        else
+            printf("Node (%d, %d): not OK, %d extra, %d missing\n", n->tcp_port, n->udp_port, n->extra,
+                   cnt_alive - 1 - n->correct);
+    }
+
+    if (converged_ts >= 0)
+        printf("Converged %.1f ms after the last change\n", (converged_ts - last_change_ts) / 1e6);
+    else
+        printf("Not converged, %d/%d nodes OK, %.1f ms after the last change\n", cnt_converged, cnt_alive,
+               (ts_ns - last_change_ts) / 1e6);
+}
+
+void report_detections()
+{
+    int cnt_kills = 0, cnt_detected = 0, cnt_disseminated = 0;
+    double total_detection_ms = 0, total_dissemination_ms = 0;
+
+    printf("\nFailure detection:\n");
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        struct node *n = &nodes[i];
+        if (n->kill_ts < 0)
+            continue;
+        cnt_kills++;
+
+        printf("Node (%d, %d): ", n->tcp_port, n->udp_port);
+        if (n->first_detection_ts >= 0)
+        {
+            double ms = (n->first_detection_ts - n->kill_ts) / 1e6;
+            total_detection_ms += ms;
+            cnt_detected++;
+            printf("first detected after %.1f ms", ms);
+        }
+        else
+            printf("never detected");
+
+        if (n->disseminated_ts >= 0)
+        {
+            double ms = (n->disseminated_ts - n->kill_ts) / 1e6;
+            total_dissemination_ms += ms;
+            cnt_disseminated++;
+            printf(", removed everywhere after %.1f ms\n", ms);
+        }
+        else
+            printf(", still listed by %d nodes\n", n->holders);
+    }
+
+    if (cnt_detected > 0)
+        printf("Average detection latency: %.1f ms (%d/%d kills)\n", total_detection_ms / cnt_detected, cnt_detected,
+               cnt_kills);
+    if (cnt_disseminated > 0)
+        printf("Average full dissemination latency: %.1f ms (%d/%d kills)\n",
+               total_dissemination_ms / cnt_disseminated, cnt_disseminated, cnt_kills);
+    printf("False positives: %d by own failure detector, %d received through gossip\n", false_positives_detector,
+           false_positives_gossip);
+    printf("Suspicions of live nodes: %d\n", false_suspicions);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        puts("Usage: ./analyze_journals <scenario file>");
+        exit(1);
+    }
+
+    init_port_index(&node_by_ports, 64);
+    read_scenario(argv[1]);
+    int cnt_scenario_nodes = cnt_nodes;
+    for (int i = 0; i < cnt_scenario_nodes; i++)
+        read_journal(i);
+
+    qsort(events, cnt_events, sizeof(struct event), compare_events);
+
+    printf("\n\n==========SIMULATION RAPORT==========\n");
+    int cnt_rounds = 0;
+    for (int i = 0; i < cnt_events; i++)
+    {
+        struct event *e = &events[i];
+        switch (e->kind)
+        {
+        case EVENT_START:
+            apply_start(e);
+            break;
+        case EVENT_KILL:
+            apply_kill(e);
+            break;
+        case EVENT_RECORD:
+            apply_record(e);
+            break;
+        case EVENT_ROUND:
+            report_round(++cnt_rounds, e->ts_ns);
+            continue;
+        }
+
+        if (e->kind != EVENT_RECORD)
+        {
+            last_change_ts = e->ts_ns;
+            converged_ts = -1;
+        }
+
+        if (cnt_converged == cnt_alive)
+        {
+            if (converged_ts < 0)
+                converged_ts = e->ts_ns;
+        }
+        else
+            converged_ts = -1;
+    }
+    printf("\nSimulation ran for %d rounds\n", cnt_rounds);
+
+    report_detections();
+    return 0;
+}
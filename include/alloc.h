@@ -0,0 +1,37 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+// Every heap allocation of a node goes through these, so that the steady state
+// can be shown to allocate nothing
+void *mem_alloc(size_t size);
+
+void *mem_realloc(void *ptr, size_t size);
+
+void mem_free(void *ptr);
+
+// Number of mem_alloc and mem_realloc calls so far, over all threads
+long long mem_allocations();
+
+// Bump allocator for short-lived buffers that are all released at once. A
+// request that does not fit is served from the heap, and the next reset grows
+// the arena to the high-water mark, so a steady workload stops allocating.
+struct arena
+{
+    char *base;
+    size_t capacity, used;
+    size_t high_water; // bytes requested since the last reset, overflow included
+    void *overflow;    // heap blocks handed out since the last reset, chained
+};
+
+void init_arena(struct arena *arena, size_t capacity);
+
+void free_arena(struct arena *arena);
+
+// Returns size bytes aligned for any type, valid until the next reset
+void *arena_alloc(struct arena *arena, size_t size);
+
+void arena_reset(struct arena *arena);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef BROADCAST_QUEUE_H
+#define BROADCAST_QUEUE_H
+
+#include "port_index.h"
+#include "gossip_message.h"
+
+#define INITIAL_BROADCASTS_CAPACITY 64
+
+struct broadcast
+{
+    int tcp_port, udp_port;
+    int status; // MEMBER_DEAD, MEMBER_ALIVE or MEMBER_SUSPECT
+    int incarnation;
+
+    int transmits;      // messages it was packed into so far
+    int transmit_limit; // dropped once transmits reaches it
+    long long seq;      // queueing order, newer broadcasts go first among equals
+};
+
+// Transmit-limited broadcast queue: a binary min-heap on (transmits, newest
+// first) plus a hash index from the node to its heap position, so there is at
+// most one broadcast per node and a newer one replaces it in O(log n).
+struct broadcast_queue
+{
+    int capacity, size;
+    struct broadcast *heap;
+    long long next_seq;
+
+    struct port_index by_node; // (tcp, udp) -> heap position
+};
+
+void init_broadcast_queue(struct broadcast_queue *queue, int capacity);
+
+void free_broadcast_queue(struct broadcast_queue *queue);
+
+void clear_broadcast_queue(struct broadcast_queue *queue);
+
+// Queues an update about a node, superseding any broadcast already queued about it
+void push_broadcast(struct broadcast_queue *queue, int tcp_port, int udp_port, int status, int incarnation, int transmit_limit);
+
+// Drops the broadcast queued about a node, if any
+void drop_broadcast(struct broadcast_queue *queue, int tcp_port, int udp_port);
+
+// Appends the least transmitted broadcasts to gossip, as long as they stay within max_updates
+// entries and byte_budget encoded bytes. Every packed broadcast counts one transmit and those
+// that reach their limit leave the queue. Returns the number of broadcasts packed
+int pack_broadcasts(struct broadcast_queue *queue, struct gossip_message *gossip, int max_updates, int byte_budget);
+
+#endif
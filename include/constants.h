@@ -5,4 +5,25 @@
 #define PROBE_PERIOD 0.5
 #define GRACE_PERIOD 0.75
 
+// a helper acks a request-probe only within this many seconds of the request
+#define REQUEST_PROBE_TIMEOUT (3. * PROBE_PERIOD / 4.)
+
+// local health multiplier cap: probe rounds stretch to at most (MAX_HEALTH + 1) * PROBE_PERIOD
+#define MAX_HEALTH 8
+
+// a suspect is declared dead after SUSPICION_MULT * log10(members) probe periods (at least SUSPICION_MULT)
+#define SUSPICION_MULT 4
+
+// buried members are forgotten after this many suspicion timeouts, and oldest first
+// beyond MAX_GRAVES of them (a power of two)
+#define GRAVE_SUSPICION_MULT 10
+#define MAX_GRAVES 4096
+
+// seconds of unanswered refutations after a NOT_A_PEER before falling back to a full rejoin
+#define REJOIN_TIMEOUT 2.0
+
+// seconds between push-pull syncs with a random member, stretched logarithmically past SYNC_SCALE_THRESHOLD members
+#define SYNC_PERIOD 5.0
+#define SYNC_SCALE_THRESHOLD 32
+
 #endif
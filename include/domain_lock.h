@@ -0,0 +1,31 @@
+#ifndef DOMAIN_LOCK_H
+#define DOMAIN_LOCK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// A mutex over one part of the node state that counts how often a thread had to wait for
+// it. Critical sections never send, receive or sleep: blocking calls go through
+// check_unlocked, which counts every one made while the calling thread holds a domain lock.
+struct domain_lock
+{
+    pthread_mutex_t mutex;
+    atomic_llong acquisitions, contended;
+};
+
+void init_domain_lock(struct domain_lock *lock);
+
+void acquire_domain(struct domain_lock *lock);
+
+// Returns 0 if the lock was taken, -1 if another thread holds it
+int try_acquire_domain(struct domain_lock *lock);
+
+void release_domain(struct domain_lock *lock);
+
+// what names the blocking call, logged if a lock is held
+void check_unlocked(const char *what);
+
+// Blocking calls made while holding a domain lock, over all threads. Always 0 unless there is a bug
+long long blocking_under_lock();
+
+#endif
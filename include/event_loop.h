@@ -0,0 +1,15 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// Runs the node on the calling thread: one epoll set over the join server,
+// the UDP socket, timerfds for probing, gossiping and the periodic report, and
+// the connection of a rejoin while one runs.
+// Never returns.
+void run_event_loop(void (*report)(void));
+
+// Rejoins without blocking the loop: waits out the grace period on a timerfd, then runs
+// the join exchange with a random member over a non-blocking connection. Does nothing
+// while a rejoin is already under way
+void start_rejoin();
+
+#endif
@@ -1,7 +1,8 @@
 #ifndef GOSSIP_MESSAGE_H
 #define GOSSIP_MESSAGE_H
 
-#define CAPACITY 100
+// one message is one datagram; longer update lists are split across messages
+#define UPDATES_PER_MESSAGE 128
 
 #define GOSSIP_UPDATE 0
 #define PROBE 1
@@ -13,7 +14,8 @@ struct gossip_message
 {
     int message_type;
     int cnt_updates;
-    int tcp_ports[CAPACITY], udp_ports[CAPACITY], statuses[CAPACITY];
+    int tcp_ports[UPDATES_PER_MESSAGE], udp_ports[UPDATES_PER_MESSAGE], statuses[UPDATES_PER_MESSAGE];
+    int incarnations[UPDATES_PER_MESSAGE]; // statuses are MEMBER_* values, ordered by incarnation
 
     // lamport time as for this message
     int node_name_tcp, node_name_udp, node_time;
@@ -1,19 +1,47 @@
 #ifndef JOIN_MESSAGE_H
 #define JOIN_MESSAGE_H
 
-#define CAPACITY 100
+// members are streamed to the joining node in chunks of this many entries
+#define JOIN_CHUNK_SIZE 512
+
+// upper bound accepted from a gateway, guards against garbage on the stream
+#define MAX_JOIN_PEERS (1 << 20)
+
+// initial bytes of the arena holding a received join reply's members, it grows to the largest reply seen
+#define JOIN_SCRATCH_SIZE (64 * 1024)
+
+// requests on the TCP port
+#define TCP_JOIN 0
+#define TCP_SYNC 1 // followed by the sender's sync_digest, see sync.h
 
 struct join_request
 {
+    int type; // TCP_JOIN or TCP_SYNC
     int tcp_port, udp_port;
+    int incarnation; // higher than any incarnation this node was declared dead at
 };
 
+// header of a join reply, followed on the stream by num_peers join_member entries
 struct join_reply
 {
     int num_peers;
+    int incarnation; // the joining node takes this incarnation
+};
 
-    int tcp_ports[CAPACITY];
-    int udp_ports[CAPACITY];
+struct join_member
+{
+    int tcp_port, udp_port;
+    int incarnation;
+};
+
+// Membership as sent in join replies, taken once and shared by every reply in
+// flight until the last one releases it
+struct member_snapshot
+{
+    int refs;
+    long long taken_ns;
+    int num_members;
+    struct join_member members[];
 };
 
 #endif
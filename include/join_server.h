@@ -0,0 +1,100 @@
+#ifndef JOIN_SERVER_H
+#define JOIN_SERVER_H
+
+#include "join_message.h"
+#include "sync.h"
+#include "alloc.h"
+
+// concurrent TCP connections, further joiners wait in the listen backlog
+#define MAX_JOIN_CONNECTIONS 256
+
+// seconds a connection gets to complete its whole exchange
+#define JOIN_CONNECTION_TIMEOUT 2.0
+
+// seconds a membership snapshot is reused for new join replies
+#define JOIN_SNAPSHOT_MAX_AGE 0.1
+
+// initial bytes of the arena holding sync entries, it grows to the largest exchange seen
+#define SYNC_SCRATCH_SIZE (16 * 1024)
+
+// connection states: a join is request -> reply. A sync is request + digest -> digest,
+// count and entries -> count and entries, after which both sides apply what they received
+#define JOIN_READING_REQUEST 0
+#define JOIN_WRITING_REPLY 1
+#define SYNC_READING_DIGEST 2
+#define SYNC_WRITING_REPLY 3
+#define SYNC_READING_COUNT 4
+#define SYNC_READING_ENTRIES 5
+#define SYNC_CONNECTING 6
+#define SYNC_WRITING_REQUEST 7
+#define SYNC_READING_REPLY 8
+#define SYNC_WRITING_ENTRIES 9
+
+// what a sync responder sends before its entries
+struct sync_reply
+{
+    struct sync_digest digest;
+    int cnt_entries;
+};
+
+struct join_connection
+{
+    int fd; // -1 while the slot is free
+    int state;
+    int outbound; // a sync this node started
+    int peer_tcp_port; // once known
+    long long deadline_ns;
+
+    // the buffer being filled, or the (up to two) buffers being sent
+    char *in;
+    long long in_len, received;
+    const char *out[2];
+    long long out_len[2], sent;
+
+    struct join_request request;
+    struct join_reply reply;
+    struct member_snapshot *snapshot;
+
+    struct sync_digest digest; // the initiator's
+    struct sync_reply sync_reply;
+    int cnt_entries, cnt_own_entries;
+    struct sync_entry *entries, *own_entries; // received and sent, from the sync scratch
+};
+
+// Serves the TCP port as a state machine over non-blocking sockets and its own
+// epoll set: join requests are answered from a shared membership snapshot, and
+// push-pull syncs run in both directions, one started every sync period. The
+// epoll fd is itself pollable, so the event loop runtime nests it.
+struct join_server
+{
+    int epoll_fd;
+    int listener_fd;
+    int timer_fd; // fires at the earliest connection deadline
+    int sync_fd;  // fires when the next sync is due
+
+    struct member_snapshot *snapshot; // the one new replies share, may be NULL
+    int cnt_connections;
+    struct join_connection connections[MAX_JOIN_CONNECTIONS];
+
+    int cnt_syncs, outbound_sync; // the scratch is reset once no sync is in flight
+    struct arena sync_scratch;
+};
+
+// Transfers over a join connection, also used by the event loop's rejoin. The fill,
+// flush and connect steps return 1 once done, 0 if the socket would block, -1 on failure
+void expect_input(struct join_connection *conn, void *buf, long long len);
+
+void queue_output(struct join_connection *conn, const void *first, long long first_len, const void *second, long long second_len);
+
+int fill_input(struct join_connection *conn);
+
+int flush_output(struct join_connection *conn);
+
+int finish_connect(struct join_connection *conn);
+
+void init_join_server(struct join_server *server, int listener_fd);
+
+// Waits up to timeout_ms (-1 blocks) for activity, then handles everything ready
+void run_join_server(struct join_server *server, int timeout_ms);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4a4e5753 // "SWNJ"
+#define JOURNAL_VERSION 1
+
+// record types
+#define JOURNAL_RESET 0   // membership replaced wholesale (start, join or rejoin), JOIN records follow
+#define JOURNAL_JOIN 1    // member added
+#define JOURNAL_DEAD 2    // member removed by this node's own failure detector
+#define JOURNAL_REMOVED 3 // member removed because another node said so
+#define JOURNAL_SUSPECT 4 // member suspected, it stays in the membership until declared dead
+
+// Every node appends these to <tcp>_<udp>.journal, only when its membership changes.
+// Timestamps are CLOCK_MONOTONIC, comparable across processes on one host.
+struct journal_record
+{
+    int64_t ts_ns;
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t tcp_port, udp_port;
+    uint16_t reserved2;
+};
+
+struct journal_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+};
+
+void init_journal(int tcp_port, int udp_port);
+
+void close_journal();
+
+// Records are timestamped and staged by the calling thread, which may hold state locks,
+// and written by its next journal_flush, which must be called without any
+void journal_event(int type, int tcp_port, int udp_port);
+
+// RESET followed by one JOIN per member
+void journal_reset(int num_peers, int *tcp_ports, int *udp_ports);
+
+// Writes the records staged by the calling thread
+void journal_flush();
+
+#endif
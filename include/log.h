@@ -1,10 +1,16 @@
 #ifndef LOG_H
 #define LOG_H
 
-#define LEVEL_FATAL "FATAL"
-#define LEVEL_INFO " INFO"
-#define LEVEL_DBG "DEBUG"
-#define LEVEL_PEERS "PEERS"
+#define LEVEL_FATAL 0
+#define LEVEL_INFO 1
+#define LEVEL_DBG 2
+#define LEVEL_PEERS 3
+
+#define LEVEL_NAMES {"FATAL", " INFO", "DEBUG", "PEERS"}
+#define LEVEL_COLORS {COLOR_FATAL, COLOR_INFO, COLOR_DBG, COLOR_PEERS}
+
+#define LOG_MASK(level) (1 << (level))
+#define LOG_ALL_LEVELS (LOG_MASK(LEVEL_FATAL) | LOG_MASK(LEVEL_INFO) | LOG_MASK(LEVEL_DBG) | LOG_MASK(LEVEL_PEERS))
 
 #define COLOR_INFO "\033[0;36m"
 #define COLOR_DBG "\033[0;33m"
@@ -12,13 +18,29 @@
 #define COLOR_RESET "\033[0m"
 #define COLOR_PEERS "\033[0;35m"
 
-#define PREFIX_FORMAT "[%s   %ld:%ld   Node %d-%d]: "
-#define COLORED_LOG_FORMAT "%s%s%s"
+// a line is: color "[" level "   " sec:nsec NODE_PREFIX_FORMAT message reset
+#define NODE_PREFIX_FORMAT "   Node %d-%d]: "
+
+// Lines are formatted by the caller straight into a slot of a lock-free ring
+// and written out in batches by a background flusher thread
+#define LOG_RING_SLOTS 4096 // must be a power of two
+#define LOG_SLOT_SIZE 512
+#define LOG_LONG_LINE_SIZE 8192
+#define LOG_FLUSH_BATCH 64
 
 void init_logger(int tcp_port_, int udp_port_);
 
+// Flushes everything still queued; safe to call more than once
 void cleanup_logger();
 
-void logg(const char *level, const char *fmt, ...);
+// Levels outside the mask are rejected before any formatting work
+void set_log_levels(int mask);
+
+int log_enabled(int level);
+
+// Number of lines dropped because the ring was full
+long long log_dropped();
+
+void logg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
 #endif
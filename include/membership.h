@@ -0,0 +1,48 @@
+#ifndef MEMBERSHIP_H
+#define MEMBERSHIP_H
+
+#include "port_index.h"
+#include "rtt.h"
+
+#define INITIAL_MEMBERS_CAPACITY 64
+
+// member states, also carried by every gossiped update
+#define MEMBER_DEAD 0
+#define MEMBER_ALIVE 1
+#define MEMBER_SUSPECT 2
+
+// Dense arrays of members plus two hash indexes into them. A node is
+// identified by its (tcp, udp) pair and addressed by its UDP port, so the
+// UDP port is assumed unique among members.
+struct member_table
+{
+    int capacity, num_peers;
+    int *tcp_ports;
+    int *udp_ports;
+    int *incarnations; // bumped only by the member itself, to refute suspicion
+    int *statuses;     // MEMBER_ALIVE or MEMBER_SUSPECT, dead members are removed
+    struct rtt_estimator *rtts; // measured on direct probe acks
+
+    struct port_index by_node; // (tcp, udp) -> position
+    struct port_index by_udp;  // udp -> position, used to match acks and senders
+};
+
+void init_member_table(struct member_table *members, int capacity);
+
+void free_member_table(struct member_table *members);
+
+void clear_member_table(struct member_table *members);
+
+// Returns the position of the member, or -1 if absent
+int lookup_member(struct member_table *members, int tcp_port, int udp_port);
+
+int lookup_member_by_udp(struct member_table *members, int udp_port);
+
+// Returns the position of the (possibly already present) member, growing the table as needed
+// New members start alive with incarnation 0 and no RTT samples
+int insert_member(struct member_table *members, int tcp_port, int udp_port);
+
+// O(1) swap-remove: the last member takes the freed position
+void delete_member_at(struct member_table *members, int pos);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef MESSAGE_QUEUE_H
+#define MESSAGE_QUEUE_H
+
+#include <stdatomic.h>
+
+#include "gossip_message.h"
+
+struct message_slot
+{
+    atomic_long seq;
+    struct gossip_message msg;
+};
+
+// Bounded MPSC ring of decoded messages, same scheme as the log ring: a slot whose
+// sequence equals the producer ticket is free, one whose sequence is ticket + 1 holds a
+// message. Producers never block, a full queue drops like a full socket buffer. The
+// consumer sleeps on an eventfd that producers signal once per pushed batch.
+struct message_queue
+{
+    int capacity; // a power of two
+    struct message_slot *slots;
+    atomic_long tail; // next ticket handed to a producer
+    long head;        // next slot read by the consumer
+    int event_fd;
+};
+
+void init_message_queue(struct message_queue *queue, int capacity);
+
+// Returns how many of the messages were queued
+int push_messages(struct message_queue *queue, const struct gossip_message *msgs, int cnt);
+
+// Consumer only: moves up to max queued messages to out and returns how many
+int pop_messages(struct message_queue *queue, struct gossip_message *out, int max);
+
+// Consumer only: blocks until messages were pushed since the last call
+void wait_messages(struct message_queue *queue);
+
+#endif
@@ -1,18 +1,49 @@
 #ifndef NODE_MANAGER_H
 #define NODE_MANAGER_H
 
+struct datagram;
+struct join_request;
+struct join_reply;
+struct join_member;
+
 extern struct node_state state;
 
+extern int cnt_receive_workers;
+
 void init_state(int tcp_port, int udp_port);
 
 void join_network(int tcp_gateway, __attribute__((unused)) int udp_gateway);
 
+// Picks a random member to join through, returns -1 if there is none
+int pick_gateway(int *tcp_gateway, int *udp_gateway);
+
+void fill_join_request(struct join_request *request);
+
+// Room for the members of a join reply, until adopt_join_reply
+struct join_member *alloc_join_members(int num_peers);
+
+// Takes the incarnation and the members of a join reply, except this node itself
+void adopt_join_reply(const struct join_reply *reply, const struct join_member *members);
+
 void start_network(int argc, char **argv);
 
+// Prepares a rejoin without blocking the receiving thread, the prober joins once the
+// grace period is over. Does nothing while a rejoin is already due
+void reset_state();
+
+void rejoin_network();
+
+int open_tcp_listener();
+
+void handle_datagrams(struct datagram *datagrams, int cnt);
+
 void *tcp_port_listener(__attribute__((unused)) void *params);
 
 void *udp_port_listener(__attribute__((unused)) void *params);
 
+// Replaces the UDP listener when cnt_receive_workers > 0
+void start_receive_workers();
+
 void *prober(__attribute__((unused)) void *params);
 
 void *gossiper(__attribute__((unused)) void *params);
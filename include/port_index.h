@@ -0,0 +1,31 @@
+#ifndef PORT_INDEX_H
+#define PORT_INDEX_H
+
+// Open-addressing hash map from a node key to an int (usually a position in a
+// dense array). Linear probing with backward-shift deletion, so lookups never
+// walk over tombstones. Kept at most half full.
+
+struct port_index
+{
+    int capacity; // always a power of two
+    int size;
+    long long *keys; // -1 marks an empty slot
+    int *values;
+};
+
+long long port_key(int tcp_port, int udp_port);
+
+void init_port_index(struct port_index *index, int capacity);
+
+void free_port_index(struct port_index *index);
+
+void clear_port_index(struct port_index *index);
+
+// Returns the value stored for key, or -1 if absent
+int port_index_get(struct port_index *index, long long key);
+
+void port_index_put(struct port_index *index, long long key, int value);
+
+void port_index_remove(struct port_index *index, long long key);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+// xoshiro256** generators, one per thread so no call ever contends. Threads
+// that did not seed their own generator derive one from the process seed.
+
+// Seeds the calling thread and sets the process seed other threads derive from
+void seed_random(unsigned long long seed);
+
+unsigned long long random_u64(void);
+
+// Uniform in [0, n), n > 0
+int random_below(int n);
+
+// Uniform in [0, 1)
+double random_unit(void);
+
+// Floyd's algorithm: k distinct indexes of [0, n) in random order, O(k^2) time and no extra
+// memory, meant for small k. Returns min(k, n), the number written to out
+int sample_indexes(int n, int k, int *out);
+
+#endif
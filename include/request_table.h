@@ -0,0 +1,59 @@
+#ifndef REQUEST_TABLE_H
+#define REQUEST_TABLE_H
+
+#include "port_index.h"
+
+// pending request-probes, requests beyond either bound are dropped
+#define REQUEST_TABLE_CAPACITY 256
+#define REQUESTORS_PER_TARGET 16
+
+// the wheel spans two request timeouts
+#define REQUEST_WHEEL_SLOTS 64
+
+// One pending target: probed on behalf of every requestor, answered when it acks
+struct request_probe
+{
+    int target_udp;
+    int cnt_requestors;
+    int requestor_udps[REQUESTORS_PER_TARGET];
+    long long requested_ns[REQUESTORS_PER_TARGET];
+
+    long long deadline_ns; // timeout of the latest request
+    int slot;              // wheel slot, -1 while the entry is free
+    int prev, next;        // links within the wheel slot, or the free list
+};
+
+// Fixed pool of request-probes keyed by target UDP port. Expiry is driven by a
+// hashed timer wheel, so it costs O(expired + elapsed ticks) and the table
+// never allocates after init.
+struct request_table
+{
+    long long timeout_ns, tick_ns;
+    long long last_tick; // entries due before this tick have been expired
+
+    int size;
+    int free_head;
+    int wheel[REQUEST_WHEEL_SLOTS]; // first entry per slot, -1 if none
+    struct request_probe entries[REQUEST_TABLE_CAPACITY];
+
+    struct port_index by_target; // target udp -> entry
+};
+
+void init_request_table(struct request_table *table, long long timeout_ns, long long now_ns);
+
+void free_request_table(struct request_table *table);
+
+void clear_request_table(struct request_table *table);
+
+// Records that requestor_udp asked for target_udp to be probed
+// Returns 0 on success, -1 if the table or the target's requestor list is full
+int add_request_probe(struct request_table *table, int target_udp, int requestor_udp, long long now_ns);
+
+// Removes the target's entry and copies out the requestors whose requests have not timed out
+// requestor_udps must hold REQUESTORS_PER_TARGET ports. Returns how many were copied
+int take_request_probe(struct request_table *table, int target_udp, int *requestor_udps, long long now_ns);
+
+// Frees every entry whose deadline passed by now_ns
+void expire_request_probes(struct request_table *table, long long now_ns);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef RTT_H
+#define RTT_H
+
+// Smoothed round-trip time and variance, updated TCP-style (RFC 6298)
+struct rtt_estimator
+{
+    long long srtt_ns; // 0 until the first sample
+    long long rttvar_ns;
+};
+
+void init_rtt(struct rtt_estimator *rtt);
+
+void rtt_sample(struct rtt_estimator *rtt, long long sample_ns);
+
+// srtt + 4 * rttvar, or fallback_ns while there are no samples
+long long rtt_timeout_ns(struct rtt_estimator *rtt, long long fallback_ns);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Periodic timer driven by absolute deadlines: tick k is due at start + k * period,
+// so lateness of one tick never shifts the following ones. The first deadline
+// gets a random phase so that nodes started together do not tick in lockstep.
+struct periodic_timer
+{
+    long long period_ns;
+    long long next_ns; // absolute deadline of the next tick
+
+    // scheduling lag, i.e. how late ticks were observed
+    long long cnt_ticks, cnt_missed;
+    long long total_lag_ns, max_lag_ns, last_lag_ns;
+    long long last_expirations; // more than 1 when the last wakeup skipped ticks
+};
+
+void init_periodic_timer(struct periodic_timer *timer, double period_s, long long start_ns);
+
+// Picks a new random phase starting from start_ns, keeping the lag statistics
+void restart_periodic_timer(struct periodic_timer *timer, long long start_ns);
+
+// Changes the period from the next tick on, the tick already scheduled moves by the difference
+void set_timer_period(struct periodic_timer *timer, long long period_ns);
+
+// Blocks until the next deadline, then records the lag and advances the deadline
+void wait_periodic_timer(struct periodic_timer *timer);
+
+// Records that the timer fired expirations times, observed at now_ns (used with timerfd)
+void record_timer_ticks(struct periodic_timer *timer, long long now_ns, long long expirations);
+
+double average_lag_ms(struct periodic_timer *timer);
+
+void log_timer_lag(const char *name, struct periodic_timer *timer);
+
+#endif
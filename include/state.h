@@ -2,62 +2,183 @@
 #define STATE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "gossip_message.h"
+#include "transport.h"
+#include "membership.h"
+#include "join_message.h"
+#include "scheduler.h"
+#include "rtt.h"
+#include "broadcast_queue.h"
+#include "request_table.h"
+#include "alloc.h"
+#include "sync.h"
+#include "domain_lock.h"
 
-#define CAPACITY 100
 #define FAN_OUT 3
 
+// max broadcasts carried by a probe, ack or request-probe
+#define PIGGYBACK_LIMIT 16
+
+// concurrent probes per round: one per MEMBERS_PER_PROBE members, at most MAX_CONCURRENT_PROBES
+#define MEMBERS_PER_PROBE 32
+#define MAX_CONCURRENT_PROBES 8
+
+// RTT-derived probe timeouts are at least MIN_PROBE_TIMEOUT seconds, and the direct
+// timeout takes at most MAX_DIRECT_TIMEOUT_SHARE of a probe round
+#define MIN_PROBE_TIMEOUT 0.01
+#define MAX_DIRECT_TIMEOUT_SHARE 0.5
+
+// replies decided while applying received messages, sent once the locks are released
+#define MAX_PENDING_REPLIES 128
+
+// In the event loop runtime and in the simulator all state is owned by one thread and the locks compile away
+#if defined(EVENT_LOOP) || defined(SIMULATOR)
+#define lock_domain(lock) ((void)(lock))
+#define try_lock_domain(lock) ((void)(lock), 0)
+#define unlock_domain(lock) ((void)(lock))
+#else
+#define lock_domain(lock) acquire_domain(lock)
+#define try_lock_domain(lock) try_acquire_domain(lock)
+#define unlock_domain(lock) release_domain(lock)
+#endif
+
 // STRUCTS
-struct broadcast;
+struct suspicion;
+struct grave;
+struct probe_session;
+struct member_view;
 struct node_state;
 
 struct node_state
 {
-    // These can be accessed without holding the lock
+    // These can be accessed without holding a lock
     int own_tcp_port, own_udp_port;
+    struct transport transport;
+    int lamport_time;
+    atomic_llong grace_period_until;
 
-    pthread_mutex_t lock;
+    // Lifeguard local health multiplier: 0 when healthy, up to MAX_HEALTH. Raised by missed
+    // acks, late probe ticks and refuted suspicions, lowered by acks. Probe rounds and the
+    // direct and indirect probe timeouts are stretched by (health + 1)
+    atomic_int health;
 
-    long long grace_period_until;
-    int lamport_time;
+    // The state is split into domains, each under its own lock. Nested locks are taken in
+    // this order: members, probes, request-probes, broadcasts
+    struct domain_lock members_lock, probes_lock, request_probes_lock, broadcasts_lock;
 
-    int capacity, num_peers;
-    int *tcp_ports;
-    int *udp_ports;
+    // MEMBERS DOMAIN: the member table, graveyard, suspicions, probe order and own incarnation
+
+    // own incarnation, raised to refute suspicion or death
+    int incarnation;
+    // set while NOT_A_PEER replies are being refuted, cleared by the next ack
+    long long not_peer_since;
+
+    struct member_table members;
+
+    // (tcp, udp) -> incarnation at which a removed member was declared dead,
+    // so stale alive updates cannot resurrect it
+    struct port_index graveyard;
+    // burials in order, a ring of graves_capacity; entries of members buried again or
+    // revived since are stale and skipped
+    int cnt_graves, graves_capacity, first_grave;
+    struct grave *graves;
 
-    int cnt_probing;
+    int cnt_suspects, suspects_capacity;
+    struct suspicion *suspects;
+
+    // round-robin probe order, reshuffled after each full pass; new members are inserted at a
+    // random position of the rest of the pass and removed ones are skipped
+    int cnt_probing, probing_capacity, probe_cursor;
     int *tcp_ports_to_probe;
     int *udp_ports_to_probe;
 
-    int current_tcp_port_to_probe;
-    int current_udp_port_to_probe;
-    int probed;
+    // read-only copy of the members for threads that do not change them, replaced on every
+    // change. Views are pooled: a replaced view is rebuilt by a later change once its readers
+    // have left, so there are at most two more views than threads reading at once
+    _Atomic(struct member_view *) view;
+    int members_changed;
+    int cnt_views;
+    struct member_view *retired_views;
+
+    // PROBES DOMAIN: probes of the current round, concluded at their deadlines or when the next round starts
+    int cnt_probes;
+    struct probe_session *probes;
+
+    // over direct acks from every member, used for members without samples of their own
+    struct rtt_estimator cluster_rtt;
 
-    int cnt_request_probes;
-    int *udp_ports_requested_to_probe;
-    int *udp_ports_requestors;
-    long long *probe_request_ns;
+    // REQUEST-PROBES DOMAIN
+    struct request_table request_probes;
 
-    int cnt_broadcast, broadcast_list_capacity;
-    struct broadcast *broadcast_list;
+    // BROADCASTS DOMAIN
+    struct broadcast_queue broadcasts;
+
+    // owned by the probing and gossiping loops, read by the periodic report
+    struct periodic_timer probe_timer, gossip_timer;
 };
 
-struct broadcast
+struct probe_session
 {
     int tcp_port, udp_port;
-    int status; // 0 -> removed, 1 -> joined
+    int acked;
+    int escalated; // request-probes sent
+
+    // escalate to request-probes, then conclude
+    long long sent_ns, escalate_at_ns, conclude_at_ns;
+};
+
+// Immutable copy of the member list. Positions match the member table it was copied from
+struct member_view
+{
+    atomic_int readers;
+    int capacity, num_peers;
+    int own_incarnation;
+    int *tcp_ports, *udp_ports, *incarnations;
+    struct port_index by_udp;
+    struct member_view *next_retired;
+};
 
-    int remaining_rounds;
+// A reply to a received message: acks (relayed for requestors when relayed_udp is set),
+// NOT_A_PEER replies, probes on behalf of requestors and alive updates refuting a
+// NOT_A_PEER reply at the given incarnation
+struct pending_reply
+{
+    int message_type, udp_port;
+    int relayed_udp, incarnation;
+};
+
+struct reply_outbox
+{
+    int cnt;
+    struct pending_reply replies[MAX_PENDING_REPLIES];
+};
+
+struct suspicion
+{
+    int tcp_port, udp_port;
+    long long deadline_ns; // declared dead at this point unless refuted
+};
+
+struct grave
+{
+    long long key;
+    int incarnation;
+    long long buried_ns;
 };
 
 // FUNCTIONS
-void populate_peers(struct node_state *state, int num_peers, int *tcp_ports, int *udp_ports);
+// Sets up an empty state, the caller then sets up state->transport
+void init_node_state(struct node_state *state, int tcp_port, int udp_port);
 
-int append_member(struct node_state *state, int tcp_port, int udp_port);
+// incarnations may be NULL, all members then start at incarnation 0
+void populate_peers(struct node_state *state, int num_peers, int *tcp_ports, int *udp_ports, int *incarnations);
 
-char *print_peers(struct node_state *state);
+void append_member(struct node_state *state, int tcp_port, int udp_port, int incarnation);
 
-void append_broadcast(struct node_state *state, int tcp_port, int udp_port, int status);
+struct member_snapshot *take_member_snapshot(struct node_state *state);
+
+void append_broadcast(struct node_state *state, int tcp_port, int udp_port, int status, int incarnation);
 
 void gossip_changes(struct node_state *state);
 
@@ -67,22 +188,81 @@ void probe_next(struct node_state *state);
 
 void reply_probe(struct node_state *state, int udp_port);
 
-void check_ack(struct node_state *state, int udp_port);
+void check_ack(struct node_state *state, int tcp_port, int udp_port);
+
+// Acks a probe if it comes from a peer, without touching the member table. NOT_A_PEER
+// replies are left to whoever applies the probe later. Rather than wait for the broadcasts
+// lock, the ack goes out without updates
+void answer_probe(struct node_state *state, int udp_port);
+
+void check_probed(struct node_state *state, long long ns);
 
-void check_probed(struct node_state *state);
+void check_suspicions(struct node_state *state);
 
-void request_probes_if_no_ack(struct node_state *state);
+// Forgets the members buried GRAVE_SUSPICION_MULT suspicion timeouts before ns
+// Must be called while holding the members lock
+void expire_graves(struct node_state *state, long long ns);
 
-void append_request_probe(struct node_state *state, int target_udp, int requestor_udp);
+void lock_members(struct node_state *state);
 
-void fulfil_request_probes(struct node_state *state, int udp_port);
+// Also publishes the member view and writes the journal if the members changed
+void unlock_members(struct node_state *state);
+
+void request_probes_if_no_ack(struct node_state *state, long long ns);
+
+void start_probe_round(struct node_state *state);
+
+long long next_probe_deadline(struct node_state *state);
+
+void run_probe_deadlines(struct node_state *state);
+
+void append_request_probe(struct node_state *state, int target_udp, int requestor_udp, struct reply_outbox *outbox);
+
+void fulfil_request_probes(struct node_state *state, int udp_port, struct reply_outbox *outbox);
 
 int is_peer(struct node_state *state, int udp_port);
 
-void reply_not_peer(struct node_state *state, int udp_port);
+void reply_not_peer(struct node_state *state, int udp_port, struct reply_outbox *outbox);
+
+int refute_not_peer(struct node_state *state, int udp_port, struct reply_outbox *outbox);
+
+// Sends every queued reply and empties the outbox. Must be called without holding a lock
+void send_replies(struct node_state *state, struct reply_outbox *outbox);
+
+int admission_incarnation(struct node_state *state, int tcp_port, int udp_port, int incarnation);
 
 void remv_peer(struct node_state *state, int tcp_port, int udp_port);
 
+// Applies a batch of received messages under one acquisition of the members lock, then replies
+// Returns 1 if the node has to rejoin, the rest of the batch is then dropped
+int handle_gossip(struct node_state *state, struct gossip_message *msgs, int cnt);
+
+// Forgets everything in flight ahead of a rejoin and pauses probing and gossip for a grace period
+void prepare_rejoin(struct node_state *state);
+
+void set_incarnation(struct node_state *state, int incarnation);
+
+void sync_digest(struct node_state *state, struct sync_digest *digest);
+
+int collect_sync_entries(struct node_state *state, const struct sync_digest *theirs, struct sync_digest *ours, struct arena *scratch, struct sync_entry **entries);
+
+void apply_sync_entries(struct node_state *state, const struct sync_entry *entries, int cnt);
+
+int pick_sync_peer(struct node_state *state);
+
 double get_remaining_grace_period(struct node_state *state);
 
+// The returned view stays valid until leave_member_view. Readers never wait for writers
+struct member_view *enter_member_view(struct node_state *state);
+
+void leave_member_view(struct member_view *view);
+
+// Grows the view pool to cnt views sized for the current members, so that publishing
+// does not allocate while at most cnt - 2 threads read views at once
+void reserve_member_views(struct node_state *state, int cnt);
+
+int view_has_peer(struct member_view *view, int udp_port);
+
+void log_lock_contention(struct node_state *state);
+
 #endif
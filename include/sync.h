@@ -0,0 +1,33 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+// Push-pull anti-entropy: two nodes swap digests of their membership, hashed
+// into buckets by node, then send each other every entry of the buckets that
+// differ. Updates apply with the usual incarnation rules, so a sync repairs
+// whatever gossip lost without ever undoing newer information.
+
+#define SYNC_BUCKETS 64
+
+// upper bound accepted from a peer, guards against garbage on the stream
+#define MAX_SYNC_ENTRIES (1 << 20)
+
+struct sync_entry
+{
+    int tcp_port, udp_port;
+    int status; // MEMBER_DEAD for buried members
+    int incarnation;
+};
+
+// XOR of the hashes of the entries in each bucket
+struct sync_digest
+{
+    unsigned int buckets[SYNC_BUCKETS];
+};
+
+int sync_bucket(int tcp_port, int udp_port);
+
+void clear_digest(struct sync_digest *digest);
+
+void add_to_digest(struct sync_digest *digest, int tcp_port, int udp_port, int status, int incarnation);
+
+#endif
@@ -3,4 +3,10 @@
 
 void sleep_(double s);
 
+// CLOCK_MONOTONIC in nanoseconds
+long long now_ns();
+
+// Sleeps until an absolute CLOCK_MONOTONIC deadline, immune to drift and EINTR
+void sleep_until_ns(long long deadline_ns);
+
 #endif
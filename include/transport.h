@@ -0,0 +1,127 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// max datagrams handed to the kernel in one sendmmsg call
+#define MAX_SEND_BATCH 64
+
+// max datagrams returned by one receive
+#define MAX_RECV_BATCH 64
+
+struct transport;
+
+// Outgoing, or received: then udp_port is the sender's and buf belongs to the transport
+struct datagram
+{
+    int udp_port;
+    const void *buf;
+    int len;
+};
+
+// A backend. Datagram calls go through these, streams are sockets (TCP or local)
+// that the caller reads, writes, polls and closes as usual.
+struct transport_ops
+{
+    // Returns the number of datagrams handed on, failed ones are skipped
+    int (*send_datagrams)(struct transport *transport, struct datagram *datagrams, int cnt);
+
+    // Waits up to timeout_ms (-1 blocks, 0 polls) for datagrams and returns up to max of
+    // them, their buffers stay valid until the next receive. Returns -1 on failure
+    int (*recv_datagrams)(struct transport *transport, struct datagram *out, int max, int timeout_ms);
+
+    // Return a socket, or -1 with errno set. A non-blocking connect may fail with EINPROGRESS
+    int (*listen_stream)(struct transport *transport, int tcp_port);
+    int (*connect_stream)(struct transport *transport, int tcp_port, int nonblocking);
+    int (*accept_stream)(struct transport *transport, int listener_fd);
+
+    void (*close)(struct transport *transport);
+
+    // Opens another transport on the same UDP port that receives a share of the incoming
+    // datagrams. Returns -1 if the port is not shared; NULL if the backend cannot shard
+    int (*open_shard)(struct transport *transport, struct transport *shard);
+};
+
+struct transport
+{
+    const struct transport_ops *ops;
+    int udp_port;
+
+    // readable whenever datagrams may be waiting, for callers that poll; -1 if there is none
+    int fd;
+
+    void *impl; // backend state
+};
+
+// Real UDP and TCP sockets on INADDR_ANY. The UDP socket is shared by the listener and by
+// every sender, so that replies always originate from the node's own UDP port
+void init_udp_transport(struct transport *transport, int udp_port);
+
+// The same with SO_REUSEPORT, so that shards can receive from the port as well. The kernel
+// spreads datagrams over the sockets by sender
+void init_sharded_udp_transport(struct transport *transport, int udp_port);
+
+// Pieces of the UDP backend for other socket backends. The socket is bound to udp_port, the
+// process exits if that fails
+int open_udp_socket(int udp_port, int reuse_port);
+int tcp_listen_stream(struct transport *transport, int tcp_port);
+int tcp_connect_stream(struct transport *transport, int tcp_port, int nonblocking);
+int accept_any_stream(struct transport *transport, int listener_fd);
+
+#ifdef IO_URING
+// The UDP backend over io_uring: one multishot receive into a ring of provided buffers, and
+// sends submitted as a batch. Returns -1, leaving nothing set up, if the kernel lacks any of it
+int init_uring_transport(struct transport *transport, int udp_port);
+#endif
+
+// In-memory datagrams between transports of one process, for tests and benchmarks. A
+// datagram is copied once, into the receiver's queue, and received in place; it is dropped
+// if nobody has the port or the queue is full. Streams are local sockets private to the process
+void init_loopback_transport(struct transport *transport, int udp_port);
+
+// max ports a fault injector cuts off
+#define MAX_PARTITIONED_PORTS 64
+
+struct fault_config
+{
+    double loss;                       // probability that a received datagram is dropped
+    double min_delay_ms, max_delay_ms; // uniform delay of every received datagram
+    double reorder;                    // probability of another delay of up to max_delay_ms + 1 ms
+
+    // datagrams from and to these UDP ports are dropped between partition_from and
+    // partition_until, in seconds since the injector was set up (until < 0: for good)
+    int cnt_partitioned;
+    int partitioned_ports[MAX_PARTITIONED_PORTS];
+    double partition_from, partition_until;
+};
+
+// Parses "loss=0.1,delay=1-5,reorder=0.05,partition=21001+22001,partition_at=5-20",
+// unset fields stay as they are. A partition without partition_at starts at once and lasts
+// for good. Returns 0, or -1 if the spec is malformed
+int parse_fault_config(const char *spec, struct fault_config *config);
+
+// Wraps inner, which the wrapper takes over, and applies config to its datagrams. Delayed
+// datagrams are held by the receiver and released by the first receive after they are due;
+// the wrapper's fd also becomes readable then
+void init_fault_injector(struct transport *transport, struct transport *inner, const struct fault_config *config);
+
+void close_transport(struct transport *transport);
+
+int send_datagram(struct transport *transport, int udp_port, const void *buf, int len);
+
+int send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt);
+
+int recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms);
+
+int listen_stream(struct transport *transport, int tcp_port);
+
+int connect_stream(struct transport *transport, int tcp_port, int nonblocking);
+
+int accept_stream(struct transport *transport, int listener_fd);
+
+int open_shard(struct transport *transport, struct transport *shard);
+
+// Stream helpers, loop until all len bytes are transferred. Return 0 on success, -1 otherwise
+int send_all(int fd, const void *buf, int len);
+
+int recv_all(int fd, void *buf, int len);
+
+#endif
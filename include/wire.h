@@ -0,0 +1,35 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "gossip_message.h"
+
+#define WIRE_VERSION 2
+
+// largest datagram we put on the wire, keeps clear of IP fragmentation
+#define MAX_DATAGRAM_SIZE 1400
+
+// version, type, two ports, varint time, optional target port, varint count
+#define WIRE_HEADER_MAX_SIZE (1 + 1 + 2 + 2 + 5 + 2 + 5)
+// bytes left for updates in a datagram carrying the largest header
+#define WIRE_UPDATES_BUDGET (MAX_DATAGRAM_SIZE - WIRE_HEADER_MAX_SIZE)
+// two ports + status + varint incarnation
+#define WIRE_UPDATE_SIZE (2 + 2 + 1 + 5)
+
+_Static_assert(WIRE_HEADER_MAX_SIZE + UPDATES_PER_MESSAGE * WIRE_UPDATE_SIZE <= MAX_DATAGRAM_SIZE,
+               "a full message must fit in one datagram");
+
+// Layout (ports are 16-bit big endian, varints are LEB128):
+//   u8 version | u8 message_type | u16 node_name_tcp | u16 node_name_udp
+//   varint node_time | [u16 target_udp if REQUEST_PROBE] | varint cnt_updates
+//   cnt_updates x (u16 tcp_port | u16 udp_port | u8 status | varint incarnation)
+
+// Returns the number of bytes one update takes on the wire
+int wire_update_size(int incarnation);
+
+// Returns the encoded length, or -1 if the message does not fit in buf_len
+int encode_gossip(const struct gossip_message *gossip, unsigned char *buf, int buf_len);
+
+// Returns 0 on success, -1 on a truncated, malformed or foreign-version datagram
+int decode_gossip(const unsigned char *buf, int len, struct gossip_message *gossip);
+
+#endif
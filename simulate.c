@@ -0,0 +1,750 @@
+// Deterministic cluster simulator: runs the protocol in src/state.c for every node of
+// a cluster inside one process, against a virtual clock and an in-memory network, and
+// reports failure detection latency, dissemination time, false positives and bandwidth.
+// Usage: simulator [--nodes N] [--seconds S] [--seed X] [--loss P] [--latency MIN_MS MAX_MS]
+//                  [--kill K] [--kill-at S]
+//
+// Every node starts knowing every other one, like seeds given the full cluster. At
+// --kill-at, K random nodes crash. Datagrams are lost with probability --loss and take
+// a uniform latency. This file stands in for the clock (time_utils.c) and the journal
+// (journal.c), and plugs its network in as a transport backend, so the protocol code runs
+// unmodified.
+// Joins and syncs over TCP are not simulated, a rejoin takes effect at once.
+// Runs with the same arguments behave identically, only the wall-clock time differs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "state.h"
+#include "journal.h"
+#include "transport.h"
+#include "time_utils.h"
+#include "wire.h"
+#include "random.h"
+#include "alloc.h"
+#include "constants.h"
+
+// node i has TCP port FIRST_PORT + 2i and UDP port FIRST_PORT + 2i + 1
+#define FIRST_PORT 1024
+#define MAX_NODES ((65536 - FIRST_PORT) / 2)
+
+// the virtual clock starts away from 0, which the protocol uses for "never"
+#define START_NS 1000000000000LL
+
+#define INITIAL_FLIGHTS_CAPACITY 1024
+
+struct sim_node
+{
+    struct node_state state;
+    int alive;
+    int heap_pos;
+    long long wake_ns; // earliest probe, deadline or gossip timer
+
+    // failure detection, for killed nodes
+    long long kill_ns, first_detection_ns, disseminated_ns;
+    int holders; // live nodes that still list this node
+};
+
+// a datagram in flight
+struct flight
+{
+    long long deliver_ns, seq;
+    int to;
+    int len;
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+};
+
+// PARAMETERS
+int cnt_nodes = 1000;
+double sim_seconds = 30.;
+unsigned long long seed = 1;
+double loss = 0.;
+double min_latency_ms = 0.2, max_latency_ms = 1.;
+int cnt_kills = 1;
+double kill_at = -1.;
+
+// CLUSTER
+struct sim_node *nodes;
+int cnt_alive;
+int current = -1; // node whose code is running, owns journal events and sends
+
+// nodes ordered by wake_ns, then by index
+int *node_heap;
+int node_heap_size;
+
+// datagrams ordered by deliver_ns, then by send order
+struct flight *flights;
+int *free_flights, cnt_free_flights, flights_capacity;
+int *flight_heap, flight_heap_size;
+long long next_seq;
+
+struct arena scratch;
+
+// STATISTICS
+long long virtual_ns = START_NS;
+long long cnt_sent, bytes_sent, cnt_lost, cnt_undeliverable, cnt_delivered, cnt_timer_events;
+int false_positives_detector, false_positives_gossip, false_suspicions;
+int cnt_rejoins, cnt_exits;
+
+int tcp_port_of(int i)
+{
+    return FIRST_PORT + 2 * i;
+}
+
+int udp_port_of(int i)
+{
+    return FIRST_PORT + 2 * i + 1;
+}
+
+// Returns the node with this UDP port, or -1
+int node_of_udp(int udp_port)
+{
+    int offset = udp_port - FIRST_PORT - 1;
+    if (offset < 0 || offset % 2 != 0 || offset / 2 >= cnt_nodes)
+        return -1;
+    return offset / 2;
+}
+
+// CLOCK
+long long now_ns()
+{
+    return virtual_ns;
+}
+
+// virtual time only moves between events, nothing in the protocol sleeps here
+void sleep_(__attribute__((unused)) double s)
+{
+}
+
+void sleep_until_ns(__attribute__((unused)) long long deadline_ns)
+{
+}
+
+// NODE HEAP
+int node_before(int a, int b)
+{
+    if (nodes[a].wake_ns != nodes[b].wake_ns)
+        return nodes[a].wake_ns < nodes[b].wake_ns;
+    return a < b;
+}
+
+void place_node(int pos, int i)
+{
+    node_heap[pos] = i;
+    nodes[i].heap_pos = pos;
+}
+
+void sift_node_up(int pos)
+{
+    int i = node_heap[pos];
+    while (pos > 0 && node_before(i, node_heap[(pos - 1) / 2]))
+    {
+        place_node(pos, node_heap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    place_node(pos, i);
+}
+
+void sift_node_down(int pos)
+{
+    int i = node_heap[pos];
+    while (1)
+    {
+        int child = 2 * pos + 1;
+        if (child >= node_heap_size)
+            break;
+        if (child + 1 < node_heap_size && node_before(node_heap[child + 1], node_heap[child]))
+            child++;
+        if (!node_before(node_heap[child], i))
+            break;
+        place_node(pos, node_heap[child]);
+        pos = child;
+    }
+    place_node(pos, i);
+}
+
+void remove_node_from_heap(int i)
+{
+    int pos = nodes[i].heap_pos;
+    int last = node_heap[--node_heap_size];
+    nodes[i].heap_pos = -1;
+    if (last == i)
+        return;
+
+    place_node(pos, last);
+    sift_node_up(pos);
+    sift_node_down(nodes[last].heap_pos);
+}
+
+// Recomputes when node i next has to run and moves it in the heap
+void reschedule(int i)
+{
+    struct node_state *s = &nodes[i].state;
+    long long wake = s->probe_timer.next_ns;
+    if (s->gossip_timer.next_ns < wake)
+        wake = s->gossip_timer.next_ns;
+    long long deadline = next_probe_deadline(s);
+    if (deadline != -1 && deadline < wake)
+        wake = deadline;
+
+    // a deadline that is already due was handled, it must not spin the clock in place
+    if (wake <= virtual_ns)
+        wake = virtual_ns + 1;
+
+    nodes[i].wake_ns = wake;
+    sift_node_up(nodes[i].heap_pos);
+    sift_node_down(nodes[i].heap_pos);
+}
+
+// FLIGHT HEAP
+int flight_before(int a, int b)
+{
+    if (flights[a].deliver_ns != flights[b].deliver_ns)
+        return flights[a].deliver_ns < flights[b].deliver_ns;
+    return flights[a].seq < flights[b].seq;
+}
+
+void push_flight(int f)
+{
+    int pos = flight_heap_size++;
+    while (pos > 0 && flight_before(f, flight_heap[(pos - 1) / 2]))
+    {
+        flight_heap[pos] = flight_heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    flight_heap[pos] = f;
+}
+
+int pop_flight()
+{
+    int top = flight_heap[0];
+    int f = flight_heap[--flight_heap_size];
+    int pos = 0;
+    while (1)
+    {
+        int child = 2 * pos + 1;
+        if (child >= flight_heap_size)
+            break;
+        if (child + 1 < flight_heap_size && flight_before(flight_heap[child + 1], flight_heap[child]))
+            child++;
+        if (!flight_before(flight_heap[child], f))
+            break;
+        flight_heap[pos] = flight_heap[child];
+        pos = child;
+    }
+    if (flight_heap_size > 0)
+        flight_heap[pos] = f;
+    return top;
+}
+
+int claim_flight()
+{
+    if (cnt_free_flights == 0)
+    {
+        int old_capacity = flights_capacity;
+        flights_capacity *= 2;
+        flights = (struct flight *)mem_realloc(flights, sizeof(struct flight) * flights_capacity);
+        free_flights = (int *)mem_realloc(free_flights, sizeof(int) * flights_capacity);
+        flight_heap = (int *)mem_realloc(flight_heap, sizeof(int) * flights_capacity);
+        for (int f = flights_capacity - 1; f >= old_capacity; f--)
+            free_flights[cnt_free_flights++] = f;
+    }
+    return free_flights[--cnt_free_flights];
+}
+
+// TRANSPORT
+// Every datagram counts as sent, then it is lost or put in flight with a random latency
+int sim_send_datagrams(__attribute__((unused)) struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        cnt_sent++;
+        bytes_sent += datagrams[i].len;
+
+        int to = node_of_udp(datagrams[i].udp_port);
+        if (to == -1)
+        {
+            cnt_undeliverable++;
+            continue;
+        }
+        if (loss > 0 && random_unit() < loss)
+        {
+            cnt_lost++;
+            continue;
+        }
+
+        int f = claim_flight();
+        double latency_ms = min_latency_ms + random_unit() * (max_latency_ms - min_latency_ms);
+        flights[f].deliver_ns = virtual_ns + (long long)(latency_ms * 1000000.);
+        flights[f].seq = next_seq++;
+        flights[f].to = to;
+        flights[f].len = datagrams[i].len;
+        memcpy(flights[f].buf, datagrams[i].buf, datagrams[i].len);
+        push_flight(f);
+    }
+    return cnt;
+}
+
+// flights are delivered by the main loop, not received
+int sim_recv_datagrams(__attribute__((unused)) struct transport *transport, __attribute__((unused)) struct datagram *out,
+                       __attribute__((unused)) int max, __attribute__((unused)) int timeout_ms)
+{
+    return 0;
+}
+
+int sim_listen_stream(__attribute__((unused)) struct transport *transport, __attribute__((unused)) int tcp_port)
+{
+    return -1;
+}
+
+int sim_connect_stream(__attribute__((unused)) struct transport *transport, __attribute__((unused)) int tcp_port,
+                       __attribute__((unused)) int nonblocking)
+{
+    return -1;
+}
+
+int sim_accept_stream(__attribute__((unused)) struct transport *transport, __attribute__((unused)) int listener_fd)
+{
+    return -1;
+}
+
+void sim_close(__attribute__((unused)) struct transport *transport)
+{
+}
+
+const struct transport_ops sim_ops = {
+    sim_send_datagrams,
+    sim_recv_datagrams,
+    sim_listen_stream,
+    sim_connect_stream,
+    sim_accept_stream,
+    sim_close,
+    NULL,
+};
+
+void init_sim_transport(struct transport *transport, int udp_port)
+{
+    transport->ops = &sim_ops;
+    transport->udp_port = udp_port;
+    transport->fd = -1;
+    transport->impl = NULL;
+}
+
+// JOURNAL
+void init_journal(__attribute__((unused)) int tcp_port, __attribute__((unused)) int udp_port)
+{
+}
+
+void close_journal()
+{
+}
+
+// memberships replaced wholesale are accounted for by rejoin()
+void journal_reset(__attribute__((unused)) int num_peers, __attribute__((unused)) int *tcp_ports, __attribute__((unused)) int *udp_ports)
+{
+}
+
+void journal_flush()
+{
+}
+
+void journal_event(int type, int tcp_port, int udp_port)
+{
+    if (current == -1 || !nodes[current].alive)
+        return;
+    int member = node_of_udp(udp_port);
+    if (member == -1 || tcp_port != tcp_port_of(member))
+        return;
+    struct sim_node *n = &nodes[member];
+
+    if (n->alive)
+    {
+        if (type == JOURNAL_DEAD)
+            false_positives_detector++;
+        else if (type == JOURNAL_REMOVED)
+            false_positives_gossip++;
+        else if (type == JOURNAL_SUSPECT)
+            false_suspicions++;
+        return;
+    }
+    if (n->kill_ns < 0)
+        return;
+
+    if (type == JOURNAL_DEAD || type == JOURNAL_REMOVED)
+    {
+        if (n->first_detection_ns < 0)
+            n->first_detection_ns = virtual_ns;
+        if (--n->holders == 0)
+            n->disseminated_ns = virtual_ns;
+    }
+    else if (type == JOURNAL_JOIN)
+    {
+        n->holders++;
+        n->disseminated_ns = -1;
+    }
+}
+
+// Moves the holder counts of killed nodes by delta for every one node i lists
+void count_held(int i, int delta)
+{
+    struct member_table *members = &nodes[i].state.members;
+    for (int m = 0; m < members->num_peers; m++)
+    {
+        int member = node_of_udp(members->udp_ports[m]);
+        if (member == -1 || nodes[member].alive || nodes[member].kill_ns < 0)
+            continue;
+
+        nodes[member].holders += delta;
+        if (nodes[member].holders == 0)
+            nodes[member].disseminated_ns = virtual_ns;
+        else
+            nodes[member].disseminated_ns = -1;
+    }
+}
+
+// CLUSTER EVENTS
+void crash(int i)
+{
+    nodes[i].alive = 0;
+    cnt_alive--;
+    remove_node_from_heap(i);
+}
+
+// What reset_state and a join over TCP do, with the exchange taking no time. Like the
+// real node, one whose gateway is down gives up and exits
+void rejoin(int i)
+{
+    struct sim_node *n = &nodes[i];
+    struct node_state *s = &n->state;
+    cnt_rejoins++;
+
+    current = i;
+    count_held(i, -1);
+    prepare_rejoin(s);
+
+    int g = s->members.num_peers > 0 ? node_of_udp(s->members.udp_ports[random_below(s->members.num_peers)]) : -1;
+    if (g == -1 || !nodes[g].alive)
+    {
+        cnt_exits++;
+        crash(i);
+        return;
+    }
+    struct node_state *gateway = &nodes[g].state;
+
+    // the gateway forgetting the joiner is bookkeeping, not a detection
+    current = -1;
+    int incarnation = admission_incarnation(gateway, s->own_tcp_port, s->own_udp_port, s->incarnation);
+    remv_peer(gateway, s->own_tcp_port, s->own_udp_port);
+    struct member_snapshot *snapshot = take_member_snapshot(gateway);
+
+    current = i;
+    int *tcp_ports = (int *)arena_alloc(&scratch, sizeof(int) * snapshot->num_members);
+    int *udp_ports = (int *)arena_alloc(&scratch, sizeof(int) * snapshot->num_members);
+    int *incarnations = (int *)arena_alloc(&scratch, sizeof(int) * snapshot->num_members);
+    int num_peers = 0;
+    for (int m = 0; m < snapshot->num_members; m++)
+    {
+        if (snapshot->members[m].udp_port == s->own_udp_port)
+            continue;
+        tcp_ports[num_peers] = snapshot->members[m].tcp_port;
+        udp_ports[num_peers] = snapshot->members[m].udp_port;
+        incarnations[num_peers] = snapshot->members[m].incarnation;
+        num_peers++;
+    }
+    s->incarnation = incarnation;
+    populate_peers(s, num_peers, tcp_ports, udp_ports, incarnations);
+    count_held(i, 1);
+    mem_free(snapshot);
+    arena_reset(&scratch);
+
+    current = g;
+    append_member(gateway, s->own_tcp_port, s->own_udp_port, incarnation);
+    append_broadcast(gateway, s->own_tcp_port, s->own_udp_port, MEMBER_ALIVE, incarnation);
+    reschedule(g);
+}
+
+void kill_nodes()
+{
+    int *killed = (int *)mem_alloc(sizeof(int) * (cnt_kills > 0 ? cnt_kills : 1));
+    int cnt = sample_indexes(cnt_nodes, cnt_kills, killed);
+    for (int k = 0; k < cnt; k++)
+    {
+        if (!nodes[killed[k]].alive)
+            continue;
+        crash(killed[k]);
+        nodes[killed[k]].kill_ns = virtual_ns;
+        nodes[killed[k]].holders = 0;
+    }
+
+    for (int i = 0; i < cnt_nodes; i++)
+        if (nodes[i].alive)
+            count_held(i, 1);
+    mem_free(killed);
+}
+
+// What the event loop does when the node's timers fire
+void run_timers(int i)
+{
+    struct node_state *s = &nodes[i].state;
+    cnt_timer_events++;
+
+    if (s->probe_timer.next_ns <= virtual_ns)
+    {
+        record_timer_ticks(&s->probe_timer, virtual_ns, 1);
+        if (get_remaining_grace_period(s) <= 0)
+            start_probe_round(s);
+    }
+
+    long long deadline = next_probe_deadline(s);
+    if (deadline != -1 && deadline <= virtual_ns)
+        run_probe_deadlines(s);
+
+    if (s->gossip_timer.next_ns <= virtual_ns)
+    {
+        record_timer_ticks(&s->gossip_timer, virtual_ns, 1);
+        if (get_remaining_grace_period(s) <= 0)
+            gossip_changes(s);
+    }
+}
+
+void deliver(int f)
+{
+    int i = flights[f].to;
+    if (!nodes[i].alive)
+    {
+        cnt_undeliverable++;
+        return;
+    }
+    cnt_delivered++;
+
+    struct gossip_message msg;
+    if (decode_gossip(flights[f].buf, flights[f].len, &msg) < 0)
+        return;
+    if (handle_gossip(&nodes[i].state, &msg, 1))
+        rejoin(i);
+}
+
+// SETUP
+void start_cluster()
+{
+    nodes = (struct sim_node *)mem_alloc(sizeof(struct sim_node) * cnt_nodes);
+    memset(nodes, 0, sizeof(struct sim_node) * cnt_nodes);
+    node_heap = (int *)mem_alloc(sizeof(int) * cnt_nodes);
+
+    flights_capacity = INITIAL_FLIGHTS_CAPACITY;
+    flights = (struct flight *)mem_alloc(sizeof(struct flight) * flights_capacity);
+    free_flights = (int *)mem_alloc(sizeof(int) * flights_capacity);
+    flight_heap = (int *)mem_alloc(sizeof(int) * flights_capacity);
+    for (int f = flights_capacity - 1; f >= 0; f--)
+        free_flights[cnt_free_flights++] = f;
+    init_arena(&scratch, sizeof(int) * 3 * cnt_nodes);
+
+    int *tcp_ports = (int *)mem_alloc(sizeof(int) * cnt_nodes);
+    int *udp_ports = (int *)mem_alloc(sizeof(int) * cnt_nodes);
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        tcp_ports[i] = tcp_port_of(i);
+        udp_ports[i] = udp_port_of(i);
+    }
+
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        struct sim_node *n = &nodes[i];
+        current = i;
+        init_node_state(&n->state, tcp_ports[i], udp_ports[i]);
+        init_sim_transport(&n->state.transport, udp_ports[i]);
+
+        // everyone but itself, the last node takes i's place in the list
+        int last_tcp = tcp_ports[cnt_nodes - 1], last_udp = udp_ports[cnt_nodes - 1];
+        tcp_ports[i] = last_tcp;
+        udp_ports[i] = last_udp;
+        populate_peers(&n->state, cnt_nodes - 1, tcp_ports, udp_ports, NULL);
+        tcp_ports[i] = tcp_port_of(i);
+        udp_ports[i] = udp_port_of(i);
+
+        init_periodic_timer(&n->state.probe_timer, PROBE_PERIOD, virtual_ns);
+        init_periodic_timer(&n->state.gossip_timer, GOSSIP_PERIOD, virtual_ns);
+
+        n->alive = 1;
+        n->kill_ns = n->first_detection_ns = n->disseminated_ns = -1;
+        node_heap[i] = i;
+        n->heap_pos = i;
+        n->wake_ns = virtual_ns;
+    }
+    node_heap_size = cnt_alive = cnt_nodes;
+    for (int i = 0; i < cnt_nodes; i++)
+        reschedule(i);
+
+    mem_free(tcp_ports);
+    mem_free(udp_ports);
+}
+
+void parse_args(int argc, char **argv)
+{
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--nodes") == 0 && a + 1 < argc)
+            cnt_nodes = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--seconds") == 0 && a + 1 < argc)
+            sim_seconds = atof(argv[++a]);
+        else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc)
+            seed = strtoull(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "--loss") == 0 && a + 1 < argc)
+            loss = atof(argv[++a]);
+        else if (strcmp(argv[a], "--latency") == 0 && a + 2 < argc)
+        {
+            min_latency_ms = atof(argv[++a]);
+            max_latency_ms = atof(argv[++a]);
+        }
+        else if (strcmp(argv[a], "--kill") == 0 && a + 1 < argc)
+            cnt_kills = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--kill-at") == 0 && a + 1 < argc)
+            kill_at = atof(argv[++a]);
+        else
+        {
+            puts("Usage: ./simulator [--nodes N] [--seconds S] [--seed X] [--loss P] [--latency MIN_MS MAX_MS] [--kill K] [--kill-at S]");
+            exit(1);
+        }
+    }
+
+    if (cnt_nodes < 2 || cnt_nodes > MAX_NODES || cnt_kills < 0 || cnt_kills >= cnt_nodes || loss < 0 || loss >= 1 ||
+        min_latency_ms < 0 || max_latency_ms < min_latency_ms)
+    {
+        printf("Invalid parameters, at most %d nodes\n", MAX_NODES);
+        exit(1);
+    }
+    if (kill_at < 0)
+        kill_at = sim_seconds / 3;
+}
+
+// REPORT
+void report(double wall_s, double setup_s)
+{
+    printf("\n\n==========SIMULATION RAPORT==========\n");
+    printf("%d nodes, seed %llu, loss %.3f, latency %.2f-%.2f ms\n", cnt_nodes, seed, loss, min_latency_ms, max_latency_ms);
+    printf("Simulated %.1f s in %.2f s after a %.2f s setup (%.1fx real time)\n", sim_seconds, wall_s, setup_s, sim_seconds / wall_s);
+    printf("%lld timer events, %lld datagrams delivered\n", cnt_timer_events, cnt_delivered);
+
+    printf("\nBandwidth:\n");
+    printf("%lld datagrams, %lld bytes sent, %lld lost, %lld undeliverable\n", cnt_sent, bytes_sent, cnt_lost, cnt_undeliverable);
+    printf("Per node: %.1f datagrams/s, %.1f bytes/s\n", cnt_sent / sim_seconds / cnt_nodes, bytes_sent / sim_seconds / cnt_nodes);
+
+    int cnt_killed = 0, cnt_detected = 0, cnt_disseminated = 0;
+    double total_detection_ms = 0, total_dissemination_ms = 0, max_detection_ms = 0, max_dissemination_ms = 0;
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        struct sim_node *n = &nodes[i];
+        if (n->kill_ns < 0)
+            continue;
+        cnt_killed++;
+
+        if (n->first_detection_ns >= 0)
+        {
+            double ms = (n->first_detection_ns - n->kill_ns) / 1e6;
+            total_detection_ms += ms;
+            if (ms > max_detection_ms)
+                max_detection_ms = ms;
+            cnt_detected++;
+        }
+        if (n->disseminated_ns >= 0)
+        {
+            double ms = (n->disseminated_ns - n->kill_ns) / 1e6;
+            total_dissemination_ms += ms;
+            if (ms > max_dissemination_ms)
+                max_dissemination_ms = ms;
+            cnt_disseminated++;
+        }
+        else if (cnt_killed <= 10)
+            printf("Node (%d, %d): still listed by %d nodes\n", n->state.own_tcp_port, n->state.own_udp_port, n->holders);
+    }
+
+    printf("\nFailure detection:\n");
+    if (cnt_detected > 0)
+        printf("Average detection latency: %.1f ms, max %.1f ms (%d/%d kills)\n", total_detection_ms / cnt_detected,
+               max_detection_ms, cnt_detected, cnt_killed);
+    if (cnt_disseminated > 0)
+        printf("Average full dissemination latency: %.1f ms, max %.1f ms (%d/%d kills)\n",
+               total_dissemination_ms / cnt_disseminated, max_dissemination_ms, cnt_disseminated, cnt_killed);
+    printf("False positives: %d by own failure detector, %d received through gossip\n", false_positives_detector,
+           false_positives_gossip);
+    printf("Suspicions of live nodes: %d\n", false_suspicions);
+    printf("Rejoins: %d, %d of them gave up\n", cnt_rejoins, cnt_exits);
+
+    // a node is converged if it lists exactly the live nodes
+    int cnt_converged = 0;
+    for (int i = 0; i < cnt_nodes; i++)
+    {
+        struct member_table *members = &nodes[i].state.members;
+        if (!nodes[i].alive || members->num_peers != cnt_alive - 1)
+            continue;
+
+        int live = 0;
+        for (int m = 0; m < members->num_peers; m++)
+            live += nodes[node_of_udp(members->udp_ports[m])].alive;
+        cnt_converged += live == cnt_alive - 1;
+    }
+    printf("\nConverged nodes: %d/%d\n", cnt_converged, cnt_alive);
+}
+
+double wall_seconds()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+    seed_random(seed);
+
+    double setup_start = wall_seconds();
+    start_cluster();
+    double run_start = wall_seconds();
+
+    long long end_ns = START_NS + (long long)(sim_seconds * 1000000000.);
+    long long kill_ns = START_NS + (long long)(kill_at * 1000000000.);
+    int killed = cnt_kills == 0;
+
+    while (1)
+    {
+        long long node_ns = node_heap_size > 0 ? nodes[node_heap[0]].wake_ns : end_ns + 1;
+        long long flight_ns = flight_heap_size > 0 ? flights[flight_heap[0]].deliver_ns : end_ns + 1;
+        long long next_ns = node_ns < flight_ns ? node_ns : flight_ns;
+
+        if (!killed && kill_ns <= next_ns)
+        {
+            virtual_ns = kill_ns;
+            current = -1;
+            kill_nodes();
+            killed = 1;
+            continue;
+        }
+        if (next_ns > end_ns)
+            break;
+        virtual_ns = next_ns;
+
+        int i;
+        if (flight_ns <= node_ns)
+        {
+            int f = pop_flight();
+            i = current = flights[f].to;
+            deliver(f);
+            free_flights[cnt_free_flights++] = f;
+        }
+        else
+        {
+            i = current = node_heap[0];
+            run_timers(i);
+        }
+
+        if (nodes[i].alive)
+            reschedule(i);
+    }
+    virtual_ns = end_ns;
+
+    report(wall_seconds() - run_start, run_start - setup_start);
+    return 0;
+}
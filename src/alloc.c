@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "alloc.h"
+
+atomic_llong cnt_allocations = 0;
+
+void *mem_alloc(size_t size)
+{
+    atomic_fetch_add_explicit(&cnt_allocations, 1, memory_order_relaxed);
+    void *ptr = malloc(size);
+    if (ptr == NULL && size > 0)
+    {
+        fputs("Out of memory\n", stderr);
+        exit(1);
+    }
+    return ptr;
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&cnt_allocations, 1, memory_order_relaxed);
+    ptr = realloc(ptr, size);
+    if (ptr == NULL && size > 0)
+    {
+        fputs("Out of memory\n", stderr);
+        exit(1);
+    }
+    return ptr;
+}
+
+void mem_free(void *ptr)
+{
+    free(ptr);
+}
+
+long long mem_allocations()
+{
+    return atomic_load_explicit(&cnt_allocations, memory_order_relaxed);
+}
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+size_t align_up(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// overflow blocks start with the link to the previous one
+struct overflow_block
+{
+    void *next;
+    max_align_t data[];
+};
+
+void init_arena(struct arena *arena, size_t capacity)
+{
+    arena->capacity = align_up(capacity);
+    arena->base = (char *)mem_alloc(arena->capacity);
+    arena->used = arena->high_water = 0;
+    arena->overflow = NULL;
+}
+
+void free_arena(struct arena *arena)
+{
+    arena_reset(arena);
+    mem_free(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = align_up(size);
+    arena->high_water += size;
+
+    if (arena->used + size <= arena->capacity)
+    {
+        void *ptr = arena->base + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    struct overflow_block *block = (struct overflow_block *)mem_alloc(sizeof(struct overflow_block) + size);
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return block->data;
+}
+
+void arena_reset(struct arena *arena)
+{
+    while (arena->overflow != NULL)
+    {
+        struct overflow_block *block = (struct overflow_block *)arena->overflow;
+        arena->overflow = block->next;
+        mem_free(block);
+    }
+
+    if (arena->high_water > arena->capacity)
+    {
+        arena->capacity = arena->high_water;
+        mem_free(arena->base);
+        arena->base = (char *)mem_alloc(arena->capacity);
+    }
+    arena->used = arena->high_water = 0;
+}
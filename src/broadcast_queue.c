@@ -0,0 +1,162 @@
+#include <stdlib.h>
+
+#include "broadcast_queue.h"
+#include "alloc.h"
+#include "wire.h"
+
+// Returns 1 if a must be sent before b
+int broadcast_before(const struct broadcast *a, const struct broadcast *b)
+{
+    if (a->transmits != b->transmits)
+        return a->transmits < b->transmits;
+    return a->seq > b->seq;
+}
+
+void place_broadcast(struct broadcast_queue *queue, int pos, struct broadcast b)
+{
+    queue->heap[pos] = b;
+    port_index_put(&queue->by_node, port_key(b.tcp_port, b.udp_port), pos);
+}
+
+void sift_up(struct broadcast_queue *queue, int pos)
+{
+    struct broadcast b = queue->heap[pos];
+    while (pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        if (!broadcast_before(&b, &queue->heap[parent]))
+            break;
+        place_broadcast(queue, pos, queue->heap[parent]);
+        pos = parent;
+    }
+    place_broadcast(queue, pos, b);
+}
+
+void sift_down(struct broadcast_queue *queue, int pos)
+{
+    struct broadcast b = queue->heap[pos];
+    while (1)
+    {
+        int child = 2 * pos + 1;
+        if (child >= queue->size)
+            break;
+        if (child + 1 < queue->size && broadcast_before(&queue->heap[child + 1], &queue->heap[child]))
+            child++;
+        if (!broadcast_before(&queue->heap[child], &b))
+            break;
+        place_broadcast(queue, pos, queue->heap[child]);
+        pos = child;
+    }
+    place_broadcast(queue, pos, b);
+}
+
+void remove_broadcast_at(struct broadcast_queue *queue, int pos)
+{
+    struct broadcast *b = &queue->heap[pos];
+    port_index_remove(&queue->by_node, port_key(b->tcp_port, b->udp_port));
+
+    queue->size--;
+    if (pos == queue->size)
+        return;
+
+    // the last broadcast fills the hole and moves whichever way restores the heap
+    queue->heap[pos] = queue->heap[queue->size];
+    if (pos > 0 && broadcast_before(&queue->heap[pos], &queue->heap[(pos - 1) / 2]))
+        sift_up(queue, pos);
+    else
+        sift_down(queue, pos);
+}
+
+void insert_broadcast(struct broadcast_queue *queue, struct broadcast b)
+{
+    if (queue->size >= queue->capacity)
+    {
+        queue->capacity *= 2;
+        queue->heap = (struct broadcast *)mem_realloc(queue->heap, sizeof(struct broadcast) * queue->capacity);
+    }
+
+    queue->heap[queue->size++] = b;
+    sift_up(queue, queue->size - 1);
+}
+
+void init_broadcast_queue(struct broadcast_queue *queue, int capacity)
+{
+    queue->capacity = capacity > 0 ? capacity : 1;
+    queue->size = 0;
+    queue->heap = (struct broadcast *)mem_alloc(sizeof(struct broadcast) * queue->capacity);
+    queue->next_seq = 0;
+    init_port_index(&queue->by_node, queue->capacity);
+}
+
+void free_broadcast_queue(struct broadcast_queue *queue)
+{
+    mem_free(queue->heap);
+    queue->heap = NULL;
+    queue->capacity = queue->size = 0;
+    free_port_index(&queue->by_node);
+}
+
+void clear_broadcast_queue(struct broadcast_queue *queue)
+{
+    queue->size = 0;
+    clear_port_index(&queue->by_node);
+}
+
+void push_broadcast(struct broadcast_queue *queue, int tcp_port, int udp_port, int status, int incarnation, int transmit_limit)
+{
+    drop_broadcast(queue, tcp_port, udp_port);
+
+    struct broadcast b;
+    b.tcp_port = tcp_port;
+    b.udp_port = udp_port;
+    b.status = status;
+    b.incarnation = incarnation;
+    b.transmits = 0;
+    b.transmit_limit = transmit_limit;
+    b.seq = queue->next_seq++;
+    insert_broadcast(queue, b);
+}
+
+void drop_broadcast(struct broadcast_queue *queue, int tcp_port, int udp_port)
+{
+    int pos = port_index_get(&queue->by_node, port_key(tcp_port, udp_port));
+    if (pos != -1)
+        remove_broadcast_at(queue, pos);
+}
+
+int pack_broadcasts(struct broadcast_queue *queue, struct gossip_message *gossip, int max_updates, int byte_budget)
+{
+    // popped in order, then pushed back with one more transmit
+    struct broadcast packed[UPDATES_PER_MESSAGE];
+    int cnt = 0;
+
+    if (max_updates > UPDATES_PER_MESSAGE - gossip->cnt_updates)
+        max_updates = UPDATES_PER_MESSAGE - gossip->cnt_updates;
+
+    while (cnt < max_updates && queue->size > 0)
+    {
+        struct broadcast *b = &queue->heap[0];
+        int size = wire_update_size(b->incarnation);
+        if (size > byte_budget)
+            break;
+        byte_budget -= size;
+
+        int i = gossip->cnt_updates++;
+        gossip->tcp_ports[i] = b->tcp_port;
+        gossip->udp_ports[i] = b->udp_port;
+        gossip->statuses[i] = b->status;
+        gossip->incarnations[i] = b->incarnation;
+
+        packed[cnt++] = *b;
+        remove_broadcast_at(queue, 0);
+    }
+
+    for (int i = 0; i < cnt; i++)
+    {
+        packed[i].transmits++;
+        if (packed[i].transmits < packed[i].transmit_limit)
+            insert_broadcast(queue, packed[i]);
+    }
+
+    return cnt;
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "domain_lock.h"
+#include "log.h"
+
+// domain locks held by the calling thread
+_Thread_local int cnt_held_locks = 0;
+
+atomic_llong cnt_blocking_under_lock = 0;
+
+void init_domain_lock(struct domain_lock *lock)
+{
+    if (pthread_mutex_init(&lock->mutex, NULL) != 0)
+    {
+        logg(LEVEL_FATAL, "Failed to init state lock");
+        exit(1);
+    }
+    atomic_init(&lock->acquisitions, 0);
+    atomic_init(&lock->contended, 0);
+}
+
+void acquire_domain(struct domain_lock *lock)
+{
+    if (pthread_mutex_trylock(&lock->mutex) != 0)
+    {
+        atomic_fetch_add_explicit(&lock->contended, 1, memory_order_relaxed);
+        pthread_mutex_lock(&lock->mutex);
+    }
+    atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+    cnt_held_locks++;
+}
+
+int try_acquire_domain(struct domain_lock *lock)
+{
+    if (pthread_mutex_trylock(&lock->mutex) != 0)
+    {
+        atomic_fetch_add_explicit(&lock->contended, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+    cnt_held_locks++;
+    return 0;
+}
+
+void release_domain(struct domain_lock *lock)
+{
+    cnt_held_locks--;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+void check_unlocked(const char *what)
+{
+    if (cnt_held_locks == 0)
+        return;
+
+    atomic_fetch_add_explicit(&cnt_blocking_under_lock, 1, memory_order_relaxed);
+    logg(LEVEL_FATAL, "%s while holding %d state locks", what, cnt_held_locks);
+}
+
+long long blocking_under_lock()
+{
+    return atomic_load_explicit(&cnt_blocking_under_lock, memory_order_relaxed);
+}
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+#include "node_manager.h"
+#include "state.h"
+#include "log.h"
+#include "wire.h"
+#include "transport.h"
+#include "constants.h"
+#include "scheduler.h"
+#include "time_utils.h"
+#include "join_server.h"
+
+#define MAX_EVENTS 16
+
+// rejoin states: out of the grace period, a join is connect -> request -> reply header -> members
+#define REJOIN_IDLE 0
+#define REJOIN_WAITING 1
+#define REJOIN_CONNECTING 2
+#define REJOIN_WRITING_REQUEST 3
+#define REJOIN_READING_REPLY 4
+#define REJOIN_READING_MEMBERS 5
+
+int loop_epoll_fd = -1;
+
+// the connection to the gateway of a rejoin, fd -1 unless the exchange runs
+struct join_connection rejoin;
+int rejoin_fd = -1; // fires when the grace period ends, then at the deadline of the exchange
+struct join_member *rejoin_members;
+
+int create_timer()
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to create timerfd");
+        exit(1);
+    }
+    return fd;
+}
+
+// Arms fd to fire at the timer's absolute deadlines; the kernel keeps them drift-free
+void arm_timer(int fd, struct periodic_timer *timer)
+{
+    struct itimerspec spec;
+    spec.it_value.tv_sec = timer->next_ns / 1000000000ll;
+    spec.it_value.tv_nsec = timer->next_ns % 1000000000ll;
+    spec.it_interval.tv_sec = timer->period_ns / 1000000000ll;
+    spec.it_interval.tv_nsec = timer->period_ns % 1000000000ll;
+
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to arm timerfd");
+        exit(1);
+    }
+}
+
+// One-shot at an absolute deadline, or disarmed if deadline_ns is -1
+void arm_deadline(int fd, long long deadline_ns)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (deadline_ns != -1)
+    {
+        // a zero it_value would disarm, a deadline in the past fires at once
+        if (deadline_ns < 1)
+            deadline_ns = 1;
+        spec.it_value.tv_sec = deadline_ns / 1000000000ll;
+        spec.it_value.tv_nsec = deadline_ns % 1000000000ll;
+    }
+
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to arm timerfd");
+        exit(1);
+    }
+}
+
+// Returns how many times the timer expired since it was last read
+long long read_timer(int fd)
+{
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+    return (long long)expirations;
+}
+
+void update_watch(int epoll_fd, int op, int fd, unsigned int events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to update the epoll set for fd %d", fd);
+        exit(1);
+    }
+}
+
+void watch_fd(int epoll_fd, int fd)
+{
+    update_watch(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLIN);
+}
+
+void drain_transport()
+{
+    struct datagram received[MAX_RECV_BATCH];
+    while (1)
+    {
+        int cnt = recv_datagrams(&state.transport, received, MAX_RECV_BATCH, 0);
+        if (cnt <= 0)
+        {
+            if (cnt < 0)
+                logg(LEVEL_DBG, "Error occured while receiving UDP message. Resuming listening...");
+            return;
+        }
+
+        handle_datagrams(received, cnt);
+    }
+}
+
+void start_rejoin()
+{
+    if (rejoin.state != REJOIN_IDLE)
+        return;
+
+    prepare_rejoin(&state);
+    rejoin.state = REJOIN_WAITING;
+    arm_deadline(rejoin_fd, atomic_load(&state.grace_period_until));
+}
+
+// Like the blocking join, a rejoin whose gateway fails gives up and exits
+void fail_rejoin(const char *what)
+{
+    logg(LEVEL_FATAL, "%s, rejoin via %d failed", what, rejoin.peer_tcp_port);
+    exit(1);
+}
+
+void connect_gateway()
+{
+    int tcp_gateway, udp_gateway;
+    if (pick_gateway(&tcp_gateway, &udp_gateway) < 0)
+    {
+        logg(LEVEL_FATAL, "No peer to connect to");
+        rejoin.state = REJOIN_IDLE;
+        return;
+    }
+
+    logg(LEVEL_INFO, "Rejoining via %d-%d", tcp_gateway, udp_gateway);
+    rejoin.peer_tcp_port = tcp_gateway;
+    rejoin.fd = connect_stream(&state.transport, tcp_gateway, 1);
+    if (rejoin.fd < 0)
+        fail_rejoin("Error connecting to server TCP gateway socket");
+
+    rejoin.state = REJOIN_CONNECTING;
+    arm_deadline(rejoin_fd, now_ns() + (long long)(JOIN_CONNECTION_TIMEOUT * 1000000000.));
+    update_watch(loop_epoll_fd, EPOLL_CTL_ADD, rejoin.fd, EPOLLOUT);
+}
+
+// Moves the rejoin on once the transfer of its current state completed
+// Returns 1 once the rejoin is done
+int step_rejoin()
+{
+    switch (rejoin.state)
+    {
+    case REJOIN_CONNECTING:
+        fill_join_request(&rejoin.request);
+        queue_output(&rejoin, &rejoin.request, sizeof(rejoin.request), NULL, 0);
+        rejoin.state = REJOIN_WRITING_REQUEST;
+        return 0;
+
+    case REJOIN_WRITING_REQUEST:
+        memset(&rejoin.reply, 0, sizeof(rejoin.reply));
+        expect_input(&rejoin, &rejoin.reply, sizeof(rejoin.reply));
+        rejoin.state = REJOIN_READING_REPLY;
+        return 0;
+
+    case REJOIN_READING_REPLY:
+        if (rejoin.reply.num_peers < 0 || rejoin.reply.num_peers > MAX_JOIN_PEERS)
+            fail_rejoin("Did not receive join reply");
+
+        rejoin_members = alloc_join_members(rejoin.reply.num_peers);
+        expect_input(&rejoin, rejoin_members, (long long)sizeof(struct join_member) * rejoin.reply.num_peers);
+        rejoin.state = REJOIN_READING_MEMBERS;
+        return 0;
+
+    case REJOIN_READING_MEMBERS:
+        close(rejoin.fd); // also leaves the epoll set
+        rejoin.fd = -1;
+        rejoin.state = REJOIN_IDLE;
+        arm_deadline(rejoin_fd, -1);
+        adopt_join_reply(&rejoin.reply, rejoin_members);
+        return 1;
+    }
+
+    return 1;
+}
+
+// Runs the rejoin exchange until its socket would block or it is done
+void advance_rejoin()
+{
+    while (1)
+    {
+        int ret;
+        if (rejoin.state == REJOIN_CONNECTING)
+            ret = finish_connect(&rejoin);
+        else if (rejoin.state == REJOIN_WRITING_REQUEST)
+            ret = flush_output(&rejoin);
+        else
+            ret = fill_input(&rejoin);
+
+        if (ret < 0)
+            fail_rejoin("Join exchange broke off");
+        if (ret == 0)
+        {
+            update_watch(loop_epoll_fd, EPOLL_CTL_MOD, rejoin.fd, rejoin.state == REJOIN_WRITING_REQUEST ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        if (step_rejoin())
+            return;
+    }
+}
+
+void run_event_loop(void (*report)(void))
+{
+    int epoll_fd = loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to create epoll instance");
+        exit(1);
+    }
+
+    struct join_server join_server;
+    init_join_server(&join_server, open_tcp_listener());
+    int udp_fd = state.transport.fd;
+    struct periodic_timer report_timer;
+    init_periodic_timer(&state.probe_timer, PROBE_PERIOD, now_ns());
+    init_periodic_timer(&state.gossip_timer, GOSSIP_PERIOD, now_ns());
+    init_periodic_timer(&report_timer, 1., now_ns());
+
+    int probe_fd = create_timer();
+    int deadline_fd = create_timer(); // timeouts of the current probe
+    int gossip_fd = create_timer();
+    int report_fd = create_timer();
+    rejoin_fd = create_timer();
+    rejoin.fd = -1;
+    rejoin.state = REJOIN_IDLE;
+    arm_timer(probe_fd, &state.probe_timer);
+    arm_timer(gossip_fd, &state.gossip_timer);
+    arm_timer(report_fd, &report_timer);
+
+    watch_fd(epoll_fd, join_server.epoll_fd);
+    watch_fd(epoll_fd, udp_fd);
+    watch_fd(epoll_fd, probe_fd);
+    watch_fd(epoll_fd, deadline_fd);
+    watch_fd(epoll_fd, gossip_fd);
+    watch_fd(epoll_fd, report_fd);
+    watch_fd(epoll_fd, rejoin_fd);
+
+    logg(LEVEL_INFO, "Started event loop...");
+
+    while (1)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int cnt_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (cnt_events < 0)
+        {
+            if (errno != EINTR)
+                logg(LEVEL_DBG, "epoll_wait failed. Resuming...");
+            continue;
+        }
+
+        for (int i = 0; i < cnt_events; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == udp_fd)
+            {
+                drain_transport();
+            }
+            else if (fd == join_server.epoll_fd)
+            {
+                run_join_server(&join_server, 0);
+            }
+            else if (fd == probe_fd)
+            {
+                record_timer_ticks(&state.probe_timer, now_ns(), read_timer(probe_fd));
+
+                // rounds only run once a rejoin is through and the grace period after it is over
+                if (rejoin.state != REJOIN_IDLE || get_remaining_grace_period(&state) > 0)
+                    continue;
+
+                long long period_ns = state.probe_timer.period_ns;
+                start_probe_round(&state);
+                arm_deadline(deadline_fd, next_probe_deadline(&state));
+
+                // local health may have stretched or shrunk the probe round
+                if (state.probe_timer.period_ns != period_ns)
+                    arm_timer(probe_fd, &state.probe_timer);
+            }
+            else if (fd == deadline_fd)
+            {
+                read_timer(deadline_fd);
+                run_probe_deadlines(&state);
+                arm_deadline(deadline_fd, next_probe_deadline(&state));
+            }
+            else if (fd == gossip_fd)
+            {
+                record_timer_ticks(&state.gossip_timer, now_ns(), read_timer(gossip_fd));
+                if (rejoin.state == REJOIN_IDLE && get_remaining_grace_period(&state) <= 0)
+                    gossip_changes(&state);
+            }
+            else if (fd == rejoin_fd)
+            {
+                read_timer(rejoin_fd);
+                if (rejoin.state == REJOIN_WAITING)
+                    connect_gateway();
+                else if (rejoin.state != REJOIN_IDLE)
+                    fail_rejoin("Join exchange timed out");
+            }
+            else if (fd == rejoin.fd)
+            {
+                advance_rejoin();
+            }
+            else if (fd == report_fd)
+            {
+                record_timer_ticks(&report_timer, now_ns(), read_timer(report_fd));
+                if (report != NULL)
+                    report();
+            }
+        }
+    }
+}
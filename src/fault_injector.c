@@ -0,0 +1,390 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "transport.h"
+#include "wire.h"
+#include "time_utils.h"
+#include "random.h"
+#include "alloc.h"
+#include "log.h"
+
+// datagrams held back for their delay, further ones are dropped
+#define MAX_HELD_DATAGRAMS 1024
+
+struct held_datagram
+{
+    long long due_ns, seq;
+    int from, len;
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+};
+
+struct fault_injector
+{
+    struct transport inner;
+    struct fault_config config;
+    long long partition_from_ns, partition_until_ns; // until is -1 for good
+
+    // held datagrams as a min-heap of slots by (due_ns, seq)
+    struct held_datagram held[MAX_HELD_DATAGRAMS];
+    int heap[MAX_HELD_DATAGRAMS], heap_size;
+    int free_slots[MAX_HELD_DATAGRAMS], cnt_free;
+    long long next_seq;
+
+    // returned by the last receive, freed by the next one
+    int leased[MAX_RECV_BATCH], cnt_leased;
+
+    // the wrapper's fd is an epoll set of the inner fd and of this timer,
+    // which fires when the earliest held datagram is due
+    int due_fd;
+};
+
+int held_before(struct fault_injector *faults, int a, int b)
+{
+    if (faults->held[a].due_ns != faults->held[b].due_ns)
+        return faults->held[a].due_ns < faults->held[b].due_ns;
+    return faults->held[a].seq < faults->held[b].seq;
+}
+
+void push_held(struct fault_injector *faults, int slot)
+{
+    int pos = faults->heap_size++;
+    while (pos > 0 && held_before(faults, slot, faults->heap[(pos - 1) / 2]))
+    {
+        faults->heap[pos] = faults->heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    faults->heap[pos] = slot;
+}
+
+int pop_held(struct fault_injector *faults)
+{
+    int top = faults->heap[0];
+    int slot = faults->heap[--faults->heap_size];
+    int pos = 0;
+    while (1)
+    {
+        int child = 2 * pos + 1;
+        if (child >= faults->heap_size)
+            break;
+        if (child + 1 < faults->heap_size && held_before(faults, faults->heap[child + 1], faults->heap[child]))
+            child++;
+        if (!held_before(faults, faults->heap[child], slot))
+            break;
+        faults->heap[pos] = faults->heap[child];
+        pos = child;
+    }
+    if (faults->heap_size > 0)
+        faults->heap[pos] = slot;
+    return top;
+}
+
+int is_partitioned(struct fault_injector *faults, int udp_port)
+{
+    long long ns = now_ns();
+    if (ns < faults->partition_from_ns || (faults->partition_until_ns >= 0 && ns >= faults->partition_until_ns))
+        return 0;
+
+    for (int i = 0; i < faults->config.cnt_partitioned; i++)
+        if (faults->config.partitioned_ports[i] == udp_port)
+            return 1;
+    return 0;
+}
+
+// Drops d, or holds a copy of it until its delay has passed
+void admit(struct fault_injector *faults, struct datagram *d)
+{
+    struct fault_config *config = &faults->config;
+    if (is_partitioned(faults, d->udp_port) || (config->loss > 0 && random_unit() < config->loss))
+        return;
+    if (faults->cnt_free == 0 || d->len > MAX_DATAGRAM_SIZE)
+        return;
+
+    double delay_ms = config->min_delay_ms + random_unit() * (config->max_delay_ms - config->min_delay_ms);
+    if (config->reorder > 0 && random_unit() < config->reorder)
+        delay_ms += random_unit() * (config->max_delay_ms + 1.);
+
+    int slot = faults->free_slots[--faults->cnt_free];
+    struct held_datagram *h = &faults->held[slot];
+    h->due_ns = now_ns() + (long long)(delay_ms * 1000000.);
+    h->seq = faults->next_seq++;
+    h->from = d->udp_port;
+    h->len = d->len;
+    memcpy(h->buf, d->buf, d->len);
+    push_held(faults, slot);
+}
+
+// Outgoing datagrams only go through the partition, loss and delay apply on receipt
+int faulty_send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    struct fault_injector *faults = (struct fault_injector *)transport->impl;
+    struct datagram passed[MAX_SEND_BATCH];
+
+    for (int start = 0; start < cnt; start += MAX_SEND_BATCH)
+    {
+        int cnt_passed = 0;
+        for (int i = start; i < cnt && i < start + MAX_SEND_BATCH; i++)
+            if (!is_partitioned(faults, datagrams[i].udp_port))
+                passed[cnt_passed++] = datagrams[i];
+        if (cnt_passed > 0)
+            send_datagrams(&faults->inner, passed, cnt_passed);
+    }
+    return cnt;
+}
+
+// Arms due_fd for the earliest held datagram, or disarms it
+void arm_due_timer(struct fault_injector *faults)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (faults->heap_size > 0)
+    {
+        long long due_ns = faults->held[faults->heap[0]].due_ns;
+        if (due_ns < 1)
+            due_ns = 1;
+        spec.it_value.tv_sec = due_ns / 1000000000ll;
+        spec.it_value.tv_nsec = due_ns % 1000000000ll;
+    }
+    if (timerfd_settime(faults->due_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+        logg(LEVEL_DBG, "Failed to arm the fault injector timer");
+}
+
+int faulty_recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms)
+{
+    struct fault_injector *faults = (struct fault_injector *)transport->impl;
+    if (max > MAX_RECV_BATCH)
+        max = MAX_RECV_BATCH;
+
+    for (int i = 0; i < faults->cnt_leased; i++)
+        faults->free_slots[faults->cnt_free++] = faults->leased[i];
+    faults->cnt_leased = 0;
+
+    uint64_t expirations;
+    if (read(faults->due_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        logg(LEVEL_DBG, "Failed to reset the fault injector timer");
+
+    long long deadline_ns = timeout_ms < 0 ? -1 : now_ns() + timeout_ms * 1000000ll;
+    int polled = 0;
+    while (1)
+    {
+        long long ns = now_ns();
+        int cnt = 0;
+        while (cnt < max && faults->heap_size > 0 && faults->held[faults->heap[0]].due_ns <= ns)
+        {
+            int slot = pop_held(faults);
+            faults->leased[faults->cnt_leased++] = slot;
+            out[cnt].udp_port = faults->held[slot].from;
+            out[cnt].buf = faults->held[slot].buf;
+            out[cnt].len = faults->held[slot].len;
+            cnt++;
+        }
+        if (cnt > 0 || (polled && deadline_ns >= 0 && deadline_ns <= ns))
+        {
+            arm_due_timer(faults);
+            return cnt;
+        }
+
+        // wait for the inner transport, no longer than until the next held datagram is due
+        long long wait_until_ns = deadline_ns;
+        if (faults->heap_size > 0 && (wait_until_ns < 0 || faults->held[faults->heap[0]].due_ns < wait_until_ns))
+            wait_until_ns = faults->held[faults->heap[0]].due_ns;
+        int wait_ms = -1;
+        if (wait_until_ns >= 0)
+            wait_ms = wait_until_ns <= ns ? 0 : (int)((wait_until_ns - ns + 999999) / 1000000);
+
+        struct datagram received[MAX_RECV_BATCH];
+        int cnt_received = recv_datagrams(&faults->inner, received, MAX_RECV_BATCH, wait_ms);
+        polled = 1;
+        if (cnt_received < 0)
+        {
+            arm_due_timer(faults);
+            return -1;
+        }
+        for (int i = 0; i < cnt_received; i++)
+            admit(faults, &received[i]);
+    }
+}
+
+int faulty_listen_stream(struct transport *transport, int tcp_port)
+{
+    return listen_stream(&((struct fault_injector *)transport->impl)->inner, tcp_port);
+}
+
+int faulty_connect_stream(struct transport *transport, int tcp_port, int nonblocking)
+{
+    return connect_stream(&((struct fault_injector *)transport->impl)->inner, tcp_port, nonblocking);
+}
+
+int faulty_accept_stream(struct transport *transport, int listener_fd)
+{
+    return accept_stream(&((struct fault_injector *)transport->impl)->inner, listener_fd);
+}
+
+// Shards get their own injector with the same faults
+int faulty_open_shard(struct transport *transport, struct transport *shard)
+{
+    struct fault_injector *faults = (struct fault_injector *)transport->impl;
+    struct transport inner_shard;
+    if (open_shard(&faults->inner, &inner_shard) < 0)
+        return -1;
+    init_fault_injector(shard, &inner_shard, &faults->config);
+    return 0;
+}
+
+void faulty_close(struct transport *transport)
+{
+    struct fault_injector *faults = (struct fault_injector *)transport->impl;
+    close_transport(&faults->inner);
+    close(faults->due_fd);
+    close(transport->fd);
+    mem_free(faults);
+    transport->impl = NULL;
+    transport->fd = -1;
+}
+
+const struct transport_ops fault_injector_ops = {
+    faulty_send_datagrams,
+    faulty_recv_datagrams,
+    faulty_listen_stream,
+    faulty_connect_stream,
+    faulty_accept_stream,
+    faulty_close,
+    faulty_open_shard,
+};
+
+void init_fault_injector(struct transport *transport, struct transport *inner, const struct fault_config *config)
+{
+    struct fault_injector *faults = (struct fault_injector *)mem_alloc(sizeof(struct fault_injector));
+    faults->inner = *inner;
+    faults->config = *config;
+
+    long long ns = now_ns();
+    faults->partition_from_ns = ns + (long long)(config->partition_from * 1000000000.);
+    faults->partition_until_ns = config->partition_until < 0 ? -1 : ns + (long long)(config->partition_until * 1000000000.);
+
+    faults->heap_size = faults->cnt_leased = 0;
+    faults->next_seq = 0;
+    faults->cnt_free = 0;
+    for (int slot = MAX_HELD_DATAGRAMS - 1; slot >= 0; slot--)
+        faults->free_slots[faults->cnt_free++] = slot;
+
+    faults->due_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (faults->due_fd < 0 || epoll_fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to set up the fault injector");
+        exit(1);
+    }
+
+    int watched[2] = {inner->fd, faults->due_fd};
+    for (int i = 0; i < 2; i++)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = watched[i];
+        if (watched[i] >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched[i], &ev) < 0)
+        {
+            logg(LEVEL_FATAL, "Failed to set up the fault injector");
+            exit(1);
+        }
+    }
+
+    transport->ops = &fault_injector_ops;
+    transport->udp_port = inner->udp_port;
+    transport->fd = epoll_fd;
+    transport->impl = faults;
+}
+
+// Parses "MIN-MAX" or a single value into both
+int parse_fault_range(const char *value, double *min, double *max)
+{
+    char *end;
+    *min = strtod(value, &end);
+    if (end == value)
+        return -1;
+    if (*end == '-')
+    {
+        const char *rest = end + 1;
+        *max = strtod(rest, &end);
+        if (end == rest)
+            return -1;
+    }
+    else
+        *max = *min;
+    return *end == '\0' ? 0 : -1;
+}
+
+int parse_partitioned_ports(const char *value, struct fault_config *config)
+{
+    config->cnt_partitioned = 0;
+    const char *p = value;
+    while (*p != '\0')
+    {
+        char *end;
+        long port = strtol(p, &end, 10);
+        if (end == p || port <= 0 || port > 65535 || config->cnt_partitioned == MAX_PARTITIONED_PORTS)
+            return -1;
+        config->partitioned_ports[config->cnt_partitioned++] = (int)port;
+        p = *end == '+' ? end + 1 : end;
+        if (*end != '+' && *end != '\0')
+            return -1;
+    }
+    return 0;
+}
+
+int parse_fault_config(const char *spec, struct fault_config *config)
+{
+    char buf[1024];
+    if (strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf, spec);
+
+    int partitioned = 0, timed = 0;
+    for (char *field = strtok(buf, ","); field != NULL; field = strtok(NULL, ","))
+    {
+        char *value = strchr(field, '=');
+        if (value == NULL)
+            return -1;
+        *value++ = '\0';
+
+        double unused;
+        int ret = -1;
+        if (strcmp(field, "loss") == 0)
+            ret = parse_fault_range(value, &config->loss, &unused);
+        else if (strcmp(field, "delay") == 0)
+            ret = parse_fault_range(value, &config->min_delay_ms, &config->max_delay_ms);
+        else if (strcmp(field, "reorder") == 0)
+            ret = parse_fault_range(value, &config->reorder, &unused);
+        else if (strcmp(field, "partition") == 0)
+        {
+            ret = parse_partitioned_ports(value, config);
+            partitioned = 1;
+        }
+        else if (strcmp(field, "partition_at") == 0)
+        {
+            timed = 1;
+            ret = parse_fault_range(value, &config->partition_from, &config->partition_until);
+            if (ret == 0 && strchr(value, '-') == NULL)
+                config->partition_until = -1;
+        }
+        if (ret < 0)
+            return -1;
+    }
+
+    if (partitioned && !timed)
+    {
+        config->partition_from = 0;
+        config->partition_until = -1;
+    }
+
+    if (config->loss < 0 || config->loss > 1 || config->reorder < 0 || config->reorder > 1 || config->min_delay_ms < 0 ||
+        config->max_delay_ms < config->min_delay_ms)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "join_server.h"
+#include "node_manager.h"
+#include "state.h"
+#include "log.h"
+#include "constants.h"
+#include "random.h"
+#include "time_utils.h"
+
+#define MAX_JOIN_EVENTS 64
+
+// epoll tags beyond the connection slots
+#define LISTENER_TAG MAX_JOIN_CONNECTIONS
+#define TIMER_TAG (MAX_JOIN_CONNECTIONS + 1)
+#define SYNC_TAG (MAX_JOIN_CONNECTIONS + 2)
+
+void release_snapshot(struct member_snapshot *snapshot)
+{
+    if (snapshot != NULL && --snapshot->refs == 0)
+        mem_free(snapshot);
+}
+
+// Returns a reference to a snapshot at most JOIN_SNAPSHOT_MAX_AGE old
+struct member_snapshot *share_snapshot(struct join_server *server)
+{
+    if (server->snapshot == NULL || now_ns() - server->snapshot->taken_ns > JOIN_SNAPSHOT_MAX_AGE * 1000000000.)
+    {
+        release_snapshot(server->snapshot);
+        server->snapshot = take_member_snapshot(&state);
+    }
+
+    server->snapshot->refs++;
+    return server->snapshot;
+}
+
+void watch(struct join_server *server, int op, int fd, unsigned int events, uint64_t tag)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = tag;
+
+    if (epoll_ctl(server->epoll_fd, op, fd, &ev) < 0)
+        logg(LEVEL_FATAL, "Failed to update the join server epoll set for fd %d", fd);
+}
+
+// Absolute one-shot, or disarmed if deadline_ns is -1
+void arm_at(int fd, long long deadline_ns)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (deadline_ns != -1)
+    {
+        if (deadline_ns < 1)
+            deadline_ns = 1;
+        spec.it_value.tv_sec = deadline_ns / 1000000000ll;
+        spec.it_value.tv_nsec = deadline_ns % 1000000000ll;
+    }
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+int is_writing(int conn_state)
+{
+    return conn_state == JOIN_WRITING_REPLY || conn_state == SYNC_WRITING_REPLY ||
+           conn_state == SYNC_WRITING_REQUEST || conn_state == SYNC_WRITING_ENTRIES || conn_state == SYNC_CONNECTING;
+}
+
+int is_sync(int conn_state)
+{
+    return conn_state != JOIN_READING_REQUEST && conn_state != JOIN_WRITING_REPLY;
+}
+
+void close_connection(struct join_server *server, int i)
+{
+    struct join_connection *conn = &server->connections[i];
+    close(conn->fd); // also leaves the epoll set
+    release_snapshot(conn->snapshot);
+    conn->snapshot = NULL;
+    conn->fd = -1;
+
+    if (is_sync(conn->state))
+    {
+        if (conn->outbound)
+            server->outbound_sync = 0;
+        if (--server->cnt_syncs == 0)
+            arena_reset(&server->sync_scratch);
+    }
+
+    // a slot freed up, accept again
+    if (server->cnt_connections-- == MAX_JOIN_CONNECTIONS)
+        watch(server, EPOLL_CTL_MOD, server->listener_fd, EPOLLIN, LISTENER_TAG);
+}
+
+// Returns the slot given to fd, or -1 if every slot is taken
+int claim_slot(struct join_server *server, int fd, int conn_state, int outbound)
+{
+    if (server->cnt_connections == MAX_JOIN_CONNECTIONS)
+        return -1;
+
+    int i = 0;
+    while (server->connections[i].fd != -1)
+        i++;
+
+    struct join_connection *conn = &server->connections[i];
+    conn->fd = fd;
+    conn->state = conn_state;
+    conn->outbound = outbound;
+    conn->deadline_ns = now_ns() + (long long)(JOIN_CONNECTION_TIMEOUT * 1000000000.);
+    conn->snapshot = NULL;
+    server->cnt_connections++;
+    if (is_sync(conn_state))
+        server->cnt_syncs++;
+
+    watch(server, EPOLL_CTL_ADD, fd, is_writing(conn_state) ? EPOLLOUT : EPOLLIN, i);
+
+    // full, leave further joiners in the backlog until a slot frees up
+    if (server->cnt_connections == MAX_JOIN_CONNECTIONS)
+        watch(server, EPOLL_CTL_MOD, server->listener_fd, 0, LISTENER_TAG);
+    return i;
+}
+
+void expect_input(struct join_connection *conn, void *buf, long long len)
+{
+    conn->in = (char *)buf;
+    conn->in_len = len;
+    conn->received = 0;
+}
+
+void queue_output(struct join_connection *conn, const void *first, long long first_len, const void *second, long long second_len)
+{
+    conn->out[0] = (const char *)first;
+    conn->out_len[0] = first_len;
+    conn->out[1] = (const char *)second;
+    conn->out_len[1] = second_len;
+    conn->sent = 0;
+}
+
+// Both return 1 once the transfer completed, 0 if the socket would block, -1 on failure
+int fill_input(struct join_connection *conn)
+{
+    while (conn->received < conn->in_len)
+    {
+        ssize_t ret = recv(conn->fd, conn->in + conn->received, conn->in_len - conn->received, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (ret <= 0)
+            return -1;
+        conn->received += ret;
+    }
+    return 1;
+}
+
+int flush_output(struct join_connection *conn)
+{
+    long long total = conn->out_len[0] + conn->out_len[1];
+    while (conn->sent < total)
+    {
+        struct iovec iov[2];
+        int cnt_iov = 0;
+        if (conn->sent < conn->out_len[0])
+        {
+            iov[cnt_iov].iov_base = (char *)conn->out[0] + conn->sent;
+            iov[cnt_iov++].iov_len = conn->out_len[0] - conn->sent;
+            if (conn->out_len[1] > 0)
+            {
+                iov[cnt_iov].iov_base = (char *)conn->out[1];
+                iov[cnt_iov++].iov_len = conn->out_len[1];
+            }
+        }
+        else
+        {
+            iov[cnt_iov].iov_base = (char *)conn->out[1] + (conn->sent - conn->out_len[0]);
+            iov[cnt_iov++].iov_len = total - conn->sent;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt_iov;
+
+        ssize_t ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (ret < 0)
+            return -1;
+        conn->sent += ret;
+    }
+    return 1;
+}
+
+int finish_connect(struct join_connection *conn)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        return -1;
+    return 1;
+}
+
+// Sets up reading the count and entries a sync peer sends, -1 if the count is not plausible
+int expect_entries(struct join_server *server, struct join_connection *conn, int cnt_entries)
+{
+    if (cnt_entries < 0 || cnt_entries > MAX_SYNC_ENTRIES)
+        return -1;
+
+    conn->cnt_entries = cnt_entries;
+    conn->entries = (struct sync_entry *)arena_alloc(&server->sync_scratch, sizeof(struct sync_entry) * (cnt_entries + 1));
+    expect_input(conn, conn->entries, (long long)sizeof(struct sync_entry) * cnt_entries);
+    conn->state = SYNC_READING_ENTRIES;
+    return 0;
+}
+
+void finish_sync(struct join_server *server, int i)
+{
+    struct join_connection *conn = &server->connections[i];
+    logg(LEVEL_DBG, "Synced with %d: received %d entries, sent %d", conn->peer_tcp_port, conn->cnt_entries, conn->cnt_own_entries);
+
+    apply_sync_entries(&state, conn->entries, conn->cnt_entries);
+    close_connection(server, i);
+}
+
+// Moves a connection on once the transfer of its current state completed
+// Returns 1 if the connection is done and was closed
+int step(struct join_server *server, int i)
+{
+    struct join_connection *conn = &server->connections[i];
+
+    switch (conn->state)
+    {
+    case JOIN_READING_REQUEST:
+        conn->peer_tcp_port = conn->request.tcp_port;
+        if (conn->request.type == TCP_SYNC)
+        {
+            server->cnt_syncs++;
+            expect_input(conn, &conn->digest, sizeof(conn->digest));
+            conn->state = SYNC_READING_DIGEST;
+            return 0;
+        }
+
+        logg(LEVEL_DBG, "Received join request from %d-%d", conn->request.tcp_port, conn->request.udp_port);
+        memset(&conn->reply, 0, sizeof(conn->reply));
+        conn->reply.incarnation = admission_incarnation(&state, conn->request.tcp_port, conn->request.udp_port, conn->request.incarnation);
+        remv_peer(&state, conn->request.tcp_port, conn->request.udp_port); // remove node if previously among peers
+
+        // the snapshot may still list the joiner, it skips itself
+        conn->snapshot = share_snapshot(server);
+        conn->reply.num_peers = conn->snapshot->num_members;
+        queue_output(conn, &conn->reply, sizeof(conn->reply), conn->snapshot->members, (long long)sizeof(struct join_member) * conn->snapshot->num_members);
+        conn->state = JOIN_WRITING_REPLY;
+        return 0;
+
+    case JOIN_WRITING_REPLY:
+    {
+        struct join_request request = conn->request;
+        int incarnation = conn->reply.incarnation;
+        logg(LEVEL_DBG, "Sent join reply successfully with %d peers", conn->reply.num_peers);
+        close_connection(server, i);
+
+        append_member(&state, request.tcp_port, request.udp_port, incarnation);
+        append_broadcast(&state, request.tcp_port, request.udp_port, MEMBER_ALIVE, incarnation);
+        return 1;
+    }
+
+    case SYNC_READING_DIGEST:
+        conn->cnt_own_entries = collect_sync_entries(&state, &conn->digest, &conn->sync_reply.digest, &server->sync_scratch, &conn->own_entries);
+        conn->sync_reply.cnt_entries = conn->cnt_own_entries;
+        queue_output(conn, &conn->sync_reply, sizeof(conn->sync_reply), conn->own_entries, (long long)sizeof(struct sync_entry) * conn->cnt_own_entries);
+        conn->state = SYNC_WRITING_REPLY;
+        return 0;
+
+    case SYNC_WRITING_REPLY:
+        expect_input(conn, &conn->cnt_entries, sizeof(conn->cnt_entries));
+        conn->state = SYNC_READING_COUNT;
+        return 0;
+
+    case SYNC_READING_COUNT:
+        if (expect_entries(server, conn, conn->cnt_entries) < 0)
+        {
+            close_connection(server, i);
+            return 1;
+        }
+        return 0;
+
+    case SYNC_READING_ENTRIES:
+    {
+        if (!conn->outbound)
+        {
+            finish_sync(server, i);
+            return 1;
+        }
+
+        // push back whatever differs from the responder's digest
+        struct sync_digest ours;
+        conn->cnt_own_entries = collect_sync_entries(&state, &conn->sync_reply.digest, &ours, &server->sync_scratch, &conn->own_entries);
+        queue_output(conn, &conn->cnt_own_entries, sizeof(conn->cnt_own_entries), conn->own_entries, (long long)sizeof(struct sync_entry) * conn->cnt_own_entries);
+        conn->state = SYNC_WRITING_ENTRIES;
+        return 0;
+    }
+
+    case SYNC_CONNECTING:
+        memset(&conn->request, 0, sizeof(conn->request));
+        conn->request.type = TCP_SYNC;
+        conn->request.tcp_port = state.own_tcp_port;
+        conn->request.udp_port = state.own_udp_port;
+        struct member_view *view = enter_member_view(&state);
+        conn->request.incarnation = view->own_incarnation;
+        leave_member_view(view);
+        sync_digest(&state, &conn->digest);
+        queue_output(conn, &conn->request, sizeof(conn->request), &conn->digest, sizeof(conn->digest));
+        conn->state = SYNC_WRITING_REQUEST;
+        return 0;
+
+    case SYNC_WRITING_REQUEST:
+        expect_input(conn, &conn->sync_reply, sizeof(conn->sync_reply));
+        conn->state = SYNC_READING_REPLY;
+        return 0;
+
+    case SYNC_READING_REPLY:
+        if (expect_entries(server, conn, conn->sync_reply.cnt_entries) < 0)
+        {
+            close_connection(server, i);
+            return 1;
+        }
+        return 0;
+
+    case SYNC_WRITING_ENTRIES:
+        finish_sync(server, i);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Runs a connection until its socket would block or it is done
+void advance(struct join_server *server, int i)
+{
+    struct join_connection *conn = &server->connections[i];
+    while (1)
+    {
+        int ret;
+        if (conn->state == SYNC_CONNECTING)
+            ret = finish_connect(conn);
+        else if (is_writing(conn->state))
+            ret = flush_output(conn);
+        else
+            ret = fill_input(conn);
+
+        if (ret < 0)
+        {
+            logg(LEVEL_DBG, "TCP exchange with %d failed. Resuming listening...", conn->peer_tcp_port);
+            close_connection(server, i);
+            return;
+        }
+        if (ret == 0)
+        {
+            watch(server, EPOLL_CTL_MOD, conn->fd, is_writing(conn->state) ? EPOLLOUT : EPOLLIN, i);
+            return;
+        }
+        if (step(server, i))
+            return;
+    }
+}
+
+void accept_connections(struct join_server *server)
+{
+    while (server->cnt_connections < MAX_JOIN_CONNECTIONS)
+    {
+        int fd = accept_stream(&state.transport, server->listener_fd);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logg(LEVEL_DBG, "Failed to accept connection. Resume listening...");
+            return;
+        }
+
+        int i = claim_slot(server, fd, JOIN_READING_REQUEST, 0);
+        struct join_connection *conn = &server->connections[i];
+        conn->peer_tcp_port = -1;
+        memset(&conn->request, 0, sizeof(conn->request));
+        expect_input(conn, &conn->request, sizeof(conn->request));
+    }
+}
+
+// Sync period, stretched for large clusters the way gossip rounds are
+long long sync_period_ns()
+{
+    struct member_view *view = enter_member_view(&state);
+    int num_peers = view->num_peers;
+    leave_member_view(view);
+
+    double scale = 1.;
+    if (num_peers > SYNC_SCALE_THRESHOLD)
+        scale += ceil(log2(num_peers) - log2(SYNC_SCALE_THRESHOLD));
+    return (long long)(SYNC_PERIOD * scale * 1000000000.);
+}
+
+// Opens a sync with a random member, unless one is still running or the node is in its grace period
+void start_sync(struct join_server *server)
+{
+    arm_at(server->sync_fd, now_ns() + sync_period_ns());
+
+    if (server->outbound_sync || get_remaining_grace_period(&state) > 0)
+        return;
+    int tcp_port = pick_sync_peer(&state);
+    if (tcp_port == -1)
+        return;
+
+    int fd = connect_stream(&state.transport, tcp_port, 1);
+    if (fd < 0)
+    {
+        logg(LEVEL_DBG, "Failed to connect to %d for a sync", tcp_port);
+        return;
+    }
+
+    int i = claim_slot(server, fd, SYNC_CONNECTING, 1);
+    if (i == -1)
+    {
+        close(fd);
+        return;
+    }
+    server->outbound_sync = 1;
+    server->connections[i].peer_tcp_port = tcp_port;
+    server->connections[i].cnt_entries = server->connections[i].cnt_own_entries = 0;
+}
+
+// Drops connections past their deadline and arms the timer at the earliest remaining one
+void expire_connections(struct join_server *server)
+{
+    long long ns = now_ns(), earliest = -1;
+    for (int i = 0; i < MAX_JOIN_CONNECTIONS; i++)
+    {
+        struct join_connection *conn = &server->connections[i];
+        if (conn->fd == -1)
+            continue;
+
+        if (conn->deadline_ns <= ns)
+        {
+            logg(LEVEL_DBG, "TCP connection timed out after %.1f s, dropping it", JOIN_CONNECTION_TIMEOUT);
+            close_connection(server, i);
+        }
+        else if (earliest == -1 || conn->deadline_ns < earliest)
+            earliest = conn->deadline_ns;
+    }
+
+    arm_at(server->timer_fd, earliest);
+}
+
+void init_join_server(struct join_server *server, int listener_fd)
+{
+    server->listener_fd = listener_fd;
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    server->sync_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (server->epoll_fd < 0 || server->timer_fd < 0 || server->sync_fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to set up the join server");
+        exit(1);
+    }
+
+    server->snapshot = NULL;
+    server->cnt_connections = 0;
+    for (int i = 0; i < MAX_JOIN_CONNECTIONS; i++)
+    {
+        server->connections[i].fd = -1;
+        server->connections[i].snapshot = NULL;
+    }
+    server->cnt_syncs = server->outbound_sync = 0;
+    init_arena(&server->sync_scratch, SYNC_SCRATCH_SIZE);
+
+    int flags = fcntl(listener_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(listener_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to make the TCP listener non-blocking");
+        exit(1);
+    }
+    watch(server, EPOLL_CTL_ADD, listener_fd, EPOLLIN, LISTENER_TAG);
+    watch(server, EPOLL_CTL_ADD, server->timer_fd, EPOLLIN, TIMER_TAG);
+    watch(server, EPOLL_CTL_ADD, server->sync_fd, EPOLLIN, SYNC_TAG);
+
+    // random phase, so that nodes started together do not sync in lockstep
+    arm_at(server->sync_fd, now_ns() + (long long)(random_unit() * sync_period_ns()));
+}
+
+void run_join_server(struct join_server *server, int timeout_ms)
+{
+    struct epoll_event events[MAX_JOIN_EVENTS];
+    int cnt_events = epoll_wait(server->epoll_fd, events, MAX_JOIN_EVENTS, timeout_ms);
+    if (cnt_events < 0)
+    {
+        if (errno != EINTR)
+            logg(LEVEL_DBG, "epoll_wait failed in the join server. Resuming...");
+        return;
+    }
+
+    for (int e = 0; e < cnt_events; e++)
+    {
+        uint64_t tag = events[e].data.u64;
+        uint64_t expirations;
+        if (tag == LISTENER_TAG)
+            accept_connections(server);
+        else if (tag == TIMER_TAG)
+        {
+            // deadlines are checked below anyway
+            if (read(server->timer_fd, &expirations, sizeof(expirations)) < 0)
+                continue;
+        }
+        else if (tag == SYNC_TAG)
+        {
+            if (read(server->sync_fd, &expirations, sizeof(expirations)) > 0)
+                start_sync(server);
+        }
+        else if (server->connections[tag].fd != -1)
+        {
+            // errors and hang-ups surface as failed reads or writes
+            advance(server, (int)tag);
+        }
+    }
+
+    expire_connections(server);
+}
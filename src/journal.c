@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "time_utils.h"
+#include "alloc.h"
+#include "domain_lock.h"
+
+int journal_fd = -1;
+
+void init_journal(int tcp_port, int udp_port)
+{
+    char journal_filename[32];
+    sprintf(journal_filename, "%d_%d.journal", tcp_port, udp_port);
+    journal_fd = open(journal_filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0)
+        return;
+
+    struct journal_header header;
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.record_size = sizeof(struct journal_record);
+    if (write(journal_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+void close_journal()
+{
+    if (journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = -1;
+}
+
+void fill_record(struct journal_record *record, long long ts_ns, int type, int tcp_port, int udp_port)
+{
+    memset(record, 0, sizeof(*record));
+    record->ts_ns = ts_ns;
+    record->type = type;
+    record->tcp_port = tcp_port;
+    record->udp_port = udp_port;
+}
+
+// records staged by the calling thread, the buffer grows to its high-water mark
+_Thread_local struct journal_record *staged;
+_Thread_local int cnt_staged, staged_capacity;
+
+struct journal_record *stage_record()
+{
+    if (cnt_staged == staged_capacity)
+    {
+        staged_capacity = staged_capacity > 0 ? 2 * staged_capacity : 64;
+        staged = (struct journal_record *)mem_realloc(staged, sizeof(struct journal_record) * staged_capacity);
+    }
+    return &staged[cnt_staged++];
+}
+
+void journal_event(int type, int tcp_port, int udp_port)
+{
+    if (journal_fd < 0)
+        return;
+
+    fill_record(stage_record(), now_ns(), type, tcp_port, udp_port);
+}
+
+void journal_reset(int num_peers, int *tcp_ports, int *udp_ports)
+{
+    if (journal_fd < 0)
+        return;
+
+    long long ts_ns = now_ns();
+    fill_record(stage_record(), ts_ns, JOURNAL_RESET, 0, 0);
+    for (int i = 0; i < num_peers; i++)
+        fill_record(stage_record(), ts_ns, JOURNAL_JOIN, tcp_ports[i], udp_ports[i]);
+}
+
+void journal_flush()
+{
+    if (cnt_staged == 0 || journal_fd < 0)
+        return;
+    check_unlocked("Journaling");
+
+    // O_APPEND makes each write atomic with respect to other threads; records of threads
+    // flushing out of order are put back in order by their timestamps
+    long long len = (long long)sizeof(struct journal_record) * cnt_staged;
+    if (write(journal_fd, staged, len) != len)
+    {
+        // the journal is best effort
+    }
+    cnt_staged = 0;
+}
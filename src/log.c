@@ -2,106 +2,291 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 
 #include "log.h"
 
-int log_tcp_port, log_udp_port;
-FILE *f;
+// Bounded MPSC ring (Vyukov style): a slot whose sequence equals the producer
+// ticket is free, a slot whose sequence is ticket + 1 holds a finished line
+struct log_slot
+{
+    atomic_long seq;
+    int len;
+    char line[LOG_SLOT_SIZE];
+};
 
-void init_logger(int tcp_port_, int udp_port_)
+struct log_slot *ring;
+atomic_long ring_tail; // next ticket handed to a producer
+long ring_head;        // next slot read by the flusher
+
+atomic_int log_levels = LOG_ALL_LEVELS;
+atomic_int logger_running;
+atomic_long cnt_dropped;
+
+// The flusher sleeps on wake_fd once the ring is empty. It raises flusher_waiting first, and
+// the producer that finds it raised signals, so an idle node makes no wakeups at all
+int wake_fd = -1;
+atomic_int flusher_waiting;
+
+int log_fd = -1;
+char node_prefix[64];
+int node_prefix_len;
+
+pthread_t flusher_thread;
+pthread_mutex_t direct_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *level_names[] = LEVEL_NAMES;
+const char *level_colors[] = LEVEL_COLORS;
+
+void write_batch(struct iovec *iov, int cnt)
 {
-    log_tcp_port = tcp_port_;
-    log_udp_port = udp_port_;
+    if (cnt == 0)
+        return;
 
-    char log_filename[20];
-    sprintf(log_filename, "%d_%d.log", tcp_port_, udp_port_);
-    f = fopen(log_filename, "a");
+    // stdout first, the file second, each with a single syscall
+    if (writev(STDOUT_FILENO, iov, cnt) < 0)
+    {
+        // nothing sensible to do, the line still goes to the file
+    }
+    if (log_fd >= 0 && writev(log_fd, iov, cnt) < 0)
+    {
+        // the log file is best effort
+    }
 }
 
-void cleanup_logger()
+// Writes out every finished line currently in the ring, returns how many
+int drain_ring()
 {
-    fclose(f);
+    int drained = 0;
+    while (1)
+    {
+        struct iovec iov[LOG_FLUSH_BATCH];
+        int cnt = 0;
+
+        long start = ring_head, head = ring_head;
+        while (head - start < LOG_FLUSH_BATCH)
+        {
+            struct log_slot *slot = &ring[head & (LOG_RING_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+                break;
+
+            if (slot->len > 0)
+            {
+                iov[cnt].iov_base = slot->line;
+                iov[cnt].iov_len = slot->len;
+                cnt++;
+            }
+            head++;
+        }
+
+        write_batch(iov, cnt);
+
+        // hand the written slots back to the producers
+        for (long h = start; h < head; h++)
+            atomic_store_explicit(&ring[h & (LOG_RING_SLOTS - 1)].seq, h + LOG_RING_SLOTS, memory_order_release);
+        ring_head = head;
+        drained += head - start;
+
+        if (head - start < LOG_FLUSH_BATCH)
+            return drained;
+    }
 }
 
-void set_color(const char *level, char *log, char *msg)
+void *flusher(__attribute__((unused)) void *params)
 {
-    if (strcmp(level, LEVEL_INFO) == 0)
+    while (atomic_load(&logger_running))
     {
-        sprintf(log, COLORED_LOG_FORMAT, COLOR_INFO, msg, COLOR_RESET);
+        if (drain_ring() > 0)
+            continue;
+
+        // a line finished between the drain and here is caught by the second drain, one
+        // finished after it sees flusher_waiting and signals
+        atomic_store(&flusher_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drain_ring() > 0)
+        {
+            atomic_store(&flusher_waiting, 0);
+            continue;
+        }
+
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) < 0)
+        {
+            // interrupted, drain again
+        }
     }
-    else if (strcmp(level, LEVEL_DBG) == 0)
+
+    return NULL;
+}
+
+void init_logger(int tcp_port_, int udp_port_)
+{
+    char log_filename[32];
+    sprintf(log_filename, "%d_%d.log", tcp_port_, udp_port_);
+    log_fd = open(log_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    node_prefix_len = snprintf(node_prefix, sizeof(node_prefix), NODE_PREFIX_FORMAT, tcp_port_, udp_port_);
+
+#ifdef LOGS_SUCCINT
+    set_log_levels(LOG_ALL_LEVELS & ~LOG_MASK(LEVEL_DBG));
+#endif
+
+#ifdef STRESS_TEST
+    set_log_levels(LOG_MASK(LEVEL_FATAL));
+#endif
+
+    ring = (struct log_slot *)malloc(sizeof(struct log_slot) * LOG_RING_SLOTS);
+    for (long i = 0; i < LOG_RING_SLOTS; i++)
+        atomic_init(&ring[i].seq, i);
+    atomic_init(&ring_tail, 0);
+    ring_head = 0;
+
+    atomic_init(&flusher_waiting, 0);
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0)
     {
-        sprintf(log, COLORED_LOG_FORMAT, COLOR_DBG, msg, COLOR_RESET);
+        fputs("Failed to create log flusher eventfd\n", stderr);
+        exit(1);
     }
-    else if (strcmp(level, LEVEL_FATAL) == 0)
+
+    atomic_store(&logger_running, 1);
+    if (pthread_create(&flusher_thread, NULL, flusher, NULL) != 0)
     {
-        sprintf(log, COLORED_LOG_FORMAT, COLOR_FATAL, msg, COLOR_RESET);
+        atomic_store(&logger_running, 0);
+        fputs("Failed to create log flusher thread\n", stderr);
+        exit(1);
     }
-    else if (strcmp(level, LEVEL_PEERS) == 0)
+
+    // lines logged right before exit(1) must still make it out
+    atexit(cleanup_logger);
+}
+
+void cleanup_logger()
+{
+    if (!atomic_exchange(&logger_running, 0))
+        return;
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
     {
-        sprintf(log, COLORED_LOG_FORMAT, COLOR_PEERS, msg, COLOR_RESET);
+        // the flusher was not asleep
     }
+    pthread_join(flusher_thread, NULL);
+    drain_ring();
+
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = -1;
 }
 
-void unset_color()
+void set_log_levels(int mask)
 {
-    printf("\033[0m");
+    atomic_store_explicit(&log_levels, mask, memory_order_relaxed);
 }
 
-void logg(const char *level, const char *fmt, ...)
+int log_enabled(int level)
 {
-#ifdef LOGS_SUCCINT
-    if (strcmp(level, LEVEL_DBG) == 0)
+    return (atomic_load_explicit(&log_levels, memory_order_relaxed) & LOG_MASK(level)) != 0;
+}
+
+long long log_dropped()
+{
+    return atomic_load(&cnt_dropped);
+}
+
+// Formats one full line into out, returns its length had out been large enough
+int format_line(char *out, int size, int level, struct timespec *tp, const char *fmt, va_list ap)
+{
+    int n = snprintf(out, size, "%s[%s   %ld:%ld%s", level_colors[level], level_names[level], tp->tv_sec, tp->tv_nsec, node_prefix);
+    n += vsnprintf(out + (n < size ? n : size), n < size ? size - n : 0, fmt, ap);
+    n += snprintf(out + (n < size ? n : size), n < size ? size - n : 0, "%s\n", COLOR_RESET);
+    return n;
+}
+
+// Lines that do not fit in a slot bypass the ring and are written directly,
+// truncated to LOG_LONG_LINE_SIZE so that logging never allocates
+void write_long_line(int level, struct timespec *tp, int len, const char *fmt, va_list ap)
+{
+    char line[LOG_LONG_LINE_SIZE];
+    format_line(line, sizeof(line), level, tp, fmt, ap);
+    if (len > (int)sizeof(line) - 1)
     {
-        return;
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
     }
-#endif
 
-#ifdef STRESS_TEST
-    if (strcmp(level, LEVEL_PEERS) != 0)
-    {
+    struct iovec iov;
+    iov.iov_base = line;
+    iov.iov_len = len;
+
+    pthread_mutex_lock(&direct_write_lock);
+    write_batch(&iov, 1);
+    pthread_mutex_unlock(&direct_write_lock);
+}
+
+void logg(int level, const char *fmt, ...)
+{
+    if (!log_enabled(level) || !atomic_load_explicit(&logger_running, memory_order_relaxed))
         return;
-    }
-#endif
 
     // get current time
     struct timespec tp;
     clock_gettime(CLOCK_MONOTONIC, &tp);
 
-    char *p = NULL;
-    va_list ap;
-    va_start(ap, fmt);
-
-    // Calculate size for message
-    int n = vsnprintf(p, 0, fmt, ap);
-    va_end(ap);
+    // claim a ticket for a free slot, or drop the line if the ring is full
+    struct log_slot *slot;
+    long ticket = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    while (1)
+    {
+        slot = &ring[ticket & (LOG_RING_SLOTS - 1)];
+        long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == ticket)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring_tail, &ticket, ticket + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (seq < ticket)
+        {
+            atomic_fetch_add(&cnt_dropped, 1);
+            return;
+        }
+        else
+        {
+            ticket = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        }
+    }
 
-    // Write message
-    p = (char *)malloc(n + 1);
+    va_list ap;
     va_start(ap, fmt);
-    vsnprintf(p, n + 1, fmt, ap);
+    slot->len = format_line(slot->line, LOG_SLOT_SIZE, level, &tp, fmt, ap);
     va_end(ap);
 
-    // Calculate size for preffix
-    char *prefix = NULL;
-    int m = snprintf(prefix, 0, PREFIX_FORMAT, level, tp.tv_sec, tp.tv_nsec, log_tcp_port, log_udp_port);
-
-    // Write preffix
-    prefix = (char *)malloc(m + n + 1);
-    snprintf(prefix, m + 1, PREFIX_FORMAT, level, tp.tv_sec, tp.tv_nsec, log_tcp_port, log_udp_port);
-
-    // Concatenate message to prefix
-    strcat(prefix, p);
-
-    char *log = malloc(m + n + 1 + 2 * 6);
+    if (slot->len >= LOG_SLOT_SIZE)
+    {
+        va_start(ap, fmt);
+        write_long_line(level, &tp, slot->len, fmt, ap);
+        va_end(ap);
+        slot->len = 0; // the slot is released without being written
+    }
 
-    set_color(level, log, prefix);
-    puts(log);
-    fputs(log, f);
-    fputs("\n", f);
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
 
-    free(p);
-    free(prefix);
-    free(log);
+    // pairs with the fence in flusher: either it sees this line or this sees it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&flusher_waiting, memory_order_relaxed) && atomic_exchange(&flusher_waiting, 0))
+    {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+        {
+            // the counter cannot overflow, a failed signal leaves an earlier one pending
+        }
+    }
 }
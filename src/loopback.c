@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "transport.h"
+#include "wire.h"
+#include "log.h"
+#include "alloc.h"
+
+// datagrams waiting for one receiver, further ones are dropped like on a full socket buffer
+#define LOOPBACK_QUEUE_SLOTS 256
+
+#define MAX_PORTS 65536
+
+struct loopback_slot
+{
+    int from, len;
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+};
+
+// A ring of slots: [head, leased) were returned by the last receive and are still being
+// read, [leased, tail) wait. Senders copy into the slot at tail
+struct loopback_transport
+{
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    int event_fd; // the receiver's transport fd, readable while datagrams wait
+    long long head, leased, tail;
+    struct loopback_slot slots[LOOPBACK_QUEUE_SLOTS];
+};
+
+// receivers by UDP port, write-locked only to register and unregister
+pthread_rwlock_t loopback_ports_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct loopback_transport *loopback_ports[MAX_PORTS];
+
+// Enqueues a copy of d for its receiver, returns 0 if it was dropped
+int loopback_deliver(int from, struct datagram *d)
+{
+    if (d->udp_port < 0 || d->udp_port >= MAX_PORTS || d->len > MAX_DATAGRAM_SIZE)
+        return 0;
+
+    pthread_rwlock_rdlock(&loopback_ports_lock);
+    struct loopback_transport *to = loopback_ports[d->udp_port];
+    int delivered = 0;
+    if (to != NULL)
+    {
+        pthread_mutex_lock(&to->lock);
+        if (to->tail - to->head < LOOPBACK_QUEUE_SLOTS)
+        {
+            struct loopback_slot *slot = &to->slots[to->tail % LOOPBACK_QUEUE_SLOTS];
+            slot->from = from;
+            slot->len = d->len;
+            memcpy(slot->buf, d->buf, d->len);
+            if (to->tail++ == to->leased)
+            {
+                uint64_t one = 1;
+                if (write(to->event_fd, &one, sizeof(one)) < 0)
+                    logg(LEVEL_DBG, "Failed to signal the loopback eventfd");
+                pthread_cond_signal(&to->readable);
+            }
+            delivered = 1;
+        }
+        pthread_mutex_unlock(&to->lock);
+    }
+    pthread_rwlock_unlock(&loopback_ports_lock);
+    return delivered;
+}
+
+int loopback_send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+        loopback_deliver(transport->udp_port, &datagrams[i]);
+    return cnt;
+}
+
+int loopback_recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms)
+{
+    struct loopback_transport *loopback = (struct loopback_transport *)transport->impl;
+    if (max > MAX_RECV_BATCH)
+        max = MAX_RECV_BATCH;
+
+    struct timespec deadline;
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000l;
+        if (deadline.tv_nsec >= 1000000000l)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000l;
+        }
+    }
+
+    pthread_mutex_lock(&loopback->lock);
+
+    // the previous batch has been read
+    loopback->head = loopback->leased;
+
+    while (loopback->tail == loopback->leased && timeout_ms != 0)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&loopback->readable, &loopback->lock);
+        else if (pthread_cond_timedwait(&loopback->readable, &loopback->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    int cnt = 0;
+    while (cnt < max && loopback->leased < loopback->tail)
+    {
+        struct loopback_slot *slot = &loopback->slots[loopback->leased++ % LOOPBACK_QUEUE_SLOTS];
+        out[cnt].udp_port = slot->from;
+        out[cnt].buf = slot->buf;
+        out[cnt].len = slot->len;
+        cnt++;
+    }
+
+    if (loopback->leased == loopback->tail)
+    {
+        uint64_t value;
+        if (read(loopback->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            logg(LEVEL_DBG, "Failed to reset the loopback eventfd");
+    }
+
+    pthread_mutex_unlock(&loopback->lock);
+    return cnt;
+}
+
+socklen_t local_stream_addr(struct sockaddr_un *addr, int tcp_port)
+{
+    // abstract namespace, private to this process by its pid
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "thin_swim/%d/%d", (int)getpid(), tcp_port);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+int loopback_listen_stream(__attribute__((unused)) struct transport *transport, int tcp_port)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    socklen_t addr_len = local_stream_addr(&addr, tcp_port);
+    if (bind(fd, (const struct sockaddr *)&addr, addr_len) < 0 || listen(fd, 50) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int loopback_connect_stream(__attribute__((unused)) struct transport *transport, int tcp_port, int nonblocking)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    socklen_t addr_len = local_stream_addr(&addr, tcp_port);
+    if (connect(fd, (const struct sockaddr *)&addr, addr_len) < 0 && !(nonblocking && (errno == EINPROGRESS || errno == EAGAIN)))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int loopback_accept_stream(__attribute__((unused)) struct transport *transport, int listener_fd)
+{
+    return accept4(listener_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+void loopback_close(struct transport *transport)
+{
+    struct loopback_transport *loopback = (struct loopback_transport *)transport->impl;
+
+    pthread_rwlock_wrlock(&loopback_ports_lock);
+    if (loopback_ports[transport->udp_port] == loopback)
+        loopback_ports[transport->udp_port] = NULL;
+    pthread_rwlock_unlock(&loopback_ports_lock);
+
+    pthread_mutex_destroy(&loopback->lock);
+    pthread_cond_destroy(&loopback->readable);
+    close(transport->fd);
+    mem_free(loopback);
+    transport->impl = NULL;
+    transport->fd = -1;
+}
+
+const struct transport_ops loopback_ops = {
+    loopback_send_datagrams,
+    loopback_recv_datagrams,
+    loopback_listen_stream,
+    loopback_connect_stream,
+    loopback_accept_stream,
+    loopback_close,
+    NULL,
+};
+
+void init_loopback_transport(struct transport *transport, int udp_port)
+{
+    if (udp_port < 0 || udp_port >= MAX_PORTS)
+    {
+        logg(LEVEL_FATAL, "Invalid loopback port %d", udp_port);
+        exit(1);
+    }
+
+    struct loopback_transport *loopback = (struct loopback_transport *)mem_alloc(sizeof(struct loopback_transport));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&loopback->readable, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&loopback->lock, NULL);
+    loopback->head = loopback->leased = loopback->tail = 0;
+
+    transport->ops = &loopback_ops;
+    transport->udp_port = udp_port;
+    transport->impl = loopback;
+    transport->fd = loopback->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (transport->fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to create the loopback eventfd");
+        exit(1);
+    }
+
+    pthread_rwlock_wrlock(&loopback_ports_lock);
+    if (loopback_ports[udp_port] != NULL)
+    {
+        logg(LEVEL_FATAL, "Loopback port %d is taken", udp_port);
+        exit(1);
+    }
+    loopback_ports[udp_port] = loopback;
+    pthread_rwlock_unlock(&loopback_ports_lock);
+}
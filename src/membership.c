@@ -0,0 +1,108 @@
+#include <stdlib.h>
+
+#include "membership.h"
+#include "alloc.h"
+#include "port_index.h"
+
+void init_member_table(struct member_table *members, int capacity)
+{
+    if (capacity < 1)
+        capacity = 1;
+    members->capacity = capacity;
+    members->num_peers = 0;
+    members->tcp_ports = (int *)mem_alloc(sizeof(int) * capacity);
+    members->udp_ports = (int *)mem_alloc(sizeof(int) * capacity);
+    members->incarnations = (int *)mem_alloc(sizeof(int) * capacity);
+    members->statuses = (int *)mem_alloc(sizeof(int) * capacity);
+    members->rtts = (struct rtt_estimator *)mem_alloc(sizeof(struct rtt_estimator) * capacity);
+
+    init_port_index(&members->by_node, capacity);
+    init_port_index(&members->by_udp, capacity);
+}
+
+void free_member_table(struct member_table *members)
+{
+    mem_free(members->tcp_ports);
+    mem_free(members->udp_ports);
+    mem_free(members->incarnations);
+    mem_free(members->statuses);
+    mem_free(members->rtts);
+    members->tcp_ports = NULL;
+    members->udp_ports = NULL;
+    members->incarnations = NULL;
+    members->statuses = NULL;
+    members->rtts = NULL;
+    members->capacity = members->num_peers = 0;
+
+    free_port_index(&members->by_node);
+    free_port_index(&members->by_udp);
+}
+
+void clear_member_table(struct member_table *members)
+{
+    members->num_peers = 0;
+    clear_port_index(&members->by_node);
+    clear_port_index(&members->by_udp);
+}
+
+int lookup_member(struct member_table *members, int tcp_port, int udp_port)
+{
+    return port_index_get(&members->by_node, port_key(tcp_port, udp_port));
+}
+
+int lookup_member_by_udp(struct member_table *members, int udp_port)
+{
+    return port_index_get(&members->by_udp, udp_port);
+}
+
+int insert_member(struct member_table *members, int tcp_port, int udp_port)
+{
+    int pos = lookup_member(members, tcp_port, udp_port);
+    if (pos != -1)
+        return pos;
+
+    if (members->num_peers + 1 > members->capacity)
+    {
+        members->capacity *= 2;
+        members->tcp_ports = (int *)mem_realloc(members->tcp_ports, sizeof(int) * members->capacity);
+        members->udp_ports = (int *)mem_realloc(members->udp_ports, sizeof(int) * members->capacity);
+        members->incarnations = (int *)mem_realloc(members->incarnations, sizeof(int) * members->capacity);
+        members->statuses = (int *)mem_realloc(members->statuses, sizeof(int) * members->capacity);
+        members->rtts = (struct rtt_estimator *)mem_realloc(members->rtts, sizeof(struct rtt_estimator) * members->capacity);
+    }
+
+    pos = members->num_peers++;
+    members->tcp_ports[pos] = tcp_port;
+    members->udp_ports[pos] = udp_port;
+    members->incarnations[pos] = 0;
+    members->statuses[pos] = MEMBER_ALIVE;
+    init_rtt(&members->rtts[pos]);
+
+    port_index_put(&members->by_node, port_key(tcp_port, udp_port), pos);
+    port_index_put(&members->by_udp, udp_port, pos);
+    return pos;
+}
+
+void delete_member_at(struct member_table *members, int pos)
+{
+    int last = members->num_peers - 1;
+
+    port_index_remove(&members->by_node, port_key(members->tcp_ports[pos], members->udp_ports[pos]));
+    if (port_index_get(&members->by_udp, members->udp_ports[pos]) == pos)
+        port_index_remove(&members->by_udp, members->udp_ports[pos]);
+
+    if (pos != last)
+    {
+        members->tcp_ports[pos] = members->tcp_ports[last];
+        members->udp_ports[pos] = members->udp_ports[last];
+        members->incarnations[pos] = members->incarnations[last];
+        members->statuses[pos] = members->statuses[last];
+        members->rtts[pos] = members->rtts[last];
+
+        port_index_put(&members->by_node, port_key(members->tcp_ports[pos], members->udp_ports[pos]), pos);
+        if (port_index_get(&members->by_udp, members->udp_ports[pos]) == last)
+            port_index_put(&members->by_udp, members->udp_ports[pos], pos);
+    }
+
+    members->num_peers--;
+}
@@ -0,0 +1,89 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "message_queue.h"
+#include "log.h"
+#include "alloc.h"
+
+void init_message_queue(struct message_queue *queue, int capacity)
+{
+    queue->capacity = capacity;
+    queue->slots = (struct message_slot *)mem_alloc(sizeof(struct message_slot) * capacity);
+    for (long i = 0; i < capacity; i++)
+        atomic_init(&queue->slots[i].seq, i);
+    atomic_init(&queue->tail, 0);
+    queue->head = 0;
+
+    queue->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (queue->event_fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to create the message queue eventfd");
+        exit(1);
+    }
+}
+
+int push_messages(struct message_queue *queue, const struct gossip_message *msgs, int cnt)
+{
+    int cnt_pushed = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        // claim the slot of the next ticket, unless the consumer has not freed it yet
+        long ticket = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        struct message_slot *slot = NULL;
+        while (slot == NULL)
+        {
+            struct message_slot *candidate = &queue->slots[ticket & (queue->capacity - 1)];
+            long seq = atomic_load_explicit(&candidate->seq, memory_order_acquire);
+            if (seq < ticket)
+                break;
+            if (seq > ticket)
+                ticket = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+            else if (atomic_compare_exchange_weak_explicit(&queue->tail, &ticket, ticket + 1, memory_order_relaxed, memory_order_relaxed))
+                slot = candidate;
+        }
+        if (slot == NULL)
+            break;
+
+        memcpy(&slot->msg, &msgs[i], sizeof(struct gossip_message));
+        atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+        cnt_pushed++;
+    }
+
+    if (cnt_pushed > 0)
+    {
+        uint64_t one = 1;
+        if (write(queue->event_fd, &one, sizeof(one)) < 0)
+            logg(LEVEL_DBG, "Failed to signal the message queue");
+    }
+    return cnt_pushed;
+}
+
+int pop_messages(struct message_queue *queue, struct gossip_message *out, int max)
+{
+    int cnt = 0;
+    while (cnt < max)
+    {
+        struct message_slot *slot = &queue->slots[queue->head & (queue->capacity - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != queue->head + 1)
+            break;
+
+        memcpy(&out[cnt++], &slot->msg, sizeof(struct gossip_message));
+
+        // hand the slot back to the producers
+        atomic_store_explicit(&slot->seq, queue->head + queue->capacity, memory_order_release);
+        queue->head++;
+    }
+    return cnt;
+}
+
+void wait_messages(struct message_queue *queue)
+{
+    uint64_t value;
+    while (read(queue->event_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
@@ -6,8 +6,11 @@
 #include <pthread.h>
 
 #include "log.h"
+#include "journal.h"
 #include "state.h"
 #include "node_manager.h"
+#include "event_loop.h"
+#include "scheduler.h"
 
 // STATE
 extern struct node_state state;
@@ -16,6 +19,7 @@ extern struct node_state state;
 void sigint_handler(__attribute__((unused)) int signum)
 {
     logg(LEVEL_FATAL, "Received SIGINT, stopping...");
+    close_journal();
     cleanup_logger();
     exit(0);
 }
@@ -35,6 +39,7 @@ void parse_ports(int argc, char **argv)
     int udp_port = atoi(argv[3]);
 
     init_logger(tcp_port, udp_port);
+    init_journal(tcp_port, udp_port);
     init_state(tcp_port, udp_port);
 }
 
@@ -54,6 +59,21 @@ void parse_command(int argc, char **argv)
     start_network(argc, argv);
 }
 
+// called once per second by the runtime
+// membership changes are not logged here, they go to the node's journal as they happen
+int cnt_reports = 0;
+void report()
+{
+    cnt_reports++;
+    if (cnt_reports % 10 == 0)
+    {
+        log_timer_lag("Probe", &state.probe_timer);
+        log_timer_lag("Gossip", &state.gossip_timer);
+        logg(LEVEL_INFO, "Local health %d", atomic_load(&state.health));
+        log_lock_contention(&state);
+    }
+}
+
 int main(int argc, char **argv)
 {
     signal(SIGINT, sigint_handler);
@@ -64,6 +84,10 @@ int main(int argc, char **argv)
     // start a new network or join an existing network
     parse_command(argc, argv);
 
+#ifdef EVENT_LOOP
+    // all listening, probing and gossiping happens on this thread
+    run_event_loop(report);
+#else
     // start tcp and udp listener threads
     pthread_t tcp_listener_thread, udp_listener_thread;
     if (pthread_create(&tcp_listener_thread, NULL, tcp_port_listener, NULL) != 0)
@@ -71,7 +95,9 @@ int main(int argc, char **argv)
         logg(LEVEL_FATAL, "Failed to create TCP listener thread. Exiting...");
         exit(1);
     }
-    if (pthread_create(&udp_listener_thread, NULL, udp_port_listener, NULL) != 0)
+    if (cnt_receive_workers > 0)
+        start_receive_workers();
+    else if (pthread_create(&udp_listener_thread, NULL, udp_port_listener, NULL) != 0)
     {
         logg(LEVEL_FATAL, "Failed to create UDP listener thread. Exiting...");
         exit(1);
@@ -96,12 +122,10 @@ int main(int argc, char **argv)
     // node running...
     while (1)
     {
-        char *peers_repr = print_peers(&state);
-        logg(LEVEL_PEERS, "peers: %s", peers_repr);
-        free(peers_repr);
-
+        report();
         sleep(1);
     }
+#endif
 
     return 0;
 }
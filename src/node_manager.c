@@ -1,110 +1,178 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "node_manager.h"
 #include "state.h"
 #include "log.h"
 #include "time_utils.h"
 #include "constants.h"
+#include "random.h"
+#include "alloc.h"
 
 #include "join_message.h"
 #include "gossip_message.h"
+#include "wire.h"
+#include "transport.h"
+#include "join_server.h"
+#include "message_queue.h"
+#include "event_loop.h"
+
+#define MAX_RECEIVE_WORKERS 16
+#define OWNER_QUEUE_CAPACITY 1024 // must be a power of two
 
 struct node_state state;
 
+// scratch for the member list of a received join reply
+struct arena join_scratch;
+
+// 0: a single UDP listener thread applies everything
+int cnt_receive_workers = 0;
+
 void init_state(int tcp_port, int udp_port)
 {
-    if (pthread_mutex_init(&state.lock, NULL) != 0)
+    // nodes started together must not share random sequences (e.g. timer phases)
+    seed_random((unsigned long long)now_ns() ^ ((unsigned long long)udp_port << 20) ^ (unsigned long long)getpid());
+    init_node_state(&state, tcp_port, udp_port);
+
+    // e.g. THIN_SWIM_RECEIVE_WORKERS=4 to receive on 4 cores
+    const char *workers_spec = getenv("THIN_SWIM_RECEIVE_WORKERS");
+    if (workers_spec != NULL)
     {
-        logg(LEVEL_FATAL, "Failed to init state lock");
-        exit(1);
+#ifdef EVENT_LOOP
+        logg(LEVEL_INFO, "Receive workers need the threaded runtime, ignoring THIN_SWIM_RECEIVE_WORKERS");
+#else
+        cnt_receive_workers = atoi(workers_spec);
+        if (cnt_receive_workers < 1 || cnt_receive_workers > MAX_RECEIVE_WORKERS)
+        {
+            logg(LEVEL_FATAL, "THIN_SWIM_RECEIVE_WORKERS must be between 1 and %d", MAX_RECEIVE_WORKERS);
+            exit(1);
+        }
+#endif
     }
 
-    state.own_tcp_port = tcp_port;
-    state.own_udp_port = udp_port;
-    state.lamport_time = 0;
-
-    state.cnt_broadcast = 0;
-    state.broadcast_list_capacity = 1;
-    state.broadcast_list = malloc(sizeof(struct broadcast));
-    state.tcp_ports_to_probe = NULL;
-    state.udp_ports_to_probe = NULL;
-    state.current_tcp_port_to_probe = -1;
-    state.current_udp_port_to_probe = -1;
-    state.probed = -1;
-    state.cnt_probing = 0;
-    state.cnt_request_probes = 0;
-    state.udp_ports_requested_to_probe = malloc(CAPACITY * sizeof(int));
-    state.udp_ports_requestors = malloc(CAPACITY * sizeof(int));
-    state.probe_request_ns = malloc(CAPACITY * sizeof(long long));
-}
-
-void reset_state()
-{
-    pthread_mutex_lock(&state.lock);
-    state.cnt_broadcast = 0;
-    state.broadcast_list_capacity = 1;
+    // io_uring has no shards, receive workers use sockets
+    if (cnt_receive_workers > 0)
+        init_sharded_udp_transport(&state.transport, udp_port);
+#ifdef IO_URING
+    else if (init_uring_transport(&state.transport, udp_port) < 0)
+        init_udp_transport(&state.transport, udp_port);
+#else
+    else
+        init_udp_transport(&state.transport, udp_port);
+#endif
 
-    if (state.tcp_ports_to_probe != NULL)
+    // e.g. THIN_SWIM_FAULTS=loss=0.1,delay=1-5 to run this node over a lossy network
+    const char *fault_spec = getenv("THIN_SWIM_FAULTS");
+    if (fault_spec != NULL)
     {
-        free(state.tcp_ports_to_probe);
-        state.tcp_ports_to_probe = NULL;
+        struct fault_config config;
+        memset(&config, 0, sizeof(config));
+        if (parse_fault_config(fault_spec, &config) < 0)
+        {
+            logg(LEVEL_FATAL, "Malformed THIN_SWIM_FAULTS: %s", fault_spec);
+            exit(1);
+        }
+
+        struct transport udp = state.transport;
+        init_fault_injector(&state.transport, &udp, &config);
+        logg(LEVEL_INFO, "Injecting faults: %s", fault_spec);
     }
-    if (state.udp_ports_to_probe != NULL)
+
+    init_arena(&join_scratch, JOIN_SCRATCH_SIZE);
+}
+
+// Picks a random member to join through, returns -1 if there is none
+int pick_gateway(int *tcp_gateway, int *udp_gateway)
+{
+    struct member_view *view = enter_member_view(&state);
+    int picked = -1;
+    if (view->num_peers > 0)
     {
-        free(state.udp_ports_to_probe);
-        state.udp_ports_to_probe = NULL;
+        int rand_peer = random_below(view->num_peers);
+        *tcp_gateway = view->tcp_ports[rand_peer];
+        *udp_gateway = view->udp_ports[rand_peer];
+        picked = 0;
     }
+    leave_member_view(view);
+    return picked;
+}
 
-    state.current_tcp_port_to_probe = -1;
-    state.current_udp_port_to_probe = -1;
-    state.probed = -1;
-    state.cnt_probing = 0;
-    state.cnt_request_probes = 0;
+// set by the thread applying messages, the prober joins again once the grace period is over
+atomic_int rejoin_due = 0;
 
-    free(state.udp_ports_requested_to_probe);
-    free(state.udp_ports_requestors);
-    free(state.probe_request_ns);
-    state.udp_ports_requested_to_probe = malloc(CAPACITY * sizeof(int));
-    state.udp_ports_requestors = malloc(CAPACITY * sizeof(int));
-    state.probe_request_ns = malloc(CAPACITY * sizeof(long long));
+void reset_state()
+{
+    if (atomic_exchange(&rejoin_due, 1) == 0)
+        prepare_rejoin(&state);
+}
 
-    if (state.num_peers == 0)
+// Runs on the prober, which has nothing else to do until the node is back
+void rejoin_network()
+{
+    int tcp_gateway, udp_gateway;
+    if (pick_gateway(&tcp_gateway, &udp_gateway) < 0)
     {
         logg(LEVEL_FATAL, "No peer to connect to");
+        return;
     }
 
-    sleep_(GRACE_PERIOD);
+    logg(LEVEL_INFO, "Rejoining via %d-%d", tcp_gateway, udp_gateway);
+    join_network(tcp_gateway, udp_gateway);
+}
 
-    int rand_peer = rand() % state.num_peers;
-    logg(LEVEL_INFO, "Rejoining via %d-%d", state.tcp_ports[rand_peer], state.udp_ports[rand_peer]);
-    join_network(state.tcp_ports[rand_peer], state.udp_ports[rand_peer]);
+void fill_join_request(struct join_request *request)
+{
+    memset(request, 0, sizeof(*request));
+    request->type = TCP_JOIN;
+    request->tcp_port = state.own_tcp_port;
+    request->udp_port = state.own_udp_port;
+    struct member_view *view = enter_member_view(&state);
+    request->incarnation = view->own_incarnation;
+    leave_member_view(view);
+}
 
-    pthread_mutex_unlock(&state.lock);
+struct join_member *alloc_join_members(int num_peers)
+{
+    return (struct join_member *)arena_alloc(&join_scratch, sizeof(struct join_member) * (num_peers + 1));
+}
+
+void adopt_join_reply(const struct join_reply *reply, const struct join_member *members)
+{
+    int *tcp_ports = arena_alloc(&join_scratch, sizeof(int) * (reply->num_peers + 1));
+    int *udp_ports = arena_alloc(&join_scratch, sizeof(int) * (reply->num_peers + 1));
+    int *incarnations = arena_alloc(&join_scratch, sizeof(int) * (reply->num_peers + 1));
+    int num_peers = 0;
+    for (int i = 0; i < reply->num_peers; i++)
+    {
+        // gateways share membership snapshots between replies, which may still list a rejoining node
+        if (members[i].tcp_port == state.own_tcp_port && members[i].udp_port == state.own_udp_port)
+            continue;
+
+        tcp_ports[num_peers] = members[i].tcp_port;
+        udp_ports[num_peers] = members[i].udp_port;
+        incarnations[num_peers] = members[i].incarnation;
+        num_peers++;
+    }
+
+    logg(LEVEL_INFO, "Received join reply, discovered network with %d peers, joined at incarnation %d", num_peers, reply->incarnation);
+
+    set_incarnation(&state, reply->incarnation);
+    populate_peers(&state, num_peers, tcp_ports, udp_ports, incarnations);
+    arena_reset(&join_scratch);
 }
 
 void join_network(int tcp_gateway, __attribute__((unused)) int udp_gateway)
 {
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(tcp_gateway);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    check_unlocked("Joining over TCP");
 
-    int fd_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int fd_socket = connect_stream(&state.transport, tcp_gateway, 0);
     if (fd_socket < 0)
-    {
-        logg(LEVEL_FATAL, "Failed to create TCP socket");
-        exit(1);
-    }
-    if (connect(fd_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
         logg(LEVEL_FATAL, "Error connecting to server TCP gateway socket");
         exit(1);
@@ -112,36 +180,46 @@ void join_network(int tcp_gateway, __attribute__((unused)) int udp_gateway)
 
     // send join request
     struct join_request snd_msg;
-    memset(&snd_msg, 0, sizeof(snd_msg));
-    snd_msg.tcp_port = state.own_tcp_port;
-    snd_msg.udp_port = state.own_udp_port;
+    fill_join_request(&snd_msg);
 
-    if (send(fd_socket, &snd_msg, sizeof(snd_msg), 0) < 0)
+    if (send_all(fd_socket, &snd_msg, sizeof(snd_msg)) < 0)
     {
         logg(LEVEL_FATAL, "Error occured while sending TCP message");
         exit(1);
     }
 
-    // wait for join reply
+    // wait for join reply header, then for the streamed members
     struct join_reply recv_msg;
     memset(&recv_msg, 0, sizeof(recv_msg));
-    if (recv(fd_socket, &recv_msg, sizeof(recv_msg), 0) < 0)
+    if (recv_all(fd_socket, &recv_msg, sizeof(recv_msg)) < 0 || recv_msg.num_peers < 0 || recv_msg.num_peers > MAX_JOIN_PEERS)
     {
         logg(LEVEL_FATAL, "Did not receive join reply");
         exit(1);
     }
 
-    logg(LEVEL_INFO, "Received join reply, discovered network with %d peers", recv_msg.num_peers);
+    struct join_member *members = alloc_join_members(recv_msg.num_peers);
+    for (int start = 0; start < recv_msg.num_peers; start += JOIN_CHUNK_SIZE)
+    {
+        int cnt = recv_msg.num_peers - start;
+        if (cnt > JOIN_CHUNK_SIZE)
+            cnt = JOIN_CHUNK_SIZE;
+
+        if (recv_all(fd_socket, members + start, sizeof(struct join_member) * cnt) < 0)
+        {
+            logg(LEVEL_FATAL, "Join reply ended after %d of %d peers", start, recv_msg.num_peers);
+            exit(1);
+        }
+    }
 
     close(fd_socket);
-    populate_peers(&state, recv_msg.num_peers, recv_msg.tcp_ports, recv_msg.udp_ports);
+    adopt_join_reply(&recv_msg, members);
 }
 
 void start_network(int argc, char **argv)
 {
     int num_seeds = (argc - 4) / 3;
-    int *tcp_ports = malloc(num_seeds * sizeof(int));
-    int *udp_ports = malloc(num_seeds * sizeof(int));
+    int *tcp_ports = mem_alloc(num_seeds * sizeof(int));
+    int *udp_ports = mem_alloc(num_seeds * sizeof(int));
 
     for (int i = 0; i < num_seeds; i++)
     {
@@ -149,212 +227,254 @@ void start_network(int argc, char **argv)
         udp_ports[i] = atoi(argv[4 + 3 * i + 2]);
     }
 
-    populate_peers(&state, num_seeds, tcp_ports, udp_ports);
-    free(tcp_ports);
-    free(udp_ports);
-
-    for (int i = 0; i < state.num_peers; i++)
+    populate_peers(&state, num_seeds, tcp_ports, udp_ports, NULL);
+    for (int i = 0; i < num_seeds; i++)
     {
-        logg(LEVEL_DBG, "%dth seed has TCP=%d, UDP=%d", i + 1, state.tcp_ports[i], state.udp_ports[i]);
+        logg(LEVEL_DBG, "%dth seed has TCP=%d, UDP=%d", i + 1, tcp_ports[i], udp_ports[i]);
     }
+
+    mem_free(tcp_ports);
+    mem_free(udp_ports);
 }
 
-void *tcp_port_listener(__attribute__((unused)) void *params)
+int open_tcp_listener()
 {
-    int fd_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int fd_socket = listen_stream(&state.transport, state.own_tcp_port);
     if (fd_socket < 0)
     {
-        logg(LEVEL_FATAL, "Failed to create TCP port");
+        logg(LEVEL_FATAL, "Failed to listen on TCP port %d", state.own_tcp_port);
         exit(1);
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(state.own_tcp_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    logg(LEVEL_INFO, "Listening on TCP port %d", state.own_tcp_port);
+    return fd_socket;
+}
+
+void *tcp_port_listener(__attribute__((unused)) void *params)
+{
+    struct join_server server;
+    init_join_server(&server, open_tcp_listener());
 
-    int cnt_failures_left = 5;
-    while (bind(fd_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        logg(LEVEL_FATAL, "Tried and failed to bind TCP socket to desired port %d. Retrying...", state.own_tcp_port);
-        cnt_failures_left--;
+    while (1)
+        run_join_server(&server, -1);
 
-        if (cnt_failures_left < 0)
-            break;
-        sleep_(0.1);
-    }
+    return NULL;
+}
 
-    if (cnt_failures_left < 0)
-    {
-        logg(LEVEL_FATAL, "Failed to bind TCP socket to desired port %d.", state.own_tcp_port);
-        exit(1);
-    }
+// messages of the batch being applied, only used by the thread that applies them
+struct gossip_message decoded[MAX_RECV_BATCH];
 
-    if (listen(fd_socket, 50) < 0)
-    {
-        logg(LEVEL_FATAL, "Failed to start listening to desired port");
-        exit(1);
-    }
-    else
+void apply_messages(struct gossip_message *msgs, int cnt)
+{
+    if (cnt > 0 && handle_gossip(&state, msgs, cnt))
     {
-        logg(LEVEL_INFO, "Listening on TCP port %d", state.own_tcp_port);
+        logg(LEVEL_INFO, "Refutations went unanswered. Rejoining...");
+#ifdef EVENT_LOOP
+        start_rejoin();
+#else
+        reset_state();
+#endif
     }
+}
 
-    while (1)
+// Decodes a batch of datagrams and applies the valid ones to the protocol together
+void handle_datagrams(struct datagram *datagrams, int cnt)
+{
+    int cnt_decoded = 0;
+    for (int i = 0; i < cnt; i++)
     {
-        struct sockaddr_in client_addr;
-        memset(&client_addr, 0, sizeof(client_addr));
-        socklen_t client_socklen = sizeof(client_addr);
-        int client_socket = accept(fd_socket, (struct sockaddr *)&client_addr, &client_socklen);
-        if (client_socket < 0)
+        if (decode_gossip(datagrams[i].buf, datagrams[i].len, &decoded[cnt_decoded]) < 0)
         {
-            logg(LEVEL_DBG, "Failed to accept connection. Resume listening...");
+            logg(LEVEL_DBG, "Dropping malformed UDP message of %d bytes", datagrams[i].len);
             continue;
         }
-        else
-            logg(LEVEL_DBG, "Client connected on port %d", client_addr.sin_port);
+        cnt_decoded++;
+    }
 
-        // wait for join request
-        struct join_request recv_msg;
-        memset(&recv_msg, 0, sizeof(recv_msg));
-        if (recv(client_socket, &recv_msg, sizeof(recv_msg), 0) < 0)
+    apply_messages(decoded, cnt_decoded);
+}
+
+void *udp_port_listener(__attribute__((unused)) void *params)
+{
+    struct datagram received[MAX_RECV_BATCH];
+
+    while (1)
+    {
+        int cnt = recv_datagrams(&state.transport, received, MAX_RECV_BATCH, -1);
+        if (cnt < 0)
         {
-            logg(LEVEL_DBG, "Could not receive join request. Resuming listening...");
+            logg(LEVEL_DBG, "Error occured while receiving UDP message. Resuming listening...");
             continue;
         }
-        logg(LEVEL_DBG, "Received join request from %d-%d", recv_msg.tcp_port, recv_msg.udp_port);
 
-        // reply with join reply
-        remv_peer(&state, recv_msg.tcp_port, recv_msg.udp_port); // remove node if previously among peers
+        handle_datagrams(received, cnt);
+    }
+
+    return NULL;
+}
+
+// RECEIVE WORKERS
+// Each worker reads one socket of the shared UDP port. Probes are acked by the worker right
+// away; everything that changes membership goes to the owner thread, the only one applying it
+struct receive_worker
+{
+    int index;
+    struct transport *transport;
+    struct gossip_message forwarded[MAX_RECV_BATCH];
+};
+
+struct receive_worker *workers;
+struct transport shards[MAX_RECEIVE_WORKERS];
+struct message_queue owner_queue;
+
+// Pins the calling thread to one of the allowed cores, spreading the nodes of a host over them
+void pin_to_core(int index)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
 
-        struct join_reply snd_msg;
-        memset(&snd_msg, 0, sizeof(snd_msg));
+    int target = (state.own_udp_port + index) % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || target-- > 0)
+            continue;
 
-        snd_msg.num_peers = state.num_peers + 1;
-        memcpy(snd_msg.tcp_ports, state.tcp_ports, sizeof(int) * state.num_peers);
-        memcpy(snd_msg.udp_ports, state.udp_ports, sizeof(int) * state.num_peers);
-        snd_msg.tcp_ports[state.num_peers] = state.own_tcp_port;
-        snd_msg.udp_ports[state.num_peers] = state.own_udp_port;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0)
+            logg(LEVEL_DBG, "Failed to pin receive worker %d to core %d", index, cpu);
+        return;
+    }
+}
 
-        if (send(client_socket, &snd_msg, sizeof(snd_msg), 0) < 0)
+void *receive_worker(void *params)
+{
+    struct receive_worker *worker = (struct receive_worker *)params;
+    pin_to_core(worker->index);
+
+    struct datagram received[MAX_RECV_BATCH];
+    while (1)
+    {
+        int cnt = recv_datagrams(worker->transport, received, MAX_RECV_BATCH, -1);
+        if (cnt < 0)
         {
-            logg(LEVEL_DBG, "Error occured while sending join reply. Resume listening...");
+            logg(LEVEL_DBG, "Error occured while receiving UDP message. Resuming listening...");
             continue;
         }
-        else
-            logg(LEVEL_DBG, "Sent join reply successfully");
 
-        close(client_socket);
-        if (append_member(&state, recv_msg.tcp_port, recv_msg.udp_port) == -1)
+        int cnt_forwarded = 0;
+        for (int i = 0; i < cnt; i++)
         {
-            logg(LEVEL_FATAL, "State capacity reached, failed to append member");
-            exit(1);
+            struct gossip_message *msg = &worker->forwarded[cnt_forwarded];
+            if (decode_gossip(received[i].buf, received[i].len, msg) < 0)
+            {
+                logg(LEVEL_DBG, "Dropping malformed UDP message of %d bytes", received[i].len);
+                continue;
+            }
+            cnt_forwarded++;
+
+            // the owner still applies what the probe carries, and answers non-peers
+            if (msg->message_type == PROBE)
+            {
+                answer_probe(&state, msg->node_name_udp);
+                msg->message_type = GOSSIP_UPDATE;
+            }
         }
 
-        append_broadcast(&state, recv_msg.tcp_port, recv_msg.udp_port, 1);
+        int cnt_queued = push_messages(&owner_queue, worker->forwarded, cnt_forwarded);
+        if (cnt_queued < cnt_forwarded)
+            logg(LEVEL_DBG, "Owner queue full, dropped %d messages", cnt_forwarded - cnt_queued);
     }
 
     return NULL;
 }
 
-void *udp_port_listener(__attribute__((unused)) void *params)
+void *membership_owner(__attribute__((unused)) void *params)
 {
-    int fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_socket < 0)
-    {
-        logg(LEVEL_FATAL, "Failed to create UDP socket");
-        exit(1);
-    }
-
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(state.own_udp_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    int cnt_failures_left = 5;
-    while (bind(fd_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    while (1)
     {
-        logg(LEVEL_FATAL, "Tried and failed to bind UDP socket to desired port %d. Retrying...", state.own_udp_port);
-        cnt_failures_left--;
+        wait_messages(&owner_queue);
 
-        if (cnt_failures_left < 0)
-            break;
-        sleep_(0.1);
+        int cnt;
+        while ((cnt = pop_messages(&owner_queue, decoded, MAX_RECV_BATCH)) > 0)
+            apply_messages(decoded, cnt);
     }
 
-    if (cnt_failures_left < 0)
+    return NULL;
+}
+
+void start_receive_workers()
+{
+    init_message_queue(&owner_queue, OWNER_QUEUE_CAPACITY);
+    pthread_t owner_thread;
+    if (pthread_create(&owner_thread, NULL, membership_owner, NULL) != 0)
     {
-        logg(LEVEL_FATAL, "Failed to bind UDP socket to desired port %d.", state.own_udp_port);
+        logg(LEVEL_FATAL, "Failed to create membership owner thread. Exiting...");
         exit(1);
     }
-    while (1)
-    {
-        struct gossip_message recv_msg;
-        memset(&recv_msg, 0, sizeof(recv_msg));
-
-        if (recv(fd_socket, &recv_msg, sizeof(recv_msg), 0) < 0)
-        {
-            logg(LEVEL_DBG, "Error occured while receiving UDP message. Resuming listening...");
-            continue;
-        }
 
-        // reply with NOT_A_PEER if the received message is not from a known peer
-        if (!is_peer(&state, recv_msg.node_name_udp))
+    workers = (struct receive_worker *)mem_alloc(sizeof(struct receive_worker) * cnt_receive_workers);
+    for (int i = 0; i < cnt_receive_workers; i++)
+    {
+        workers[i].index = i;
+        workers[i].transport = &state.transport;
+        if (i > 0)
         {
-            logg(LEVEL_DBG, "Received a message from %d who is not a peer", recv_msg.node_name_udp);
-            reply_not_peer(&state, recv_msg.node_name_udp);
-            continue;
+            if (open_shard(&state.transport, &shards[i]) < 0)
+            {
+                logg(LEVEL_FATAL, "Failed to open receive shard %d", i);
+                exit(1);
+            }
+            workers[i].transport = &shards[i];
         }
 
-        if (recv_msg.message_type == GOSSIP_UPDATE)
-        {
-            logg(LEVEL_DBG, "Received %d changes via gossip", recv_msg.cnt_updates);
-            process_updates(&state, &recv_msg);
-        }
-        if (recv_msg.message_type == PROBE)
-        {
-            logg(LEVEL_DBG, "Probed by %d. Sending reply...", recv_msg.node_name_udp);
-            reply_probe(&state, recv_msg.node_name_udp);
-        }
-        if (recv_msg.message_type == ACK_PROBE)
+        pthread_t worker_thread;
+        if (pthread_create(&worker_thread, NULL, receive_worker, &workers[i]) != 0)
         {
-            check_ack(&state, recv_msg.node_name_udp);             // check ack
-            fulfil_request_probes(&state, recv_msg.node_name_udp); // check if we could answer a REQUEST_PROBE
-        }
-        if (recv_msg.message_type == REQUEST_PROBE)
-        {
-            append_request_probe(&state, recv_msg.target_udp, recv_msg.node_name_udp);
-        }
-        if (recv_msg.message_type == NOT_A_PEER)
-        {
-            logg(LEVEL_INFO, "Received not a peer from %d-%d. Rejoining...", recv_msg.node_name_tcp, recv_msg.node_name_udp);
-            reset_state();
+            logg(LEVEL_FATAL, "Failed to create receive worker thread. Exiting...");
+            exit(1);
         }
     }
 
-    return NULL;
+    logg(LEVEL_INFO, "Receiving on %d workers", cnt_receive_workers);
 }
 
 void *prober(__attribute__((unused)) void *params)
 {
     logg(LEVEL_INFO, "Started probing...");
 
+    init_periodic_timer(&state.probe_timer, PROBE_PERIOD, now_ns());
+
     while (1)
     {
         double to_sleep = get_remaining_grace_period(&state);
         if (to_sleep > 0)
+        {
             sleep_(to_sleep);
+            restart_periodic_timer(&state.probe_timer, now_ns());
+        }
 
-        probe_next(&state);
-        sleep_(1. * PROBE_PERIOD / 4.);
+        if (atomic_load(&rejoin_due))
+        {
+            rejoin_network();
+            atomic_store(&rejoin_due, 0);
+            continue;
+        }
 
-        // if no ack in PROBE_PERIOD / 4, request random peers to probe
-        request_probes_if_no_ack(&state);
-        sleep_(3. * PROBE_PERIOD / 4.);
+        // the current probe's timeouts usually expire well before the next round
+        long long deadline = next_probe_deadline(&state);
+        if (deadline != -1 && deadline < state.probe_timer.next_ns)
+        {
+            sleep_until_ns(deadline);
+            run_probe_deadlines(&state);
+            continue;
+        }
 
-        check_probed(&state);
+        wait_periodic_timer(&state.probe_timer);
+        if (!atomic_load(&rejoin_due))
+            start_probe_round(&state);
     }
 
     return NULL;
@@ -364,14 +484,20 @@ void *gossiper(__attribute__((unused)) void *params)
 {
     logg(LEVEL_INFO, "Started gossiping...");
 
+    init_periodic_timer(&state.gossip_timer, GOSSIP_PERIOD, now_ns());
+
     while (1)
     {
         double to_sleep = get_remaining_grace_period(&state);
         if (to_sleep > 0)
+        {
             sleep_(to_sleep);
+            restart_periodic_timer(&state.gossip_timer, now_ns());
+        }
 
-        gossip_changes(&state);
-        sleep(GOSSIP_PERIOD);
+        wait_periodic_timer(&state.gossip_timer);
+        if (!atomic_load(&rejoin_due))
+            gossip_changes(&state);
     }
 
     return NULL;
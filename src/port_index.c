@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "port_index.h"
+#include "alloc.h"
+
+long long port_key(int tcp_port, int udp_port)
+{
+    return ((long long)tcp_port << 32) | (unsigned int)udp_port;
+}
+
+int port_index_slot(struct port_index *index, long long key)
+{
+    // fibonacci hashing, the high bits of the product are the best mixed
+    unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ull;
+    return (int)(h >> 32) & (index->capacity - 1);
+}
+
+void init_port_index(struct port_index *index, int capacity)
+{
+    index->capacity = 16;
+    while (index->capacity < 2 * capacity)
+        index->capacity *= 2;
+
+    index->size = 0;
+    index->keys = (long long *)mem_alloc(sizeof(long long) * index->capacity);
+    index->values = (int *)mem_alloc(sizeof(int) * index->capacity);
+    memset(index->keys, 0xff, sizeof(long long) * index->capacity);
+}
+
+void free_port_index(struct port_index *index)
+{
+    mem_free(index->keys);
+    mem_free(index->values);
+    index->keys = NULL;
+    index->values = NULL;
+    index->capacity = index->size = 0;
+}
+
+void clear_port_index(struct port_index *index)
+{
+    index->size = 0;
+    memset(index->keys, 0xff, sizeof(long long) * index->capacity);
+}
+
+int port_index_get(struct port_index *index, long long key)
+{
+    int mask = index->capacity - 1;
+    for (int slot = port_index_slot(index, key);; slot = (slot + 1) & mask)
+    {
+        if (index->keys[slot] == -1)
+            return -1;
+        if (index->keys[slot] == key)
+            return index->values[slot];
+    }
+}
+
+void grow_port_index(struct port_index *index)
+{
+    int old_capacity = index->capacity;
+    long long *old_keys = index->keys;
+    int *old_values = index->values;
+
+    init_port_index(index, old_capacity);
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old_keys[i] != -1)
+            port_index_put(index, old_keys[i], old_values[i]);
+    }
+
+    mem_free(old_keys);
+    mem_free(old_values);
+}
+
+void port_index_put(struct port_index *index, long long key, int value)
+{
+    if (2 * (index->size + 1) > index->capacity)
+        grow_port_index(index);
+
+    int mask = index->capacity - 1;
+    int slot = port_index_slot(index, key);
+    while (index->keys[slot] != -1 && index->keys[slot] != key)
+        slot = (slot + 1) & mask;
+
+    if (index->keys[slot] == -1)
+        index->size++;
+    index->keys[slot] = key;
+    index->values[slot] = value;
+}
+
+void port_index_remove(struct port_index *index, long long key)
+{
+    int mask = index->capacity - 1;
+    int slot = port_index_slot(index, key);
+    while (index->keys[slot] != key)
+    {
+        if (index->keys[slot] == -1)
+            return;
+        slot = (slot + 1) & mask;
+    }
+
+    // shift back later entries of the cluster whose home slot is not between the hole and them
+    int hole = slot;
+    for (int next = (hole + 1) & mask; index->keys[next] != -1; next = (next + 1) & mask)
+    {
+        int home = port_index_slot(index, index->keys[next]);
+        int dist_next = (next - home) & mask;
+        int dist_hole = (next - hole) & mask;
+        if (dist_next >= dist_hole)
+        {
+            index->keys[hole] = index->keys[next];
+            index->values[hole] = index->values[next];
+            hole = next;
+        }
+    }
+
+    index->keys[hole] = -1;
+    index->size--;
+}
@@ -0,0 +1,114 @@
+#include <stdatomic.h>
+
+#include "random.h"
+
+struct xoshiro256
+{
+    unsigned long long s[4];
+    int seeded;
+};
+
+_Thread_local struct xoshiro256 generator;
+
+atomic_ullong process_seed = 0x853c49e6748fea9bull;
+atomic_ullong cnt_streams = 0;
+
+unsigned long long splitmix64(unsigned long long *x)
+{
+    unsigned long long z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void seed_generator(struct xoshiro256 *g, unsigned long long seed)
+{
+    for (int i = 0; i < 4; i++)
+        g->s[i] = splitmix64(&seed);
+    g->seeded = 1;
+}
+
+void seed_random(unsigned long long seed)
+{
+    atomic_store(&process_seed, seed);
+    seed_generator(&generator, seed);
+}
+
+unsigned long long rotl(unsigned long long x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+unsigned long long random_u64(void)
+{
+    struct xoshiro256 *g = &generator;
+    if (!g->seeded)
+    {
+        // every other thread gets its own stream of the process seed
+        unsigned long long stream = atomic_fetch_add(&cnt_streams, 1) + 1;
+        seed_generator(g, atomic_load(&process_seed) ^ (stream * 0xd1342543de82ef95ull));
+    }
+
+    unsigned long long result = rotl(g->s[1] * 5, 7) * 9;
+    unsigned long long t = g->s[1] << 17;
+
+    g->s[2] ^= g->s[0];
+    g->s[3] ^= g->s[1];
+    g->s[1] ^= g->s[2];
+    g->s[0] ^= g->s[3];
+    g->s[2] ^= t;
+    g->s[3] = rotl(g->s[3], 45);
+
+    return result;
+}
+
+int random_below(int n)
+{
+    // Lemire's multiply-shift, rejecting the few values that would bias low results
+    unsigned long long bound = (unsigned long long)n;
+    unsigned long long m = (random_u64() >> 32) * bound;
+    if ((m & 0xffffffffull) < bound)
+    {
+        unsigned long long threshold = (0x100000000ull - bound) % bound;
+        while ((m & 0xffffffffull) < threshold)
+            m = (random_u64() >> 32) * bound;
+    }
+    return (int)(m >> 32);
+}
+
+double random_unit(void)
+{
+    return (random_u64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int sample_indexes(int n, int k, int *out)
+{
+    if (k > n)
+        k = n;
+
+    // for j in [n - k, n): take a random t <= j, or j itself if t was already taken
+    int cnt = 0;
+    for (int j = n - k; j < n; j++)
+    {
+        int t = random_below(j + 1);
+        for (int i = 0; i < cnt; i++)
+        {
+            if (out[i] == t)
+            {
+                t = j;
+                break;
+            }
+        }
+        out[cnt++] = t;
+    }
+
+    // Floyd picks a uniform set but not a uniform order, shuffle the k picks
+    for (int i = cnt - 1; i > 0; i--)
+    {
+        int r = random_below(i + 1);
+        int temp = out[i];
+        out[i] = out[r];
+        out[r] = temp;
+    }
+    return cnt;
+}
@@ -0,0 +1,163 @@
+#include "request_table.h"
+
+long long target_key(int target_udp)
+{
+    return port_key(0, target_udp);
+}
+
+int slot_of(struct request_table *table, long long deadline_ns)
+{
+    return (int)((deadline_ns / table->tick_ns) % REQUEST_WHEEL_SLOTS);
+}
+
+void unlink_entry(struct request_table *table, int i)
+{
+    struct request_probe *e = &table->entries[i];
+    if (e->prev != -1)
+        table->entries[e->prev].next = e->next;
+    else
+        table->wheel[e->slot] = e->next;
+    if (e->next != -1)
+        table->entries[e->next].prev = e->prev;
+}
+
+void link_entry(struct request_table *table, int i)
+{
+    struct request_probe *e = &table->entries[i];
+    e->slot = slot_of(table, e->deadline_ns);
+    e->prev = -1;
+    e->next = table->wheel[e->slot];
+    if (e->next != -1)
+        table->entries[e->next].prev = i;
+    table->wheel[e->slot] = i;
+}
+
+void release_entry(struct request_table *table, int i)
+{
+    struct request_probe *e = &table->entries[i];
+    unlink_entry(table, i);
+    port_index_remove(&table->by_target, target_key(e->target_udp));
+
+    e->slot = -1;
+    e->next = table->free_head;
+    table->free_head = i;
+    table->size--;
+}
+
+void init_request_table(struct request_table *table, long long timeout_ns, long long now_ns)
+{
+    table->timeout_ns = timeout_ns;
+    table->tick_ns = 2 * timeout_ns / REQUEST_WHEEL_SLOTS;
+    if (table->tick_ns < 1)
+        table->tick_ns = 1;
+    init_port_index(&table->by_target, REQUEST_TABLE_CAPACITY);
+    clear_request_table(table);
+    table->last_tick = now_ns / table->tick_ns;
+}
+
+void free_request_table(struct request_table *table)
+{
+    free_port_index(&table->by_target);
+}
+
+void clear_request_table(struct request_table *table)
+{
+    table->size = 0;
+    for (int s = 0; s < REQUEST_WHEEL_SLOTS; s++)
+        table->wheel[s] = -1;
+
+    table->free_head = 0;
+    for (int i = 0; i < REQUEST_TABLE_CAPACITY; i++)
+    {
+        table->entries[i].slot = -1;
+        table->entries[i].next = i + 1 < REQUEST_TABLE_CAPACITY ? i + 1 : -1;
+    }
+    clear_port_index(&table->by_target);
+}
+
+int add_request_probe(struct request_table *table, int target_udp, int requestor_udp, long long now_ns)
+{
+    int i = port_index_get(&table->by_target, target_key(target_udp));
+    if (i == -1)
+    {
+        if (table->free_head == -1)
+            return -1;
+
+        i = table->free_head;
+        table->free_head = table->entries[i].next;
+        table->size++;
+
+        table->entries[i].target_udp = target_udp;
+        table->entries[i].cnt_requestors = 0;
+        port_index_put(&table->by_target, target_key(target_udp), i);
+    }
+    else
+        unlink_entry(table, i);
+
+    struct request_probe *e = &table->entries[i];
+    e->deadline_ns = now_ns + table->timeout_ns;
+
+    // a repeated request only refreshes the requestor's timeout
+    int r = 0;
+    while (r < e->cnt_requestors && e->requestor_udps[r] != requestor_udp)
+        r++;
+
+    int ret = 0;
+    if (r < e->cnt_requestors || e->cnt_requestors < REQUESTORS_PER_TARGET)
+    {
+        if (r == e->cnt_requestors)
+            e->cnt_requestors++;
+        e->requestor_udps[r] = requestor_udp;
+        e->requested_ns[r] = now_ns;
+    }
+    else
+        ret = -1;
+
+    link_entry(table, i);
+    return ret;
+}
+
+int take_request_probe(struct request_table *table, int target_udp, int *requestor_udps, long long now_ns)
+{
+    int i = port_index_get(&table->by_target, target_key(target_udp));
+    if (i == -1)
+        return 0;
+
+    struct request_probe *e = &table->entries[i];
+    int cnt = 0;
+    for (int r = 0; r < e->cnt_requestors; r++)
+    {
+        if (e->requested_ns[r] + table->timeout_ns >= now_ns)
+            requestor_udps[cnt++] = e->requestor_udps[r];
+    }
+
+    release_entry(table, i);
+    return cnt;
+}
+
+void expire_request_probes(struct request_table *table, long long now_ns)
+{
+    long long now_tick = now_ns / table->tick_ns;
+
+    // the last visited tick may still hold entries due later within it
+    // and a full turn visits every slot, older ticks need no separate pass
+    long long from = table->last_tick;
+    if (now_tick - from >= REQUEST_WHEEL_SLOTS)
+        from = now_tick - REQUEST_WHEEL_SLOTS + 1;
+
+    for (long long tick = from; tick <= now_tick; tick++)
+    {
+        int i = table->wheel[tick % REQUEST_WHEEL_SLOTS];
+        while (i != -1)
+        {
+            int next = table->entries[i].next;
+            // a slot also holds entries due a whole turn later
+            if (table->entries[i].deadline_ns <= now_ns)
+                release_entry(table, i);
+            i = next;
+        }
+    }
+
+    if (now_tick > table->last_tick)
+        table->last_tick = now_tick;
+}
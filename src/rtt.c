@@ -0,0 +1,34 @@
+#include "rtt.h"
+
+void init_rtt(struct rtt_estimator *rtt)
+{
+    rtt->srtt_ns = 0;
+    rtt->rttvar_ns = 0;
+}
+
+void rtt_sample(struct rtt_estimator *rtt, long long sample_ns)
+{
+    if (sample_ns < 1)
+        sample_ns = 1;
+
+    if (rtt->srtt_ns == 0)
+    {
+        rtt->srtt_ns = sample_ns;
+        rtt->rttvar_ns = sample_ns / 2;
+        return;
+    }
+
+    // rttvar = 3/4 rttvar + 1/4 |srtt - sample|, srtt = 7/8 srtt + 1/8 sample
+    long long err = rtt->srtt_ns - sample_ns;
+    if (err < 0)
+        err = -err;
+    rtt->rttvar_ns += (err - rtt->rttvar_ns) / 4;
+    rtt->srtt_ns += (sample_ns - rtt->srtt_ns) / 8;
+}
+
+long long rtt_timeout_ns(struct rtt_estimator *rtt, long long fallback_ns)
+{
+    if (rtt->srtt_ns == 0)
+        return fallback_ns;
+    return rtt->srtt_ns + 4 * rtt->rttvar_ns;
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "time_utils.h"
+#include "log.h"
+#include "random.h"
+
+void init_periodic_timer(struct periodic_timer *timer, double period_s, long long start_ns)
+{
+    timer->period_ns = (long long)(period_s * 1000000000.);
+    if (timer->period_ns < 1)
+        timer->period_ns = 1;
+
+    restart_periodic_timer(timer, start_ns);
+
+    timer->cnt_ticks = timer->cnt_missed = 0;
+    timer->total_lag_ns = timer->max_lag_ns = timer->last_lag_ns = 0;
+    timer->last_expirations = 0;
+}
+
+void restart_periodic_timer(struct periodic_timer *timer, long long start_ns)
+{
+    // random phase in [0, period)
+    timer->next_ns = start_ns + (long long)(random_unit() * timer->period_ns);
+}
+
+void set_timer_period(struct periodic_timer *timer, long long period_ns)
+{
+    if (period_ns < 1)
+        period_ns = 1;
+    timer->next_ns += period_ns - timer->period_ns;
+    timer->period_ns = period_ns;
+}
+
+void record_timer_ticks(struct periodic_timer *timer, long long now_ns, long long expirations)
+{
+    if (expirations <= 0)
+        return;
+
+    // lag is measured against the deadline of the most recent expiration
+    long long deadline_ns = timer->next_ns + (expirations - 1) * timer->period_ns;
+    long long lag_ns = now_ns - deadline_ns;
+    if (lag_ns < 0)
+        lag_ns = 0;
+
+    timer->cnt_ticks++;
+    timer->cnt_missed += expirations - 1;
+    timer->total_lag_ns += lag_ns;
+    timer->last_lag_ns = lag_ns;
+    timer->last_expirations = expirations;
+    if (lag_ns > timer->max_lag_ns)
+        timer->max_lag_ns = lag_ns;
+
+    timer->next_ns = deadline_ns + timer->period_ns;
+}
+
+void wait_periodic_timer(struct periodic_timer *timer)
+{
+    sleep_until_ns(timer->next_ns);
+
+    // if we overslept by whole periods, those ticks are dropped rather than fired in a burst
+    long long now = now_ns();
+    long long expirations = 1 + (now - timer->next_ns) / timer->period_ns;
+    record_timer_ticks(timer, now, expirations);
+}
+
+double average_lag_ms(struct periodic_timer *timer)
+{
+    if (timer->cnt_ticks == 0)
+        return 0.;
+    return 1. * timer->total_lag_ns / timer->cnt_ticks / 1000000.;
+}
+
+void log_timer_lag(const char *name, struct periodic_timer *timer)
+{
+    logg(LEVEL_INFO, "%s timer lag: avg %.3f ms, max %.3f ms, %lld ticks, %lld missed",
+         name, average_lag_ms(timer), timer->max_lag_ns / 1000000., timer->cnt_ticks, timer->cnt_missed);
+}
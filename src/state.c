@@ -2,237 +2,555 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
-#include <time.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <limits.h>
 
 #include "log.h"
 #include "state.h"
+#include "membership.h"
+#include "journal.h"
+#include "transport.h"
+#include "wire.h"
 #include "gossip_message.h"
 #include "constants.h"
+#include "time_utils.h"
+#include "random.h"
+#include "alloc.h"
 
-void populate_peers(struct node_state *state, int num_peers, int *tcp_ports, int *udp_ports)
-{
-    state->capacity = CAPACITY;
-    state->num_peers = num_peers;
+struct member_view *build_member_view(struct node_state *state);
 
-    if (state->tcp_ports != NULL)
-        free(state->tcp_ports);
-    if (state->udp_ports != NULL)
-        free(state->udp_ports);
-    state->tcp_ports = (int *)malloc(sizeof(int) * state->capacity);
-    state->udp_ports = (int *)malloc(sizeof(int) * state->capacity);
+void init_node_state(struct node_state *state, int tcp_port, int udp_port)
+{
+    init_domain_lock(&state->members_lock);
+    init_domain_lock(&state->probes_lock);
+    init_domain_lock(&state->request_probes_lock);
+    init_domain_lock(&state->broadcasts_lock);
+
+    state->own_tcp_port = tcp_port;
+    state->own_udp_port = udp_port;
+
+    state->lamport_time = 0;
+    atomic_init(&state->grace_period_until, 0);
+    atomic_init(&state->health, 0);
+    state->incarnation = 0;
+    state->not_peer_since = 0;
+    init_member_table(&state->members, INITIAL_MEMBERS_CAPACITY);
+    init_port_index(&state->graveyard, INITIAL_MEMBERS_CAPACITY);
+    state->cnt_graves = state->first_grave = 0;
+    state->graves_capacity = INITIAL_MEMBERS_CAPACITY;
+    state->graves = (struct grave *)mem_alloc(sizeof(struct grave) * state->graves_capacity);
+
+    state->cnt_suspects = 0;
+    state->suspects_capacity = INITIAL_MEMBERS_CAPACITY;
+    state->suspects = (struct suspicion *)mem_alloc(sizeof(struct suspicion) * state->suspects_capacity);
+
+    init_broadcast_queue(&state->broadcasts, INITIAL_BROADCASTS_CAPACITY);
+    state->cnt_probes = 0;
+    state->probes = (struct probe_session *)mem_alloc(sizeof(struct probe_session) * MAX_CONCURRENT_PROBES);
+    state->cnt_probing = state->probe_cursor = 0;
+    state->probing_capacity = INITIAL_MEMBERS_CAPACITY;
+    state->tcp_ports_to_probe = (int *)mem_alloc(sizeof(int) * state->probing_capacity);
+    state->udp_ports_to_probe = (int *)mem_alloc(sizeof(int) * state->probing_capacity);
+    init_request_table(&state->request_probes, (long long)(REQUEST_PROBE_TIMEOUT * 1000000000.), now_ns());
+
+    state->members_changed = 0;
+    state->cnt_views = 0;
+    state->retired_views = NULL;
+    atomic_init(&state->view, build_member_view(state));
+}
 
-    memcpy(state->tcp_ports, tcp_ports, sizeof(int) * num_peers);
-    memcpy(state->udp_ports, udp_ports, sizeof(int) * num_peers);
+// MEMBER VIEW
+// Writers copy the member table into a view and swap it in when they release the members
+// lock. A reader counts itself in the view it loaded and checks that the view is still the
+// current one, so a retired view whose count is zero can no longer be entered and is rebuilt
+// in place. Views are never freed, only their arrays, which readers touch only after the check
 
-    // get current time
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
+// Sizes the arrays of a view nobody reads
+void size_member_view(struct member_view *view, int capacity, int index_capacity)
+{
+    mem_free(view->by_udp.keys);
+
+    // keys first, they need the strictest alignment
+    view->by_udp.keys = (long long *)mem_alloc(sizeof(long long) * index_capacity + sizeof(int) * (3 * capacity + index_capacity));
+    view->capacity = capacity;
+    view->by_udp.capacity = index_capacity;
+    view->tcp_ports = (int *)(view->by_udp.keys + index_capacity);
+    view->udp_ports = view->tcp_ports + capacity;
+    view->incarnations = view->udp_ports + capacity;
+    view->by_udp.values = view->incarnations + capacity;
+}
 
-    long long ns = tp.tv_sec * 1000000000ll + tp.tv_nsec;
-    state->grace_period_until = ns + GRACE_PERIOD * 1000000000ll;
+struct member_view *new_member_view(struct node_state *state)
+{
+    struct member_view *view = (struct member_view *)mem_alloc(sizeof(struct member_view));
+    atomic_init(&view->readers, 0);
+    view->by_udp.keys = NULL;
+    state->cnt_views++;
+    return view;
 }
 
-int append_member(struct node_state *state, int tcp_port, int udp_port)
+// Copies the member table into a retired view without readers, or a new one if all have some
+// Must be called while holding the members lock
+struct member_view *build_member_view(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
-    if (state->num_peers + 1 > state->capacity)
-    {
-        pthread_mutex_unlock(&state->lock);
-        return -1;
-    }
+    struct member_view **link = &state->retired_views;
+    while (*link != NULL && atomic_load(&(*link)->readers) != 0)
+        link = &(*link)->next_retired;
 
-    state->tcp_ports[state->num_peers] = tcp_port;
-    state->udp_ports[state->num_peers] = udp_port;
-    state->num_peers++;
+    struct member_view *view = *link;
+    if (view != NULL)
+        *link = view->next_retired;
+    else
+        view = new_member_view(state);
+
+    struct member_table *members = &state->members;
+    if (view->by_udp.keys == NULL || view->capacity < members->num_peers || view->by_udp.capacity != members->by_udp.capacity)
+        size_member_view(view, members->capacity, members->by_udp.capacity);
+
+    view->num_peers = members->num_peers;
+    view->own_incarnation = state->incarnation;
+    memcpy(view->tcp_ports, members->tcp_ports, sizeof(int) * members->num_peers);
+    memcpy(view->udp_ports, members->udp_ports, sizeof(int) * members->num_peers);
+    memcpy(view->incarnations, members->incarnations, sizeof(int) * members->num_peers);
+    view->by_udp.size = members->by_udp.size;
+    memcpy(view->by_udp.keys, members->by_udp.keys, sizeof(long long) * members->by_udp.capacity);
+    memcpy(view->by_udp.values, members->by_udp.values, sizeof(int) * members->by_udp.capacity);
+    view->next_retired = NULL;
+    return view;
+}
 
-    pthread_mutex_unlock(&state->lock);
-    return 0;
+// Must be called while holding the members lock
+void publish_member_view(struct node_state *state)
+{
+    struct member_view *replaced = atomic_exchange(&state->view, build_member_view(state));
+    replaced->next_retired = state->retired_views;
+    state->retired_views = replaced;
+    state->members_changed = 0;
 }
 
-char *print_peers(struct node_state *state)
+void reserve_member_views(struct node_state *state, int cnt)
 {
-    pthread_mutex_lock(&state->lock);
-    char *peer_string = malloc(50 + state->num_peers * 15);
-    memset(peer_string, 0, 50 + state->num_peers * 15);
+    lock_members(state);
 
-    sprintf(peer_string, "%d peers: ", state->num_peers);
-    for (int i = 0; i < state->num_peers; i++)
+    struct member_table *members = &state->members;
+    while (state->cnt_views < cnt)
+    {
+        struct member_view *view = new_member_view(state);
+        view->next_retired = state->retired_views;
+        state->retired_views = view;
+    }
+    for (struct member_view *view = state->retired_views; view != NULL; view = view->next_retired)
     {
-        char peer_repr[13], sep = ' ';
-        if (i < state->num_peers - 1)
-            sep = ',';
-        sprintf(peer_repr, "%d-%d%c ", state->tcp_ports[i], state->udp_ports[i], sep);
-        strcat(peer_string, peer_repr);
+        if (atomic_load(&view->readers) == 0 && (view->by_udp.keys == NULL || view->capacity < members->capacity || view->by_udp.capacity != members->by_udp.capacity))
+            size_member_view(view, members->capacity, members->by_udp.capacity);
     }
 
-    pthread_mutex_unlock(&state->lock);
-    return peer_string;
+    unlock_members(state);
 }
 
-int get_gossip_rounds(struct node_state *state)
+struct member_view *enter_member_view(struct node_state *state)
 {
-    if (state->num_peers == 0)
-        return 1;
-    return 2 * (int)log(state->num_peers);
+    while (1)
+    {
+        struct member_view *view = atomic_load(&state->view);
+        atomic_fetch_add(&view->readers, 1);
+        if (atomic_load(&state->view) == view)
+            return view;
+
+        // replaced in between and possibly being rebuilt, its contents may be anything
+        atomic_fetch_sub(&view->readers, 1);
+    }
 }
 
-void add_broadcast_to_list(struct node_state *state, int tcp_port, int udp_port, int status)
+void leave_member_view(struct member_view *view)
 {
-    struct broadcast b;
-    b.tcp_port = tcp_port;
-    b.udp_port = udp_port;
-    b.status = status;
-    b.remaining_rounds = get_gossip_rounds(state);
+    atomic_fetch_sub(&view->readers, 1);
+}
 
-    if (state->cnt_broadcast >= state->broadcast_list_capacity)
-    { // extend broadcast list capacity
-        state->broadcast_list_capacity *= 2;
-        state->broadcast_list = (struct broadcast *)realloc(state->broadcast_list, sizeof(struct broadcast) * state->broadcast_list_capacity);
-    }
+int view_has_peer(struct member_view *view, int udp_port)
+{
+    return port_index_get(&view->by_udp, udp_port) != -1;
+}
 
-    state->broadcast_list[state->cnt_broadcast] = b;
-    state->cnt_broadcast++;
+int count_peers(struct node_state *state)
+{
+    struct member_view *view = enter_member_view(state);
+    int num_peers = view->num_peers;
+    leave_member_view(view);
+    return num_peers;
 }
 
-void append_broadcast(struct node_state *state, int tcp_port, int udp_port, int status)
+void lock_members(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
+    lock_domain(&state->members_lock);
+}
 
-    add_broadcast_to_list(state, tcp_port, udp_port, status);
+// Publishes a new view if the members changed since the lock was taken, then writes out
+// the journal records of the changes
+void unlock_members(struct node_state *state)
+{
+    if (state->members_changed)
+        publish_member_view(state);
+    unlock_domain(&state->members_lock);
+    journal_flush();
+}
 
-    pthread_mutex_unlock(&state->lock);
+long long suspicion_timeout_ns(struct node_state *state)
+{
+    double scale = log10(state->members.num_peers + 1);
+    if (scale < 1)
+        scale = 1;
+    return (long long)(SUSPICION_MULT * scale * PROBE_PERIOD * 1000000000.);
 }
 
-void tidy_broadcast_list(struct node_state *state)
+void start_suspicion(struct node_state *state, int tcp_port, int udp_port)
 {
-    struct broadcast *tidied_list = (struct broadcast *)malloc(sizeof(struct broadcast) * state->cnt_broadcast);
+    if (state->cnt_suspects >= state->suspects_capacity)
+    { // extend suspects capacity
+        state->suspects_capacity *= 2;
+        state->suspects = (struct suspicion *)mem_realloc(state->suspects, sizeof(struct suspicion) * state->suspects_capacity);
+    }
 
-    int rem_broadcasts = 0;
-    for (int i = 0; i < state->cnt_broadcast; i++)
+    struct suspicion *s = &state->suspects[state->cnt_suspects++];
+    s->tcp_port = tcp_port;
+    s->udp_port = udp_port;
+    s->deadline_ns = now_ns() + suspicion_timeout_ns(state);
+}
+
+void stop_suspicion(struct node_state *state, int tcp_port, int udp_port)
+{
+    for (int i = 0; i < state->cnt_suspects; i++)
     {
-        if (state->broadcast_list[i].remaining_rounds > 0)
+        if (state->suspects[i].tcp_port == tcp_port && state->suspects[i].udp_port == udp_port)
         {
-            tidied_list[rem_broadcasts] = state->broadcast_list[i];
-            rem_broadcasts++;
+            state->suspects[i] = state->suspects[--state->cnt_suspects];
+            return;
         }
     }
+}
+
+// Rebuilds the probe order as a random permutation of the members, once per full pass
+void shuffle_ports_to_probe(struct node_state *state)
+{
+    if (state->probing_capacity < state->members.num_peers)
+    {
+        state->probing_capacity = state->members.capacity;
+        state->tcp_ports_to_probe = (int *)mem_realloc(state->tcp_ports_to_probe, sizeof(int) * state->probing_capacity);
+        state->udp_ports_to_probe = (int *)mem_realloc(state->udp_ports_to_probe, sizeof(int) * state->probing_capacity);
+    }
 
-    state->cnt_broadcast = rem_broadcasts;
-    for (int i = 0; i < rem_broadcasts; i++)
+    state->cnt_probing = state->members.num_peers;
+    state->probe_cursor = 0;
+    for (int i = 0; i < state->cnt_probing; i++)
     {
-        state->broadcast_list[i] = tidied_list[i];
+        int j = random_below(i + 1);
+        state->tcp_ports_to_probe[i] = state->tcp_ports_to_probe[j];
+        state->udp_ports_to_probe[i] = state->udp_ports_to_probe[j];
+        state->tcp_ports_to_probe[j] = state->members.tcp_ports[i];
+        state->udp_ports_to_probe[j] = state->members.udp_ports[i];
     }
-    free(tidied_list);
 }
 
-void send_gossip_message_to(int udp_port, struct gossip_message *gossip)
+// Puts a new member at a random position of the rest of the current pass, in O(1)
+void insert_port_to_probe(struct node_state *state, int tcp_port, int udp_port)
 {
-    int fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_socket < 0)
+    if (state->cnt_probing >= state->probing_capacity)
     {
-        logg(LEVEL_DBG, "Failed to open UDP socket");
-        return;
+        state->probing_capacity = 2 * state->probing_capacity > 0 ? 2 * state->probing_capacity : INITIAL_MEMBERS_CAPACITY;
+        state->tcp_ports_to_probe = (int *)mem_realloc(state->tcp_ports_to_probe, sizeof(int) * state->probing_capacity);
+        state->udp_ports_to_probe = (int *)mem_realloc(state->udp_ports_to_probe, sizeof(int) * state->probing_capacity);
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(udp_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    int j = state->probe_cursor + random_below(state->cnt_probing - state->probe_cursor + 1);
+    state->tcp_ports_to_probe[state->cnt_probing] = state->tcp_ports_to_probe[j];
+    state->udp_ports_to_probe[state->cnt_probing] = state->udp_ports_to_probe[j];
+    state->tcp_ports_to_probe[j] = tcp_port;
+    state->udp_ports_to_probe[j] = udp_port;
+    state->cnt_probing++;
+}
+
+// Next member of the probe order, skipping those removed since the pass began
+// Returns -1 if there are no members
+int next_port_to_probe(struct node_state *state, int *tcp_port, int *udp_port)
+{
+    if (state->members.num_peers == 0)
+        return -1;
 
-    if (sendto(fd_socket, gossip, sizeof(*gossip), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    while (1)
     {
-        logg(LEVEL_DBG, "Failed to reach send UDP message to %d", udp_port);
+        if (state->probe_cursor >= state->cnt_probing)
+            shuffle_ports_to_probe(state);
+
+        *tcp_port = state->tcp_ports_to_probe[state->probe_cursor];
+        *udp_port = state->udp_ports_to_probe[state->probe_cursor];
+        state->probe_cursor++;
+        if (lookup_member(&state->members, *tcp_port, *udp_port) != -1)
+            return 0;
     }
 }
 
-void swap(int *a, int *b)
+// Must be called while holding the members lock
+int is_stale_grave(struct node_state *state, struct grave *grave)
 {
-    int temp = *a;
-    *a = *b;
-    *b = temp;
+    return port_index_get(&state->graveyard, grave->key) != grave->incarnation;
 }
 
-// Fisher Yates algorithm for random shuffling an array in linear time
-int *fisher_yates_(int *a, int nr)
+// Must be called while holding the members lock
+void drop_oldest_grave(struct node_state *state)
 {
-    int *b = (int *)malloc(nr * sizeof(int));
-    memcpy(b, a, nr * sizeof(int));
+    struct grave *grave = &state->graves[state->first_grave];
+    if (!is_stale_grave(state, grave))
+        port_index_remove(&state->graveyard, grave->key);
+    state->first_grave = (state->first_grave + 1) & (state->graves_capacity - 1);
+    state->cnt_graves--;
+}
+
+void expire_graves(struct node_state *state, long long ns)
+{
+    long long lifetime_ns = GRAVE_SUSPICION_MULT * suspicion_timeout_ns(state);
+    while (state->cnt_graves > 0 && state->graves[state->first_grave].buried_ns + lifetime_ns <= ns)
+        drop_oldest_grave(state);
+}
+
+// Makes room for one more burial: stale entries are dropped first, the ring only grows
+// if that left it more than half full, and past MAX_GRAVES the oldest burial goes
+// Must be called while holding the members lock
+void make_room_for_grave(struct node_state *state)
+{
+    if (state->cnt_graves < state->graves_capacity)
+        return;
+
+    int mask = state->graves_capacity - 1, cnt = 0;
+    for (int i = 0; i < state->cnt_graves; i++)
+    {
+        struct grave *grave = &state->graves[(state->first_grave + i) & mask];
+        if (!is_stale_grave(state, grave))
+            state->graves[(state->first_grave + cnt++) & mask] = *grave;
+    }
+    state->cnt_graves = cnt;
 
-    for (int i = nr - 1; i >= 0; i--)
+    if (cnt == MAX_GRAVES)
+        drop_oldest_grave(state);
+    else if (cnt > state->graves_capacity / 2)
     {
-        int rand_idx = rand() % (i + 1);
-        swap(&b[i], &b[rand_idx]);
+        struct grave *graves = (struct grave *)mem_alloc(sizeof(struct grave) * 2 * state->graves_capacity);
+        for (int i = 0; i < cnt; i++)
+            graves[i] = state->graves[(state->first_grave + i) & mask];
+        mem_free(state->graves);
+        state->graves = graves;
+        state->graves_capacity *= 2;
+        state->first_grave = 0;
     }
-    return b;
 }
 
-void shuffle_ports_to_probe(struct node_state *state)
+// Must be called while holding the members lock
+void bury(struct node_state *state, long long key, int incarnation)
+{
+    long long ns = now_ns();
+    expire_graves(state, ns);
+    make_room_for_grave(state);
+
+    struct grave *grave = &state->graves[(state->first_grave + state->cnt_graves++) & (state->graves_capacity - 1)];
+    grave->key = key;
+    grave->incarnation = incarnation;
+    grave->buried_ns = ns;
+    port_index_put(&state->graveyard, key, incarnation);
+}
+
+// reason is JOURNAL_DEAD when this node declared the member dead itself, JOURNAL_REMOVED otherwise
+void remove_peer(struct node_state *state, int idx_peer, int reason)
 {
-    // clear data structure
-    state->cnt_probing = state->num_peers;
-    if (state->tcp_ports_to_probe != NULL)
-        free(state->tcp_ports_to_probe);
-    if (state->udp_ports_to_probe != NULL)
-        free(state->udp_ports_to_probe);
+    int tcp_port = state->members.tcp_ports[idx_peer];
+    int udp_port = state->members.udp_ports[idx_peer];
+
+    journal_event(reason, tcp_port, udp_port);
+    bury(state, port_key(tcp_port, udp_port), state->members.incarnations[idx_peer]);
+    stop_suspicion(state, tcp_port, udp_port);
+    delete_member_at(&state->members, idx_peer);
+    state->members_changed = 1;
+}
 
-    state->tcp_ports_to_probe = (int *)malloc(sizeof(int) * state->cnt_probing);
-    state->udp_ports_to_probe = (int *)malloc(sizeof(int) * state->cnt_probing);
+// Adds the member, or revives it if already present, as alive at the given incarnation
+void add_peer(struct node_state *state, int tcp_port, int udp_port, int incarnation)
+{
+    int num_peers = state->members.num_peers;
+    int idx_peer = insert_member(&state->members, tcp_port, udp_port);
+    state->members.incarnations[idx_peer] = incarnation;
+    state->members.statuses[idx_peer] = MEMBER_ALIVE;
+    state->members_changed = 1;
+
+    port_index_remove(&state->graveyard, port_key(tcp_port, udp_port));
+    stop_suspicion(state, tcp_port, udp_port);
+    if (state->members.num_peers > num_peers)
+    {
+        insert_port_to_probe(state, tcp_port, udp_port);
+        journal_event(JOURNAL_JOIN, tcp_port, udp_port);
+    }
+}
 
-    // shuffle indices
-    int *idx = (int *)malloc(sizeof(int) * state->cnt_probing);
-    for (int i = 0; i < state->cnt_probing; i++)
-        idx[i] = i;
-    int *shuffle_idx = fisher_yates_(idx, state->cnt_probing);
-    free(idx);
+void suspect_peer(struct node_state *state, int idx_peer)
+{
+    state->members.statuses[idx_peer] = MEMBER_SUSPECT;
+    start_suspicion(state, state->members.tcp_ports[idx_peer], state->members.udp_ports[idx_peer]);
+    journal_event(JOURNAL_SUSPECT, state->members.tcp_ports[idx_peer], state->members.udp_ports[idx_peer]);
+}
 
-    for (int i = 0; i < state->cnt_probing; i++)
+void populate_peers(struct node_state *state, int num_peers, int *tcp_ports, int *udp_ports, int *incarnations)
+{
+    lock_members(state);
+
+    if (state->members.tcp_ports != NULL)
+        free_member_table(&state->members);
+    init_member_table(&state->members, num_peers > INITIAL_MEMBERS_CAPACITY ? num_peers : INITIAL_MEMBERS_CAPACITY);
+    state->cnt_suspects = 0;
+    state->cnt_probing = state->probe_cursor = 0; // reshuffled on the next probe
+
+    for (int i = 0; i < num_peers; i++)
     {
-        state->tcp_ports_to_probe[i] = state->tcp_ports[shuffle_idx[i]];
-        state->udp_ports_to_probe[i] = state->udp_ports[shuffle_idx[i]];
+        int idx_peer = insert_member(&state->members, tcp_ports[i], udp_ports[i]);
+        if (incarnations != NULL)
+            state->members.incarnations[idx_peer] = incarnations[i];
+        port_index_remove(&state->graveyard, port_key(tcp_ports[i], udp_ports[i]));
     }
-    free(shuffle_idx);
+    journal_reset(num_peers, tcp_ports, udp_ports);
+    state->members_changed = 1;
+
+    atomic_store(&state->grace_period_until, now_ns() + GRACE_PERIOD * 1000000000ll);
+
+    unlock_members(state);
 }
 
-int *get_random_peers(struct node_state *state, int requested_peers, int *cnt_peers)
+void append_member(struct node_state *state, int tcp_port, int udp_port, int incarnation)
 {
-    int *k = malloc(requested_peers * sizeof(int));
-    *cnt_peers = 0;
+    lock_members(state);
+    add_peer(state, tcp_port, udp_port, incarnation);
+    unlock_members(state);
+}
 
-    int *rand = fisher_yates_(state->udp_ports, state->num_peers);
-    for (int i = 0; i < state->num_peers && i < requested_peers; i++)
+// Copies the current members followed by this node into a new snapshot holding one reference
+struct member_snapshot *take_member_snapshot(struct node_state *state)
+{
+    struct member_view *view = enter_member_view(state);
+
+    int cnt = view->num_peers + 1;
+    struct member_snapshot *snapshot = (struct member_snapshot *)mem_alloc(sizeof(struct member_snapshot) + sizeof(struct join_member) * cnt);
+    snapshot->refs = 1;
+    snapshot->taken_ns = now_ns();
+    snapshot->num_members = cnt;
+    for (int i = 0; i < view->num_peers; i++)
     {
-        k[i] = rand[i];
-        *cnt_peers = *cnt_peers + 1;
+        snapshot->members[i].tcp_port = view->tcp_ports[i];
+        snapshot->members[i].udp_port = view->udp_ports[i];
+        snapshot->members[i].incarnation = view->incarnations[i];
     }
-    free(rand);
+    snapshot->members[cnt - 1].tcp_port = state->own_tcp_port;
+    snapshot->members[cnt - 1].udp_port = state->own_udp_port;
+    snapshot->members[cnt - 1].incarnation = view->own_incarnation;
+
+    leave_member_view(view);
+    return snapshot;
+}
+
+int get_gossip_rounds(struct node_state *state)
+{
+    int num_peers = count_peers(state);
+    if (num_peers == 0)
+        return 1;
+    return 2 * (int)log(num_peers);
+}
+
+void add_broadcast_to_list(struct node_state *state, int tcp_port, int udp_port, int status, int incarnation)
+{
+    int rounds = get_gossip_rounds(state);
+
+    lock_domain(&state->broadcasts_lock);
+    push_broadcast(&state->broadcasts, tcp_port, udp_port, status, incarnation, rounds);
+    unlock_domain(&state->broadcasts_lock);
+}
+
+void append_broadcast(struct node_state *state, int tcp_port, int udp_port, int status, int incarnation)
+{
+    add_broadcast_to_list(state, tcp_port, udp_port, status, incarnation);
+}
 
-    return k;
+// Attaches up to PIGGYBACK_LIMIT pending broadcasts to an outgoing message,
+// the least transmitted first
+void piggyback_updates(struct node_state *state, struct gossip_message *gossip)
+{
+    gossip->cnt_updates = 0;
+    lock_domain(&state->broadcasts_lock);
+    pack_broadcasts(&state->broadcasts, gossip, PIGGYBACK_LIMIT, WIRE_UPDATES_BUDGET);
+    unlock_domain(&state->broadcasts_lock);
 }
 
-int *get_random_peers_except(struct node_state *state, int requested_peers, int *cnt_peers, int exception)
+int send_gossip_message_to(struct node_state *state, int udp_port, struct gossip_message *gossip)
 {
-    int *k = malloc(requested_peers * sizeof(int));
-    *cnt_peers = 0;
+    check_unlocked("Sending a datagram");
 
-    int *rand = fisher_yates_(state->udp_ports, state->num_peers);
-    int ptr_k = 0;
-    for (int i = 0; i < state->num_peers && *cnt_peers < requested_peers; i++)
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+    int len = encode_gossip(gossip, buf, sizeof(buf));
+    if (len < 0)
     {
-        if (rand[i] != exception)
+        logg(LEVEL_FATAL, "Failed to encode message for %d", udp_port);
+        return -1;
+    }
+
+    if (send_datagram(&state->transport, udp_port, buf, len) < 0)
+    {
+        logg(LEVEL_DBG, "Failed to reach send UDP message to %d", udp_port);
+        return -1;
+    }
+    return 0;
+}
+
+// Sends the same message to all given peers in a single batch
+void send_gossip_message_to_all(struct node_state *state, int *udp_ports, int cnt, struct gossip_message *gossip)
+{
+    check_unlocked("Sending datagrams");
+
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+    int len = encode_gossip(gossip, buf, sizeof(buf));
+    if (len < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to encode message for %d peers", cnt);
+        return;
+    }
+
+    struct datagram datagrams[MAX_SEND_BATCH];
+    for (int start = 0; start < cnt; start += MAX_SEND_BATCH)
+    {
+        int batch = 0;
+        for (int i = start; i < cnt && batch < MAX_SEND_BATCH; i++, batch++)
         {
-            k[ptr_k++] = rand[i];
-            *cnt_peers = *cnt_peers + 1;
+            datagrams[batch].udp_port = udp_ports[i];
+            datagrams[batch].buf = buf;
+            datagrams[batch].len = len;
         }
+        send_datagrams(&state->transport, datagrams, batch);
     }
-    free(rand);
+}
+
+// Fills peers with up to k distinct random members of the view
+// Returns the number of peers written
+int get_random_peers(struct member_view *view, int *peers, int k)
+{
+    int cnt = sample_indexes(view->num_peers, k, peers);
+    for (int i = 0; i < cnt; i++)
+        peers[i] = view->udp_ports[peers[i]];
+    return cnt;
+}
+
+// Same as get_random_peers, never picking the member with the exception udp port
+int get_random_peers_except(struct member_view *view, int *peers, int k, int exception)
+{
+    int idx_exception = port_index_get(&view->by_udp, exception);
+    if (idx_exception == -1)
+        return get_random_peers(view, peers, k);
 
-    return k;
+    // sample the other members, then step over the exception's position
+    int cnt = sample_indexes(view->num_peers - 1, k, peers);
+    for (int i = 0; i < cnt; i++)
+        peers[i] = view->udp_ports[peers[i] >= idx_exception ? peers[i] + 1 : peers[i]];
+    return cnt;
 }
 
 void check_fy(int *a, int cnt)
@@ -263,35 +581,31 @@ void check_fy(int *a, int cnt)
         logg(LEVEL_DBG, "Fisher Yates ok");
 }
 
+// Sends one datagram of the least transmitted broadcasts per gossip round, which bounds the
+// bandwidth no matter how many updates are queued
 void gossip_changes(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
-    if (state->cnt_broadcast == 0)
-    {
-        pthread_mutex_unlock(&state->lock);
-        return;
-    }
-
     struct gossip_message gossip;
+    memset(&gossip, 0, sizeof(gossip));
 
     gossip.message_type = GOSSIP_UPDATE;
     gossip.node_name_tcp = state->own_tcp_port;
     gossip.node_name_udp = state->own_udp_port;
     gossip.node_time = state->lamport_time;
-    gossip.cnt_updates = state->cnt_broadcast;
-    for (int i = 0; i < gossip.cnt_updates; i++)
-    {
-        gossip.tcp_ports[i] = state->broadcast_list[i].tcp_port;
-        gossip.udp_ports[i] = state->broadcast_list[i].udp_port;
-        gossip.statuses[i] = state->broadcast_list[i].status;
-        state->broadcast_list[i].remaining_rounds--;
-    }
 
-    tidy_broadcast_list(state);
+    lock_domain(&state->broadcasts_lock);
+    int pending = state->broadcasts.size > 0;
+    if (pending)
+        pack_broadcasts(&state->broadcasts, &gossip, UPDATES_PER_MESSAGE, WIRE_UPDATES_BUDGET);
+    unlock_domain(&state->broadcasts_lock);
+    if (!pending)
+        return;
 
     // send message to (at most) fan_out random peers
-    int cnt_random_peers;
-    int *random_peers = get_random_peers(state, FAN_OUT, &cnt_random_peers);
+    int random_peers[FAN_OUT];
+    struct member_view *view = enter_member_view(state);
+    int cnt_random_peers = get_random_peers(view, random_peers, FAN_OUT);
+    leave_member_view(view);
 
 #ifdef SAFE_MODE
     check_fy(random_peers, cnt_random_peers);
@@ -300,451 +614,860 @@ void gossip_changes(struct node_state *state)
     for (int i = 0; i < cnt_random_peers; i++)
     {
         logg(LEVEL_DBG, "Gossiping %d changes to %d", gossip.cnt_updates, random_peers[i]);
-        send_gossip_message_to(random_peers[i], &gossip);
     }
-    free(random_peers);
-
-    pthread_mutex_unlock(&state->lock);
+    send_gossip_message_to_all(state, random_peers, cnt_random_peers, &gossip);
 }
 
 int idx_of(struct node_state *state, int tcp_port, int udp_port)
 {
-    int idx_state = -1;
-    for (int i = 0; i < state->num_peers; i++)
-    {
-        if (state->tcp_ports[i] == tcp_port && state->udp_ports[i] == udp_port)
-        {
-            idx_state = i;
-            break;
-        }
-    }
-    return idx_state;
+    return lookup_member(&state->members, tcp_port, udp_port);
 }
 
-void remove_peer(struct node_state *state, int idx_peer)
+void adjust_health(struct node_state *state, int delta)
 {
-    int *tcp_ports = malloc(sizeof(int) * (state->num_peers - 1));
-    int *udp_ports = malloc(sizeof(int) * (state->num_peers - 1));
-
-    int ptr = 0;
-    for (int i = 0; i < state->num_peers; i++)
+    int health = atomic_load(&state->health), adjusted;
+    do
     {
-        if (i != idx_peer)
-        {
-            tcp_ports[ptr] = state->tcp_ports[i];
-            udp_ports[ptr] = state->udp_ports[i];
-            ptr++;
-        }
-    }
-
-    state->num_peers--;
-    for (int i = 0; i < ptr; i++)
-    {
-        state->tcp_ports[i] = tcp_ports[i];
-        state->udp_ports[i] = udp_ports[i];
-    }
-
-    free(tcp_ports);
-    free(udp_ports);
+        adjusted = health + delta;
+        if (adjusted < 0)
+            adjusted = 0;
+        if (adjusted > MAX_HEALTH)
+            adjusted = MAX_HEALTH;
+    } while (!atomic_compare_exchange_weak(&state->health, &health, adjusted));
+
+    if (adjusted != health)
+        logg(LEVEL_DBG, "Local health %d -> %d", health, adjusted);
 }
 
-void add_peer(struct node_state *state, int tcp_port, int udp_port)
+// Someone suspects or buried this node at the given incarnation, outbid it
+// Must be called while holding the members lock
+void refute(struct node_state *state, int incarnation)
 {
-    state->tcp_ports[state->num_peers] = tcp_port;
-    state->udp_ports[state->num_peers] = udp_port;
-    state->num_peers++;
-}
+    if (incarnation < state->incarnation)
+        return;
 
-void fix_broadcast_list(struct node_state *state)
-{
-    int ptr_broadcast = 0;
-    struct broadcast *fixed_list = (struct broadcast *)malloc(sizeof(struct broadcast) * state->cnt_broadcast);
+    state->incarnation = incarnation + 1;
+    state->members_changed = 1;
+    logg(LEVEL_INFO, "Refuting suspicion with incarnation %d", state->incarnation);
 
-    for (int i = 0; i < state->cnt_broadcast; i++)
-    {
-        if (state->broadcast_list[i].status == 0 && idx_of(state, state->broadcast_list[i].tcp_port, state->broadcast_list[i].udp_port) > 0)
-        {
-            continue;
-        }
-        if (state->broadcast_list[i].status == 1 && idx_of(state, state->broadcast_list[i].tcp_port, state->broadcast_list[i].udp_port) == -1)
-        {
-            continue;
-        }
+    // being suspected hints that this node, not the others, is slow
+    adjust_health(state, 1);
+    add_broadcast_to_list(state, state->own_tcp_port, state->own_udp_port, MEMBER_ALIVE, state->incarnation);
+}
 
-        fixed_list[ptr_broadcast++] = state->broadcast_list[i];
-    }
+// SWIM ordering: alive overrides suspect only with a higher incarnation, suspect overrides
+// alive at the same incarnation, dead overrides both. Accepted updates are gossiped on.
+// Must be called while holding the members lock
+void update_member(struct node_state *state, int tcp_port, int udp_port, int status, int incarnation)
+{
+    // the gossip decoder rejects other statuses, sync entries arrive unchecked
+    if (status != MEMBER_ALIVE && status != MEMBER_SUSPECT && status != MEMBER_DEAD)
+        return;
 
-    state->cnt_broadcast = ptr_broadcast;
-    for (int i = 0; i < ptr_broadcast; i++)
+    if (tcp_port == state->own_tcp_port && udp_port == state->own_udp_port)
     {
-        state->broadcast_list[i] = fixed_list[i];
+        if (status != MEMBER_ALIVE)
+            refute(state, incarnation);
+        return;
     }
-    free(fixed_list);
-}
 
-void update_member(struct node_state *state, int tcp_port, int udp_port, int status)
-{
-    int append_to_broadcast = 0;
+    long long key = port_key(tcp_port, udp_port);
     int idx_peer = idx_of(state, tcp_port, udp_port);
 
-    if (status == 0)
+    if (status == MEMBER_ALIVE)
     {
-        // node is declared removed
-        // if it is in state (or is self), remove it and append to broadcast list
-        if (idx_peer > 0)
+        if (idx_peer == -1)
         {
-            remove_peer(state, idx_peer);
-            append_to_broadcast = 1;
+            int buried = port_index_get(&state->graveyard, key);
+            if (buried != -1 && incarnation <= buried)
+                return;
         }
+        else if (incarnation <= state->members.incarnations[idx_peer])
+            return;
+
+        add_peer(state, tcp_port, udp_port, incarnation);
     }
-    else
+    else if (status == MEMBER_SUSPECT)
+    {
+        if (idx_peer == -1)
+            return;
+
+        int current = state->members.incarnations[idx_peer];
+        int suspected = state->members.statuses[idx_peer] == MEMBER_SUSPECT;
+        if (incarnation < current || (incarnation == current && suspected))
+            return;
+
+        state->members.incarnations[idx_peer] = incarnation;
+        state->members_changed = 1;
+        if (!suspected)
+            suspect_peer(state, idx_peer);
+    }
+    else if (status == MEMBER_DEAD)
     {
-        // node is joining
-        // if it is not in state, add it and append to broadcast list
-        if (idx_peer == -1 && !(tcp_port == state->own_tcp_port && udp_port == state->own_udp_port))
+        if (idx_peer == -1)
         {
-            add_peer(state, tcp_port, udp_port);
-            append_to_broadcast = 1;
+            // not a member, only remember the death so stale alive updates are ignored
+            int buried = port_index_get(&state->graveyard, key);
+            if (buried == -1 || incarnation > buried)
+                bury(state, key, incarnation);
+            return;
         }
-    }
+        if (incarnation < state->members.incarnations[idx_peer])
+            return;
 
-    if (append_to_broadcast)
-    {
-        add_broadcast_to_list(state, tcp_port, udp_port, status);
+        state->members.incarnations[idx_peer] = incarnation;
+        remove_peer(state, idx_peer, JOURNAL_REMOVED);
     }
 
-    fix_broadcast_list(state);
+    add_broadcast_to_list(state, tcp_port, udp_port, status, incarnation);
 }
 
+// Must be called while holding the members lock
 void process_updates(struct node_state *state, struct gossip_message *gossip)
 {
-    pthread_mutex_lock(&state->lock);
-
     for (int i = 0; i < gossip->cnt_updates; i++)
     {
-        update_member(state, gossip->tcp_ports[i], gossip->udp_ports[i], gossip->statuses[i]);
+        update_member(state, gossip->tcp_ports[i], gossip->udp_ports[i], gossip->statuses[i], gossip->incarnations[i]);
     }
-
-    pthread_mutex_unlock(&state->lock);
 }
 
-void probe(struct node_state *state, int udp_port)
+int probe(struct node_state *state, int udp_port)
 {
     struct gossip_message gossip;
+    memset(&gossip, 0, sizeof(gossip));
     gossip.message_type = PROBE;
     gossip.node_name_tcp = state->own_tcp_port;
     gossip.node_name_udp = state->own_udp_port;
+    piggyback_updates(state, &gossip);
 
     logg(LEVEL_DBG, "Probing %d", udp_port);
 
-    int fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_socket < 0)
+    if (send_gossip_message_to(state, udp_port, &gossip) < 0)
     {
-        logg(LEVEL_DBG, "Failed to open UDP socket");
-        state->probed = 1; // asume probe ok
-        return;
+        logg(LEVEL_DBG, "Failed to probe %d", udp_port);
+        return -1;
+    }
+    return 0;
+}
+
+long long clamp_ns(long long v, long long lo, long long hi)
+{
+    if (v > hi)
+        v = hi;
+    if (v < lo)
+        v = lo;
+    return v;
+}
+
+// Direct timeout: the member's own RTO, or the cluster's while it has no samples. Indirect
+// timeout: two cluster RTOs, one per hop through the helper. Both are stretched by the local
+// health. Without any samples, escalate after a quarter of the round and conclude at its end.
+// Must be called while holding the members and probes locks
+void set_probe_deadlines(struct node_state *state, struct probe_session *session, int idx_peer)
+{
+    long long round_ns = state->probe_timer.period_ns;
+    long long min_ns = (long long)(MIN_PROBE_TIMEOUT * 1000000000.);
+    long long direct_ns = round_ns / 4, indirect_ns = round_ns - direct_ns;
+    int health = atomic_load(&state->health);
+
+    if (state->cluster_rtt.srtt_ns != 0)
+    {
+        struct rtt_estimator *rtt = &state->cluster_rtt;
+        if (idx_peer != -1 && state->members.rtts[idx_peer].srtt_ns != 0)
+            rtt = &state->members.rtts[idx_peer];
+
+        direct_ns = clamp_ns(rtt_timeout_ns(rtt, 0) * (health + 1), min_ns, (long long)(round_ns * MAX_DIRECT_TIMEOUT_SHARE));
+        indirect_ns = clamp_ns(2 * rtt_timeout_ns(&state->cluster_rtt, 0) * (health + 1), 2 * min_ns, round_ns - direct_ns);
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(udp_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    session->escalate_at_ns = session->sent_ns + direct_ns;
+    session->conclude_at_ns = session->escalate_at_ns + indirect_ns;
+}
 
-    if (sendto(fd_socket, &gossip, sizeof(struct gossip_message), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+// Returns the index of the probe session for udp_port, or -1 if there is none
+// Must be called while holding the probes lock
+int find_probe_session(struct node_state *state, int udp_port)
+{
+    for (int i = 0; i < state->cnt_probes; i++)
     {
-        logg(LEVEL_DBG, "Failed to probe %d", udp_port);
-        state->probed = 1; // asume probe ok
+        if (state->probes[i].udp_port == udp_port)
+            return i;
     }
+    return -1;
+}
+
+int cnt_concurrent_probes(struct node_state *state)
+{
+    int k = 1 + state->members.num_peers / MEMBERS_PER_PROBE;
+    return k < MAX_CONCURRENT_PROBES ? k : MAX_CONCURRENT_PROBES;
 }
 
+// Starts this round's probe sessions on the next members of the round-robin order
 void probe_next(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
+    // stretch rounds while this node is unhealthy
+    set_timer_period(&state->probe_timer, (long long)(PROBE_PERIOD * (atomic_load(&state->health) + 1) * 1000000000.));
+
+    int targets[MAX_CONCURRENT_PROBES];
+    int cnt_targets = 0;
+
+    lock_members(state);
+    lock_domain(&state->probes_lock);
 
-    state->current_tcp_port_to_probe = -1;
-    state->current_udp_port_to_probe = -1;
-    state->probed = -1;
-    if (state->cnt_probing == 0)
+    int k = cnt_concurrent_probes(state);
+    for (int attempts = 0; state->cnt_probes < k && attempts < 2 * k; attempts++)
     {
-        if (state->num_peers > 0)
-            shuffle_ports_to_probe(state);
+        int tcp_port, udp_port;
+        if (next_port_to_probe(state, &tcp_port, &udp_port) < 0)
+            break;
+
+        // a reshuffle may hand out a member that is already being probed
+        if (find_probe_session(state, udp_port) != -1)
+            continue;
+
+        struct probe_session *session = &state->probes[state->cnt_probes++];
+        session->tcp_port = tcp_port;
+        session->udp_port = udp_port;
+        session->acked = 0;
+        session->escalated = 0;
+        session->sent_ns = now_ns();
+        set_probe_deadlines(state, session, idx_of(state, tcp_port, udp_port));
+        targets[cnt_targets++] = udp_port;
     }
 
-    if (state->cnt_probing > 0)
+    unlock_domain(&state->probes_lock);
+    unlock_members(state);
+
+    for (int i = 0; i < cnt_targets; i++)
     {
-        state->cnt_probing--;
-        state->current_tcp_port_to_probe = state->tcp_ports_to_probe[state->cnt_probing];
-        state->current_udp_port_to_probe = state->udp_ports_to_probe[state->cnt_probing];
+        if (probe(state, targets[i]) == 0)
+            continue;
 
-        probe(state, state->current_udp_port_to_probe);
+        lock_domain(&state->probes_lock);
+        int j = find_probe_session(state, targets[i]);
+        if (j != -1)
+            state->probes[j].acked = 1; // asume probe ok
+        unlock_domain(&state->probes_lock);
     }
-
-    pthread_mutex_unlock(&state->lock);
 }
 
-void reply_probe(struct node_state *state, int udp_port)
+// With wait unset, an ack finding the broadcasts lock taken goes out without updates
+void ack_probe(struct node_state *state, int udp_port, int wait)
 {
-    // should be fine lock-free
-
     struct gossip_message gossip;
+    memset(&gossip, 0, sizeof(gossip));
     gossip.message_type = ACK_PROBE;
     gossip.node_name_tcp = state->own_tcp_port;
     gossip.node_name_udp = state->own_udp_port;
-
-    logg(LEVEL_DBG, "Ack probe to %d", udp_port);
-
-    int fd_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_socket < 0)
+    if (wait)
+        piggyback_updates(state, &gossip);
+    else if (try_lock_domain(&state->broadcasts_lock) == 0)
     {
-        logg(LEVEL_DBG, "Failed to open UDP socket");
-        return;
+        pack_broadcasts(&state->broadcasts, &gossip, PIGGYBACK_LIMIT, WIRE_UPDATES_BUDGET);
+        unlock_domain(&state->broadcasts_lock);
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(udp_port);
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    logg(LEVEL_DBG, "Ack probe to %d", udp_port);
 
-    if (sendto(fd_socket, &gossip, sizeof(struct gossip_message), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (send_gossip_message_to(state, udp_port, &gossip) < 0)
     {
         logg(LEVEL_DBG, "Failed to ack probe to %d", udp_port);
     }
 }
 
-void check_ack(struct node_state *state, int udp_port)
+void reply_probe(struct node_state *state, int udp_port)
 {
-    pthread_mutex_lock(&state->lock);
+    ack_probe(state, udp_port, 1);
+}
 
-    if (state->current_udp_port_to_probe == udp_port)
-        state->probed = 1;
+void answer_probe(struct node_state *state, int udp_port)
+{
+    struct member_view *view = enter_member_view(state);
+    int peer = view_has_peer(view, udp_port);
+    leave_member_view(view);
 
-    pthread_mutex_unlock(&state->lock);
+    if (peer)
+        ack_probe(state, udp_port, 0);
 }
 
-void check_probed(struct node_state *state)
+// Relayed acks (see fulfil_request_probes) name the target by udp port only, tcp_port is 0
+// Must be called while holding the members lock
+void check_ack(struct node_state *state, int tcp_port, int udp_port)
 {
-    pthread_mutex_lock(&state->lock);
+    lock_domain(&state->probes_lock);
 
-    if (state->current_udp_port_to_probe != -1)
+    int i = find_probe_session(state, udp_port);
+    if (i != -1 && !state->probes[i].acked)
     {
-        if (state->probed == -1)
-        {
-            // declare dead + broadcast
-            logg(LEVEL_INFO, "found %d-%d is dead", state->current_tcp_port_to_probe, state->current_udp_port_to_probe);
+        struct probe_session *session = &state->probes[i];
+        session->acked = 1;
+        state->not_peer_since = 0;
 
-            int idx_peer = idx_of(state, state->current_tcp_port_to_probe, state->current_udp_port_to_probe);
-            if (idx_peer != -1)
-            {
-                remove_peer(state, idx_peer);
-                add_broadcast_to_list(state, state->current_tcp_port_to_probe, state->current_udp_port_to_probe, 0);
-            }
-        }
-        else
+        // only acks from the target itself are timed, late ones included so the estimate backs off
+        if (tcp_port == session->tcp_port)
         {
-            logg(LEVEL_DBG, "found %d-%d is alive", state->current_tcp_port_to_probe, state->current_udp_port_to_probe);
+            long long rtt_ns = now_ns() - session->sent_ns;
+            int idx_peer = idx_of(state, session->tcp_port, session->udp_port);
+            if (idx_peer != -1)
+                rtt_sample(&state->members.rtts[idx_peer], rtt_ns);
+            rtt_sample(&state->cluster_rtt, rtt_ns);
         }
     }
 
-    pthread_mutex_unlock(&state->lock);
+    unlock_domain(&state->probes_lock);
 }
 
-void request_probes_if_no_ack(struct node_state *state)
+// Must be called while holding the members lock
+void conclude_probe(struct node_state *state, struct probe_session *session)
 {
-    // check if we are currently & unsuccesfully probing a node
-    // if so, send request probe to FANOUT random peers
+    if (session->acked)
+    {
+        logg(LEVEL_DBG, "found %d-%d is alive", session->tcp_port, session->udp_port);
+        adjust_health(state, -1);
+        return;
+    }
 
-    pthread_mutex_lock(&state->lock);
+    adjust_health(state, 1);
 
-    if (state->current_udp_port_to_probe != -1 && state->probed == -1)
+    // suspect + broadcast, the member has until its suspicion times out to refute
+    int idx_peer = idx_of(state, session->tcp_port, session->udp_port);
+    if (idx_peer != -1 && state->members.statuses[idx_peer] == MEMBER_ALIVE)
     {
-        struct gossip_message request;
-        request.message_type = REQUEST_PROBE;
-        request.target_udp = state->current_udp_port_to_probe;
-        request.node_name_tcp = state->own_tcp_port;
-        request.node_name_udp = state->own_udp_port;
-        request.node_time = state->lamport_time;
+        logg(LEVEL_INFO, "suspect %d-%d", session->tcp_port, session->udp_port);
+        suspect_peer(state, idx_peer);
+        add_broadcast_to_list(state, session->tcp_port, session->udp_port, MEMBER_SUSPECT, state->members.incarnations[idx_peer]);
+    }
+}
 
-        // send request probe to (at most) fan_out random peers
-        if (state->num_peers > 0)
+// Concludes every probe session whose deadline is at or before ns, acked sessions only at round end
+void check_probed(struct node_state *state, long long ns)
+{
+    struct probe_session concluded[MAX_CONCURRENT_PROBES];
+    int cnt_concluded = 0;
+
+    lock_domain(&state->probes_lock);
+    for (int i = 0; i < state->cnt_probes;)
+    {
+        struct probe_session *session = &state->probes[i];
+        int round_end = ns == LLONG_MAX;
+        if (round_end || (!session->acked && session->conclude_at_ns <= ns))
         {
-            int cnt_random_peers;
-            int *random_peers = get_random_peers_except(state, FAN_OUT, &cnt_random_peers, state->current_udp_port_to_probe);
+            // the last session takes position i
+            concluded[cnt_concluded++] = *session;
+            state->probes[i] = state->probes[--state->cnt_probes];
+        }
+        else
+            i++;
+    }
+    unlock_domain(&state->probes_lock);
 
-#ifdef SAFE_MODE
-            check_fy(random_peers, cnt_random_peers);
-#endif
+    if (cnt_concluded == 0)
+        return;
 
-            for (int i = 0; i < cnt_random_peers; i++)
-            {
-                logg(LEVEL_DBG, "Sending request-probe to %d to check on %d", random_peers[i], state->current_udp_port_to_probe);
-                send_gossip_message_to(random_peers[i], &request);
-            }
-            free(random_peers);
+    lock_members(state);
+    for (int i = 0; i < cnt_concluded; i++)
+        conclude_probe(state, &concluded[i]);
+    unlock_members(state);
+}
+
+// Declares dead every suspect whose suspicion timed out without a refutation
+void check_suspicions(struct node_state *state)
+{
+    lock_members(state);
+
+    long long ns = now_ns();
+    expire_graves(state, ns);
+    for (int i = 0; i < state->cnt_suspects;)
+    {
+        struct suspicion s = state->suspects[i];
+        if (s.deadline_ns > ns)
+        {
+            i++;
+            continue;
         }
+
+        // both paths drop suspects[i], the last suspicion takes its place
+        int idx_peer = idx_of(state, s.tcp_port, s.udp_port);
+        if (idx_peer == -1)
+        {
+            stop_suspicion(state, s.tcp_port, s.udp_port);
+            continue;
+        }
+
+        logg(LEVEL_INFO, "found %d-%d is dead", s.tcp_port, s.udp_port);
+        int incarnation = state->members.incarnations[idx_peer];
+        remove_peer(state, idx_peer, JOURNAL_DEAD);
+        add_broadcast_to_list(state, s.tcp_port, s.udp_port, MEMBER_DEAD, incarnation);
     }
 
-    pthread_mutex_unlock(&state->lock);
+    unlock_members(state);
 }
 
-void append_request_probe(struct node_state *state, int target_udp, int requestor_udp)
+void escalate_probe(struct node_state *state, struct probe_session *session)
 {
-    // append current request to list of probe requests
+    struct gossip_message request;
+    memset(&request, 0, sizeof(request));
+    request.message_type = REQUEST_PROBE;
+    request.target_udp = session->udp_port;
+    request.node_name_tcp = state->own_tcp_port;
+    request.node_name_udp = state->own_udp_port;
+    request.node_time = state->lamport_time;
+    piggyback_updates(state, &request);
+
+    // send request probe to (at most) fan_out random peers
+    int random_peers[FAN_OUT];
+    struct member_view *view = enter_member_view(state);
+    int cnt_random_peers = 0;
+    if (view->num_peers > 0)
+        cnt_random_peers = get_random_peers_except(view, random_peers, FAN_OUT, session->udp_port);
+    leave_member_view(view);
+
+#ifdef SAFE_MODE
+    check_fy(random_peers, cnt_random_peers);
+#endif
 
-    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < cnt_random_peers; i++)
+    {
+        logg(LEVEL_DBG, "Sending request-probe to %d to check on %d", random_peers[i], session->udp_port);
+    }
+    send_gossip_message_to_all(state, random_peers, cnt_random_peers, &request);
+}
 
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    long long ns = tp.tv_sec * (long long)1000000000 + tp.tv_nsec;
+// Sends request-probes for every unacked probe session whose direct timeout passed by ns
+void request_probes_if_no_ack(struct node_state *state, long long ns)
+{
+    struct probe_session escalated[MAX_CONCURRENT_PROBES];
+    int cnt_escalated = 0;
 
-    if (state->cnt_request_probes >= CAPACITY)
+    lock_domain(&state->probes_lock);
+    for (int i = 0; i < state->cnt_probes; i++)
     {
-        logg(LEVEL_FATAL, "Could not append request probe, capacity reached");
-        exit(1);
+        struct probe_session *session = &state->probes[i];
+        if (!session->acked && !session->escalated && session->escalate_at_ns <= ns)
+        {
+            session->escalated = 1;
+            escalated[cnt_escalated++] = *session;
+        }
     }
+    unlock_domain(&state->probes_lock);
 
-    state->udp_ports_requested_to_probe[state->cnt_request_probes] = target_udp;
-    state->udp_ports_requestors[state->cnt_request_probes] = requestor_udp;
-    state->probe_request_ns[state->cnt_request_probes] = ns;
-    state->cnt_request_probes++;
+    for (int i = 0; i < cnt_escalated; i++)
+        escalate_probe(state, &escalated[i]);
+}
 
-    probe(state, target_udp);
+// Runs at every probe tick, i.e. once per round: expires suspicions, concludes what is left
+// of the previous round and starts the next round's probes
+void start_probe_round(struct node_state *state)
+{
+    // skipping ticks or waking up more than an eighth of a round late means this node is starved
+    if (state->probe_timer.last_expirations > 1 || state->probe_timer.last_lag_ns > state->probe_timer.period_ns / 8)
+        adjust_health(state, 1);
 
-    pthread_mutex_unlock(&state->lock);
+    check_suspicions(state);
+    check_probed(state, LLONG_MAX);
+    probe_next(state);
 }
 
-int not_expired(long long ns_request, long long ns_current)
+// Returns the earliest absolute time a probe session needs attention, or -1 if nothing is pending
+long long next_probe_deadline(struct node_state *state)
 {
-    long double off_s = 3. * PROBE_PERIOD / 4.;
-    long double off_ms = off_s * 1000000000;
+    lock_domain(&state->probes_lock);
 
-    if (ns_request + off_ms >= ns_current)
-        return 1;
-    return 0;
+    long long deadline = -1;
+    for (int i = 0; i < state->cnt_probes; i++)
+    {
+        struct probe_session *session = &state->probes[i];
+        if (session->acked)
+            continue;
+
+        long long d = session->escalated ? session->conclude_at_ns : session->escalate_at_ns;
+        if (deadline == -1 || d < deadline)
+            deadline = d;
+    }
+
+    unlock_domain(&state->probes_lock);
+    return deadline;
 }
 
-void fulfil_request_probes(struct node_state *state, int udp_port)
+// Escalates sessions past their direct timeout, concludes those past their indirect one
+void run_probe_deadlines(struct node_state *state)
 {
-    // send ack to all request probes for this udp_port who have not expired
-    // delete answered & expired requests
+    long long ns = now_ns();
+    request_probes_if_no_ack(state, ns);
+    check_probed(state, ns);
+}
 
-    pthread_mutex_lock(&state->lock);
+// REPLIES
+// Replies decided while applying received messages are queued, and sent by send_replies
+// once the locks are released
 
-    struct timespec tspec;
-    clock_gettime(CLOCK_MONOTONIC, &tspec);
-    long long ns_current = tspec.tv_sec * (long long)1000000000 + tspec.tv_nsec;
+void queue_reply(struct reply_outbox *outbox, int message_type, int udp_port, int relayed_udp, int incarnation)
+{
+    if (outbox->cnt >= MAX_PENDING_REPLIES)
+    {
+        logg(LEVEL_DBG, "Too many pending replies, dropping the one to %d", udp_port);
+        return;
+    }
 
-    int rem_request_probes = 0;
-    int *rem_udp_ports_requested_to_probe = malloc(CAPACITY * sizeof(int));
-    int *rem_udp_ports_requestors = malloc(CAPACITY * sizeof(int));
-    long long *rem_probe_request_ns = malloc(CAPACITY * sizeof(long long));
+    struct pending_reply *reply = &outbox->replies[outbox->cnt++];
+    reply->message_type = message_type;
+    reply->udp_port = udp_port;
+    reply->relayed_udp = relayed_udp;
+    reply->incarnation = incarnation;
+}
 
-    for (int i = 0; i < state->cnt_request_probes; i++)
+void send_replies(struct node_state *state, struct reply_outbox *outbox)
+{
+    for (int i = 0; i < outbox->cnt; i++)
     {
-        if (not_expired(state->probe_request_ns[i], ns_current))
+        struct pending_reply *reply = &outbox->replies[i];
+        if (reply->message_type == PROBE)
         {
-            if (state->udp_ports_requested_to_probe[i] != udp_port)
-            {
-                rem_udp_ports_requested_to_probe[rem_request_probes] = state->udp_ports_requested_to_probe[i];
-                rem_udp_ports_requestors[rem_request_probes] = state->udp_ports_requestors[i];
-                rem_probe_request_ns[rem_request_probes] = state->probe_request_ns[i];
-                rem_request_probes++;
-            }
-            else
-            {
-                // send ack to requestser
-                logg(LEVEL_INFO, "Acking %d that %d is alive", state->udp_ports_requestors[i], udp_port);
+            probe(state, reply->udp_port);
+            continue;
+        }
+        if (reply->message_type == ACK_PROBE && reply->relayed_udp == 0)
+        {
+            reply_probe(state, reply->udp_port);
+            continue;
+        }
 
-                struct gossip_message gossip;
-                gossip.message_type = ACK_PROBE;
-                gossip.node_name_udp = udp_port;
+        struct gossip_message gossip;
+        memset(&gossip, 0, sizeof(gossip));
+        gossip.message_type = reply->message_type;
+        gossip.node_name_tcp = state->own_tcp_port;
+        gossip.node_name_udp = state->own_udp_port;
 
-                send_gossip_message_to(state->udp_ports_requestors[i], &gossip);
-            }
+        if (reply->message_type == ACK_PROBE)
+        {
+            gossip.node_name_tcp = 0; // relayed, see check_ack
+            gossip.node_name_udp = reply->relayed_udp;
+            piggyback_updates(state, &gossip);
         }
+        else if (reply->message_type == GOSSIP_UPDATE)
+        {
+            gossip.node_time = state->lamport_time;
+            gossip.cnt_updates = 1;
+            gossip.tcp_ports[0] = state->own_tcp_port;
+            gossip.udp_ports[0] = state->own_udp_port;
+            gossip.statuses[0] = MEMBER_ALIVE;
+            gossip.incarnations[0] = reply->incarnation;
+        }
+
+        send_gossip_message_to(state, reply->udp_port, &gossip);
+    }
+    outbox->cnt = 0;
+}
+
+void append_request_probe(struct node_state *state, int target_udp, int requestor_udp, struct reply_outbox *outbox)
+{
+    long long ns = now_ns();
+    lock_domain(&state->request_probes_lock);
+    expire_request_probes(&state->request_probes, ns);
+    int added = add_request_probe(&state->request_probes, target_udp, requestor_udp, ns);
+    unlock_domain(&state->request_probes_lock);
+
+    if (added < 0)
+    {
+        logg(LEVEL_DBG, "Too many pending request-probes, dropping the one from %d", requestor_udp);
+        return;
+    }
+
+    queue_reply(outbox, PROBE, target_udp, 0, 0);
+}
+
+// Acks every requestor still waiting on udp_port
+void fulfil_request_probes(struct node_state *state, int udp_port, struct reply_outbox *outbox)
+{
+    long long ns = now_ns();
+    int requestors[REQUESTORS_PER_TARGET];
+    lock_domain(&state->request_probes_lock);
+    expire_request_probes(&state->request_probes, ns);
+    int cnt_requestors = take_request_probe(&state->request_probes, udp_port, requestors, ns);
+    unlock_domain(&state->request_probes_lock);
+
+    for (int i = 0; i < cnt_requestors; i++)
+    {
+        logg(LEVEL_INFO, "Acking %d that %d is alive", requestors[i], udp_port);
+        queue_reply(outbox, ACK_PROBE, requestors[i], udp_port, 0);
     }
+}
+
+// Must be called while holding the members lock
+int is_peer(struct node_state *state, int udp_port)
+{
+    return lookup_member_by_udp(&state->members, udp_port) != -1;
+}
+
+void reply_not_peer(__attribute__((unused)) struct node_state *state, int udp_port, struct reply_outbox *outbox)
+{
+    logg(LEVEL_INFO, "Sending %d NOT_A_PEER reply", udp_port);
+    queue_reply(outbox, NOT_A_PEER, udp_port, 0, 0);
+}
 
-    int *tp = state->udp_ports_requested_to_probe;
-    state->udp_ports_requested_to_probe = rem_udp_ports_requested_to_probe;
+// Answers a NOT_A_PEER reply by sending the replier an alive update about this node, which it
+// accepts once the incarnation is above the one it buried this node at
+// Returns 1 when refutations went unanswered for REJOIN_TIMEOUT and a full rejoin is due
+// Must be called while holding the members lock
+int refute_not_peer(struct node_state *state, int udp_port, struct reply_outbox *outbox)
+{
+    long long ns = now_ns();
+    if (state->not_peer_since == 0)
+    {
+        state->not_peer_since = ns;
+        refute(state, state->incarnation);
+    }
+    else if (ns - state->not_peer_since > REJOIN_TIMEOUT * 1000000000.)
+    {
+        state->not_peer_since = 0;
+        return 1;
+    }
 
-    int *tpr = state->udp_ports_requestors;
-    state->udp_ports_requestors = rem_udp_ports_requestors;
+    queue_reply(outbox, GOSSIP_UPDATE, udp_port, 0, state->incarnation);
+    return 0;
+}
 
-    long long *ltp = state->probe_request_ns;
-    state->probe_request_ns = rem_probe_request_ns;
+// Incarnation a (re)joining node must take so that it outranks every record of its past life
+int admission_incarnation(struct node_state *state, int tcp_port, int udp_port, int incarnation)
+{
+    lock_members(state);
 
-    state->cnt_request_probes = rem_request_probes;
+    int buried = port_index_get(&state->graveyard, port_key(tcp_port, udp_port));
+    if (buried != -1 && buried >= incarnation)
+        incarnation = buried + 1;
 
-    free(tp);
-    free(tpr);
-    free(ltp);
+    int idx_peer = idx_of(state, tcp_port, udp_port);
+    if (idx_peer != -1 && state->members.incarnations[idx_peer] >= incarnation)
+        incarnation = state->members.incarnations[idx_peer] + 1;
 
-    pthread_mutex_unlock(&state->lock);
+    unlock_members(state);
+    return incarnation;
 }
 
-int is_peer(struct node_state *state, int udp_port)
+void remv_peer(struct node_state *state, int tcp_port, int udp_port)
+{
+    lock_members(state);
+    int idx_peer = idx_of(state, tcp_port, udp_port);
+    if (idx_peer != -1)
+    {
+        remove_peer(state, idx_peer, JOURNAL_REMOVED);
+    }
+    unlock_members(state);
+}
+
+// Applies one received message: its piggybacked updates, then the message itself
+// Returns 1 if refuting NOT_A_PEER replies keeps failing and the node has to rejoin
+// Replies go to outbox, which must have room for REQUESTORS_PER_TARGET + 1 more
+// Must be called while holding the members lock
+int apply_gossip(struct node_state *state, struct gossip_message *msg, struct reply_outbox *outbox)
+{
+    // updates arrive on gossip rounds and piggybacked on probes, acks and request-probes
+    // they are applied even from non-peers: incarnations order them, and that is how a
+    // refuting node gets readmitted
+    if (msg->cnt_updates > 0)
+    {
+        logg(LEVEL_DBG, "Received %d changes via gossip", msg->cnt_updates);
+        process_updates(state, msg);
+    }
+
+    // a peer dropped this node, refute instead of rejoining unless refuting keeps failing
+    if (msg->message_type == NOT_A_PEER)
+    {
+        logg(LEVEL_INFO, "Received not a peer from %d-%d. Refuting...", msg->node_name_tcp, msg->node_name_udp);
+        return refute_not_peer(state, msg->node_name_udp, outbox);
+    }
+
+    // reply with NOT_A_PEER if the received message is not from a known peer
+    if (!is_peer(state, msg->node_name_udp))
+    {
+        logg(LEVEL_DBG, "Received a message from %d who is not a peer", msg->node_name_udp);
+        reply_not_peer(state, msg->node_name_udp, outbox);
+        return 0;
+    }
+
+    if (msg->message_type == PROBE)
+    {
+        logg(LEVEL_DBG, "Probed by %d. Sending reply...", msg->node_name_udp);
+        queue_reply(outbox, ACK_PROBE, msg->node_name_udp, 0, 0);
+    }
+    if (msg->message_type == ACK_PROBE)
+    {
+        check_ack(state, msg->node_name_tcp, msg->node_name_udp); // check ack
+        fulfil_request_probes(state, msg->node_name_udp, outbox); // check if we could answer a REQUEST_PROBE
+    }
+    if (msg->message_type == REQUEST_PROBE)
+    {
+        append_request_probe(state, msg->target_udp, msg->node_name_udp, outbox);
+    }
+
+    return 0;
+}
+
+int handle_gossip(struct node_state *state, struct gossip_message *msgs, int cnt)
 {
-    pthread_mutex_lock(&state->lock);
+    struct reply_outbox outbox;
+    outbox.cnt = 0;
 
-    int peer = 0;
-    for (int i = 0; i < state->num_peers; i++)
+    lock_members(state);
+
+    int rejoin = 0;
+    for (int i = 0; i < cnt && !rejoin; i++)
     {
-        if (state->udp_ports[i] == udp_port)
+        // replies are sent without the lock, in the middle of the batch if they pile up
+        if (outbox.cnt > MAX_PENDING_REPLIES - REQUESTORS_PER_TARGET - 1)
         {
-            peer = 1;
-            break;
+            unlock_members(state);
+            send_replies(state, &outbox);
+            lock_members(state);
         }
+        rejoin = apply_gossip(state, &msgs[i], &outbox);
     }
 
-    pthread_mutex_unlock(&state->lock);
+    unlock_members(state);
 
-    return peer;
+    send_replies(state, &outbox);
+    return rejoin;
 }
 
-void reply_not_peer(struct node_state *state, int udp_port)
+void prepare_rejoin(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
+    // probing and gossip pause until the join, populate_peers then restarts the grace period
+    atomic_store(&state->grace_period_until, now_ns() + GRACE_PERIOD * 1000000000ll);
 
-    logg(LEVEL_INFO, "Sending %d NOT_A_PEER reply", udp_port);
+    lock_members(state);
+    state->cnt_probing = state->probe_cursor = 0;
+    state->not_peer_since = 0;
 
-    struct gossip_message gossip;
-    gossip.message_type = NOT_A_PEER;
-    gossip.node_name_tcp = state->own_tcp_port;
-    gossip.node_name_udp = state->own_udp_port;
+    // outbid the incarnation the network buried this node at
+    state->incarnation++;
+    state->members_changed = 1;
+    unlock_members(state);
 
-    send_gossip_message_to(udp_port, &gossip);
+    lock_domain(&state->probes_lock);
+    state->cnt_probes = 0;
+    unlock_domain(&state->probes_lock);
 
-    pthread_mutex_unlock(&state->lock);
+    lock_domain(&state->request_probes_lock);
+    clear_request_table(&state->request_probes);
+    unlock_domain(&state->request_probes_lock);
+
+    lock_domain(&state->broadcasts_lock);
+    clear_broadcast_queue(&state->broadcasts);
+    unlock_domain(&state->broadcasts_lock);
 }
 
-void remv_peer(struct node_state *state, int tcp_port, int udp_port)
+void set_incarnation(struct node_state *state, int incarnation)
 {
-    pthread_mutex_lock(&state->lock);
-    int idx_peer = idx_of(state, tcp_port, udp_port);
-    if (idx_peer > 0)
+    lock_members(state);
+    state->incarnation = incarnation;
+    state->members_changed = 1;
+    unlock_members(state);
+}
+
+// Must be called while holding the members lock
+void digest_members(struct node_state *state, struct sync_digest *digest)
+{
+    clear_digest(digest);
+    add_to_digest(digest, state->own_tcp_port, state->own_udp_port, MEMBER_ALIVE, state->incarnation);
+    for (int i = 0; i < state->members.num_peers; i++)
+        add_to_digest(digest, state->members.tcp_ports[i], state->members.udp_ports[i], state->members.statuses[i], state->members.incarnations[i]);
+}
+
+void sync_digest(struct node_state *state, struct sync_digest *digest)
+{
+    lock_members(state);
+    digest_members(state, digest);
+    unlock_members(state);
+}
+
+void collect_entry(struct sync_entry *entries, int *cnt, const int *differs, int tcp_port, int udp_port, int status, int incarnation)
+{
+    if (!differs[sync_bucket(tcp_port, udp_port)])
+        return;
+
+    struct sync_entry *e = &entries[(*cnt)++];
+    e->tcp_port = tcp_port;
+    e->udp_port = udp_port;
+    e->status = status;
+    e->incarnation = incarnation;
+}
+
+// Collects this node, its members and its buried members in every bucket where the
+// digests differ, into an array taken from scratch. ours receives the digest compared
+// against theirs. Returns the number of entries
+int collect_sync_entries(struct node_state *state, const struct sync_digest *theirs, struct sync_digest *ours, struct arena *scratch, struct sync_entry **entries)
+{
+    lock_members(state);
+
+    digest_members(state, ours);
+    int differs[SYNC_BUCKETS];
+    for (int b = 0; b < SYNC_BUCKETS; b++)
+        differs[b] = ours->buckets[b] != theirs->buckets[b];
+
+    *entries = (struct sync_entry *)arena_alloc(scratch, sizeof(struct sync_entry) * (state->members.num_peers + 1 + state->graveyard.size));
+    int cnt = 0;
+
+    collect_entry(*entries, &cnt, differs, state->own_tcp_port, state->own_udp_port, MEMBER_ALIVE, state->incarnation);
+    for (int i = 0; i < state->members.num_peers; i++)
+        collect_entry(*entries, &cnt, differs, state->members.tcp_ports[i], state->members.udp_ports[i], state->members.statuses[i], state->members.incarnations[i]);
+
+    // buried members are not digested, but a peer that missed a death needs to hear of it.
+    // There are at most MAX_GRAVES of them
+    for (int slot = 0; slot < state->graveyard.capacity; slot++)
     {
-        remove_peer(state, idx_peer);
+        long long key = state->graveyard.keys[slot];
+        if (key != -1)
+            collect_entry(*entries, &cnt, differs, (int)(key >> 32), (int)(key & 0xffffffff), MEMBER_DEAD, state->graveyard.values[slot]);
     }
-    pthread_mutex_unlock(&state->lock);
+
+    unlock_members(state);
+    return cnt;
 }
 
-double get_remaining_grace_period(struct node_state *state)
+void apply_sync_entries(struct node_state *state, const struct sync_entry *entries, int cnt)
+{
+    lock_members(state);
+
+    for (int i = 0; i < cnt; i++)
+        update_member(state, entries[i].tcp_port, entries[i].udp_port, entries[i].status, entries[i].incarnation);
+
+    unlock_members(state);
+}
+
+// Returns the TCP port of a random member to sync with, or -1 if there is none
+int pick_sync_peer(struct node_state *state)
 {
-    pthread_mutex_lock(&state->lock);
+    struct member_view *view = enter_member_view(state);
+
+    int tcp_port = -1;
+    if (view->num_peers > 0)
+        tcp_port = view->tcp_ports[random_below(view->num_peers)];
 
-    // get current time
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
+    leave_member_view(view);
+    return tcp_port;
+}
 
-    long long ns = tp.tv_sec * 1000000000 + tp.tv_nsec;
-    long long diff = state->grace_period_until - ns;
+double get_remaining_grace_period(struct node_state *state)
+{
+    long long diff = atomic_load(&state->grace_period_until) - now_ns();
 
     double to_sleep = 0.;
     if (diff > 0)
         to_sleep = 1. * diff / 1000000000.;
 
-    pthread_mutex_unlock(&state->lock);
-
     return to_sleep;
 }
+
+void log_lock_contention(struct node_state *state)
+{
+    struct domain_lock *locks[] = {&state->members_lock, &state->probes_lock, &state->request_probes_lock, &state->broadcasts_lock};
+    const char *names[] = {"members", "probes", "request-probes", "broadcasts"};
+
+    char line[256];
+    int len = 0;
+    for (int i = 0; i < 4; i++)
+        len += snprintf(line + len, sizeof(line) - len, "%s%s %lld/%lld", i > 0 ? ", " : "", names[i],
+                        atomic_load(&locks[i]->contended), atomic_load(&locks[i]->acquisitions));
+
+    logg(LEVEL_INFO, "Contended lock acquisitions: %s. Blocking calls under a lock: %lld", line, blocking_under_lock());
+}
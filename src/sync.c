@@ -0,0 +1,27 @@
+#include <string.h>
+
+#include "sync.h"
+#include "port_index.h"
+
+unsigned long long mix64(unsigned long long x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+int sync_bucket(int tcp_port, int udp_port)
+{
+    return (int)(mix64((unsigned long long)port_key(tcp_port, udp_port)) % SYNC_BUCKETS);
+}
+
+void clear_digest(struct sync_digest *digest)
+{
+    memset(digest, 0, sizeof(*digest));
+}
+
+void add_to_digest(struct sync_digest *digest, int tcp_port, int udp_port, int status, int incarnation)
+{
+    unsigned long long h = mix64((unsigned long long)port_key(tcp_port, udp_port) ^ mix64(((unsigned long long)incarnation << 8) | (unsigned int)status));
+    digest->buckets[sync_bucket(tcp_port, udp_port)] ^= (unsigned int)(h ^ (h >> 32));
+}
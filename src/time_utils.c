@@ -22,3 +22,23 @@ void sleep_(double s)
         ret = nanosleep(&req, &req);
     } while (ret == -1 && errno == EINTR);
 }
+
+long long now_ns()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000000ll + tp.tv_nsec;
+}
+
+void sleep_until_ns(long long deadline_ns)
+{
+    struct timespec req;
+    req.tv_sec = deadline_ns / 1000000000ll;
+    req.tv_nsec = deadline_ns % 1000000000ll;
+
+    int ret = 0;
+    do
+    {
+        ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL);
+    } while (ret == EINTR);
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "transport.h"
+#include "time_utils.h"
+#include "wire.h"
+#include "alloc.h"
+
+// how many times a bind is retried, 0.1 s apart, before giving up
+#define BIND_RETRIES 5
+
+// receive buffers of the UDP backend, handed out as the received datagrams
+struct udp_transport
+{
+    unsigned char bufs[MAX_RECV_BATCH][MAX_DATAGRAM_SIZE];
+    struct sockaddr_in addrs[MAX_RECV_BATCH];
+    struct iovec iovs[MAX_RECV_BATCH];
+    struct mmsghdr msgs[MAX_RECV_BATCH];
+
+    int reuse_port; // shards may bind the port too
+};
+
+// INADDR_ANY: bound to, every interface; sent to, this host
+void any_addr(struct sockaddr_in *addr, int port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = htonl(INADDR_ANY);
+}
+
+// Binds fd to addr, retrying a few times in case the port is still being released
+int bind_with_retries(int fd, const struct sockaddr *addr, socklen_t addr_len, const char *what, int port)
+{
+    int cnt_failures_left = BIND_RETRIES;
+    while (bind(fd, addr, addr_len) < 0)
+    {
+        logg(LEVEL_FATAL, "Tried and failed to bind %s socket to desired port %d. Retrying...", what, port);
+        cnt_failures_left--;
+
+        if (cnt_failures_left < 0)
+            return -1;
+        sleep_(0.1);
+    }
+    return 0;
+}
+
+// Sends all datagrams with as few sendmmsg calls as possible
+// Returns the number of datagrams handed to the kernel
+int udp_send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    struct sockaddr_in addrs[MAX_SEND_BATCH];
+    struct iovec iovs[MAX_SEND_BATCH];
+    struct mmsghdr msgs[MAX_SEND_BATCH];
+
+    int cnt_sent = 0;
+    for (int start = 0; start < cnt; start += MAX_SEND_BATCH)
+    {
+        int batch = cnt - start;
+        if (batch > MAX_SEND_BATCH)
+            batch = MAX_SEND_BATCH;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+        for (int i = 0; i < batch; i++)
+        {
+            any_addr(&addrs[i], datagrams[start + i].udp_port);
+
+            iovs[i].iov_base = (void *)datagrams[start + i].buf;
+            iovs[i].iov_len = datagrams[start + i].len;
+
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int done = 0;
+        while (done < batch)
+        {
+            int ret = sendmmsg(transport->fd, msgs + done, batch - done, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                // skip the datagram the kernel refused and carry on with the rest
+                logg(LEVEL_DBG, "Failed to send UDP message to %d", datagrams[start + done].udp_port);
+                done++;
+                continue;
+            }
+
+            done += ret;
+            cnt_sent += ret;
+        }
+    }
+
+    return cnt_sent;
+}
+
+// Waits for the first datagram only, then takes whatever else is already queued, all
+// with one recvmmsg call
+int udp_recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms)
+{
+    struct udp_transport *udp = (struct udp_transport *)transport->impl;
+    if (max > MAX_RECV_BATCH)
+        max = MAX_RECV_BATCH;
+
+    if (timeout_ms > 0)
+    {
+        struct pollfd pfd;
+        pfd.fd = transport->fd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, timeout_ms);
+        if (ret <= 0)
+            return ret < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    memset(udp->msgs, 0, sizeof(struct mmsghdr) * max);
+    for (int i = 0; i < max; i++)
+    {
+        udp->iovs[i].iov_base = udp->bufs[i];
+        udp->iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+
+        udp->msgs[i].msg_hdr.msg_name = &udp->addrs[i];
+        udp->msgs[i].msg_hdr.msg_namelen = sizeof(udp->addrs[i]);
+        udp->msgs[i].msg_hdr.msg_iov = &udp->iovs[i];
+        udp->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int cnt;
+    do
+        cnt = recvmmsg(transport->fd, udp->msgs, max, timeout_ms < 0 ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+    while (cnt < 0 && errno == EINTR);
+    if (cnt < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    for (int i = 0; i < cnt; i++)
+    {
+        out[i].udp_port = ntohs(udp->addrs[i].sin_port);
+        out[i].buf = udp->bufs[i];
+        out[i].len = (int)udp->msgs[i].msg_len;
+    }
+    return cnt;
+}
+
+int tcp_listen_stream(__attribute__((unused)) struct transport *transport, int tcp_port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    // sync responders close first, a restarted node must rebind despite their TIME_WAIT sockets
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    any_addr(&addr, tcp_port);
+    if (bind_with_retries(fd, (const struct sockaddr *)&addr, sizeof(addr), "TCP", tcp_port) < 0 || listen(fd, 50) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int tcp_connect_stream(__attribute__((unused)) struct transport *transport, int tcp_port, int nonblocking)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    any_addr(&addr, tcp_port);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && !(nonblocking && errno == EINPROGRESS))
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Accepted streams are non-blocking, whatever the family of the listener
+int accept_any_stream(__attribute__((unused)) struct transport *transport, int listener_fd)
+{
+    return accept4(listener_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+void init_udp(struct transport *transport, int udp_port, int reuse_port);
+
+int udp_open_shard(struct transport *transport, struct transport *shard)
+{
+    if (!((struct udp_transport *)transport->impl)->reuse_port)
+        return -1;
+    init_udp(shard, transport->udp_port, 1);
+    return 0;
+}
+
+void udp_close(struct transport *transport)
+{
+    if (transport->fd >= 0)
+        close(transport->fd);
+    transport->fd = -1;
+    mem_free(transport->impl);
+    transport->impl = NULL;
+}
+
+const struct transport_ops udp_ops = {
+    udp_send_datagrams,
+    udp_recv_datagrams,
+    tcp_listen_stream,
+    tcp_connect_stream,
+    accept_any_stream,
+    udp_close,
+    udp_open_shard,
+};
+
+int open_udp_socket(int udp_port, int reuse_port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to create UDP socket");
+        exit(1);
+    }
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to share UDP port %d", udp_port);
+        exit(1);
+    }
+
+    struct sockaddr_in addr;
+    any_addr(&addr, udp_port);
+    if (bind_with_retries(fd, (const struct sockaddr *)&addr, sizeof(addr), "UDP", udp_port) < 0)
+    {
+        logg(LEVEL_FATAL, "Failed to bind UDP socket to desired port %d.", udp_port);
+        exit(1);
+    }
+    return fd;
+}
+
+void init_udp(struct transport *transport, int udp_port, int reuse_port)
+{
+    struct udp_transport *udp = (struct udp_transport *)mem_alloc(sizeof(struct udp_transport));
+    udp->reuse_port = reuse_port;
+
+    transport->ops = &udp_ops;
+    transport->udp_port = udp_port;
+    transport->impl = udp;
+    transport->fd = open_udp_socket(udp_port, reuse_port);
+}
+
+void init_udp_transport(struct transport *transport, int udp_port)
+{
+    init_udp(transport, udp_port, 0);
+}
+
+void init_sharded_udp_transport(struct transport *transport, int udp_port)
+{
+    init_udp(transport, udp_port, 1);
+}
+
+void close_transport(struct transport *transport)
+{
+    transport->ops->close(transport);
+}
+
+int send_datagram(struct transport *transport, int udp_port, const void *buf, int len)
+{
+    struct datagram d;
+    d.udp_port = udp_port;
+    d.buf = buf;
+    d.len = len;
+
+    return send_datagrams(transport, &d, 1) == 1 ? 0 : -1;
+}
+
+int send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    return transport->ops->send_datagrams(transport, datagrams, cnt);
+}
+
+int recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms)
+{
+    return transport->ops->recv_datagrams(transport, out, max, timeout_ms);
+}
+
+int listen_stream(struct transport *transport, int tcp_port)
+{
+    return transport->ops->listen_stream(transport, tcp_port);
+}
+
+int connect_stream(struct transport *transport, int tcp_port, int nonblocking)
+{
+    return transport->ops->connect_stream(transport, tcp_port, nonblocking);
+}
+
+int accept_stream(struct transport *transport, int listener_fd)
+{
+    return transport->ops->accept_stream(transport, listener_fd);
+}
+
+int open_shard(struct transport *transport, struct transport *shard)
+{
+    if (transport->ops->open_shard == NULL)
+        return -1;
+    return transport->ops->open_shard(transport, shard);
+}
+
+int send_all(int fd, const void *buf, int len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        int ret = send(fd, p, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void *buf, int len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        int ret = recv(fd, p, len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "transport.h"
+#include "wire.h"
+#include "log.h"
+#include "alloc.h"
+
+// provided receive buffers, a power of 2; the completion queue holds all of them
+#define RECV_BUFFERS 256
+#define RECV_BUFFER_GROUP 0
+
+// a received buffer holds the recvmsg header, the sender's address and the payload
+#define RECV_BUFFER_SIZE 2048
+_Static_assert(sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + MAX_DATAGRAM_SIZE <= RECV_BUFFER_SIZE,
+               "a datagram must fit a receive buffer");
+
+#define RECV_TAG 1
+
+struct ring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+struct uring_transport
+{
+    int socket_fd;
+
+    // sends wait for their own completions, so callers' buffers need not outlive the call
+    pthread_mutex_t send_lock;
+    struct ring send_ring;
+
+    // owned by the receiving thread
+    struct ring recv_ring;
+    struct msghdr recv_msg; // template of the multishot receive
+    int armed;              // the multishot receive is running
+    struct io_uring_buf_ring *bufs;
+    size_t bufs_size;
+    unsigned char *buffer_memory;
+    int leased[MAX_RECV_BATCH], cnt_leased; // returned by the last receive
+};
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned cnt_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, cnt_args);
+}
+
+void unmap_ring(struct ring *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Sets up a ring and maps its queues, returns -1 if the kernel refuses
+int map_ring(struct ring *ring, unsigned entries, unsigned cq_entries)
+{
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (cq_entries > 0)
+    {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -1;
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        ring->sq_map = NULL;
+        unmap_ring(ring);
+        return -1;
+    }
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_map == MAP_FAILED)
+            ring->cq_map = NULL;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        unmap_ring(ring);
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)ring->sq_map, *cq = (unsigned char *)ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Returns a cleared submission slot, queued once publish_sqes is called; NULL if the queue is full
+struct io_uring_sqe *next_sqe(struct ring *ring, unsigned cnt_pending)
+{
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    unsigned tail = *ring->sq_tail + cnt_pending;
+    if (tail - head >= ring->entries)
+        return NULL;
+
+    unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[index];
+}
+
+void publish_sqes(struct ring *ring, unsigned cnt)
+{
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, *ring->sq_tail + cnt, memory_order_release);
+}
+
+// Returns the oldest completion, NULL if there is none; release it with pop_cqe
+struct io_uring_cqe *peek_cqe(struct ring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void pop_cqe(struct ring *ring)
+{
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, *ring->cq_head + 1, memory_order_release);
+}
+
+// Submits one batch and waits for all of it, so the msghdrs may live on the stack
+int uring_send_datagrams(struct transport *transport, struct datagram *datagrams, int cnt)
+{
+    struct uring_transport *uring = (struct uring_transport *)transport->impl;
+    struct ring *ring = &uring->send_ring;
+    struct sockaddr_in addrs[MAX_SEND_BATCH];
+    struct iovec iovs[MAX_SEND_BATCH];
+    struct msghdr msgs[MAX_SEND_BATCH];
+
+    int cnt_sent = 0;
+    pthread_mutex_lock(&uring->send_lock);
+    for (int start = 0; start < cnt; start += MAX_SEND_BATCH)
+    {
+        int batch = cnt - start;
+        if (batch > MAX_SEND_BATCH)
+            batch = MAX_SEND_BATCH;
+
+        for (int i = 0; i < batch; i++)
+        {
+            struct datagram *d = &datagrams[start + i];
+            memset(&addrs[i], 0, sizeof(addrs[i]));
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_port = htons(d->udp_port);
+            addrs[i].sin_addr.s_addr = htonl(INADDR_ANY);
+            iovs[i].iov_base = (void *)d->buf;
+            iovs[i].iov_len = d->len;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_name = &addrs[i];
+            msgs[i].msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_iov = &iovs[i];
+            msgs[i].msg_iovlen = 1;
+
+            // the send ring has room for a whole batch and is drained after each one
+            struct io_uring_sqe *sqe = next_sqe(ring, i);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = uring->socket_fd;
+            sqe->addr = (unsigned long long)(uintptr_t)&msgs[i];
+            sqe->len = 1;
+            sqe->user_data = (unsigned long long)(start + i);
+        }
+        publish_sqes(ring, batch);
+
+        int to_submit = batch, cnt_completed = 0;
+        while (cnt_completed < batch)
+        {
+            int ret = sys_io_uring_enter(ring->fd, to_submit, batch - cnt_completed, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR)
+            {
+                logg(LEVEL_FATAL, "io_uring_enter failed while sending");
+                exit(1);
+            }
+            if (ret >= 0)
+                to_submit -= ret;
+
+            struct io_uring_cqe *cqe;
+            while ((cqe = peek_cqe(ring)) != NULL)
+            {
+                if (cqe->res < 0)
+                    logg(LEVEL_DBG, "Failed to send UDP message to %d", datagrams[cqe->user_data].udp_port);
+                else
+                    cnt_sent++;
+                cnt_completed++;
+                pop_cqe(ring);
+            }
+        }
+    }
+    pthread_mutex_unlock(&uring->send_lock);
+
+    return cnt_sent;
+}
+
+unsigned char *recv_buffer(struct uring_transport *uring, int id)
+{
+    return uring->buffer_memory + (size_t)id * RECV_BUFFER_SIZE;
+}
+
+// Hands buffers back to the kernel
+void provide_buffers(struct uring_transport *uring, int *ids, int cnt)
+{
+    unsigned short tail = uring->bufs->tail;
+    for (int i = 0; i < cnt; i++)
+    {
+        struct io_uring_buf *buf = &uring->bufs->bufs[(unsigned short)(tail + i) & (RECV_BUFFERS - 1)];
+        buf->addr = (unsigned long long)(uintptr_t)recv_buffer(uring, ids[i]);
+        buf->len = RECV_BUFFER_SIZE;
+        buf->bid = (unsigned short)ids[i];
+    }
+    atomic_store_explicit((_Atomic unsigned short *)&uring->bufs->tail, (unsigned short)(tail + cnt), memory_order_release);
+}
+
+// Queues the multishot receive; it stops when it runs out of buffers and is queued again
+void arm_receive(struct uring_transport *uring)
+{
+    struct io_uring_sqe *sqe = next_sqe(&uring->recv_ring, 0);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->socket_fd;
+    sqe->addr = (unsigned long long)(uintptr_t)&uring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = RECV_TAG;
+    publish_sqes(&uring->recv_ring, 1);
+    uring->armed = 1;
+}
+
+// Moves completed receives to out; dropped buffers go straight back to the kernel
+int reap_received(struct uring_transport *uring, struct datagram *out, int max)
+{
+    int cnt = 0;
+    struct io_uring_cqe *cqe;
+    while (cnt < max && (cqe = peek_cqe(&uring->recv_ring)) != NULL)
+    {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring->armed = 0;
+        if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            logg(LEVEL_DBG, "Error occured while receiving UDP message. Resuming listening...");
+
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            int id = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            unsigned char *buf = recv_buffer(uring, id);
+            struct io_uring_recvmsg_out *header = (struct io_uring_recvmsg_out *)buf;
+            struct sockaddr_in *from = (struct sockaddr_in *)(header + 1);
+
+            if (cqe->res >= 0 && !(header->flags & MSG_TRUNC) && header->namelen >= sizeof(struct sockaddr_in))
+            {
+                uring->leased[uring->cnt_leased++] = id;
+                out[cnt].udp_port = ntohs(from->sin_port);
+                out[cnt].buf = buf + sizeof(*header) + uring->recv_msg.msg_namelen;
+                out[cnt].len = (int)header->payloadlen;
+                cnt++;
+            }
+            else
+                provide_buffers(uring, &id, 1);
+        }
+        pop_cqe(&uring->recv_ring);
+    }
+    return cnt;
+}
+
+int uring_recv_datagrams(struct transport *transport, struct datagram *out, int max, int timeout_ms)
+{
+    struct uring_transport *uring = (struct uring_transport *)transport->impl;
+    if (max > MAX_RECV_BATCH)
+        max = MAX_RECV_BATCH;
+
+    provide_buffers(uring, uring->leased, uring->cnt_leased);
+    uring->cnt_leased = 0;
+
+    int rearmed = 0;
+    while (1)
+    {
+        int cnt = reap_received(uring, out, max);
+
+        // queued datagrams complete the new receive at once, take them before giving up
+        if (!uring->armed)
+        {
+            arm_receive(uring);
+            sys_io_uring_enter(uring->recv_ring.fd, 1, 0, 0, NULL, 0);
+            if (cnt == 0 && !rearmed)
+            {
+                rearmed = 1;
+                continue;
+            }
+        }
+        if (cnt > 0 || timeout_ms == 0)
+            return cnt;
+
+        int ret;
+        if (timeout_ms < 0)
+            ret = sys_io_uring_enter(uring->recv_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        else
+        {
+            struct __kernel_timespec ts;
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+            struct io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+            ret = sys_io_uring_enter(uring->recv_ring.fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        }
+
+        if (ret < 0)
+        {
+            if (errno == ETIME)
+                return reap_received(uring, out, max);
+            if (errno != EINTR)
+                return -1;
+        }
+    }
+}
+
+void free_uring(struct uring_transport *uring)
+{
+    unmap_ring(&uring->send_ring);
+    unmap_ring(&uring->recv_ring);
+    if (uring->bufs != NULL)
+        munmap(uring->bufs, uring->bufs_size);
+    if (uring->buffer_memory != NULL)
+        mem_free(uring->buffer_memory);
+    pthread_mutex_destroy(&uring->send_lock);
+    mem_free(uring);
+}
+
+void uring_close(struct transport *transport)
+{
+    struct uring_transport *uring = (struct uring_transport *)transport->impl;
+    close(uring->socket_fd);
+    free_uring(uring);
+    transport->impl = NULL;
+    transport->fd = -1;
+}
+
+const struct transport_ops uring_ops = {
+    uring_send_datagrams,
+    uring_recv_datagrams,
+    tcp_listen_stream,
+    tcp_connect_stream,
+    accept_any_stream,
+    uring_close,
+    NULL,
+};
+
+int init_uring_transport(struct transport *transport, int udp_port)
+{
+    struct uring_transport *uring = (struct uring_transport *)mem_alloc(sizeof(struct uring_transport));
+    memset(uring, 0, sizeof(*uring));
+    uring->send_ring.fd = uring->recv_ring.fd = uring->socket_fd = -1;
+    pthread_mutex_init(&uring->send_lock, NULL);
+
+    if (map_ring(&uring->send_ring, MAX_SEND_BATCH, 0) < 0 || map_ring(&uring->recv_ring, 8, 2 * RECV_BUFFERS) < 0)
+    {
+        logg(LEVEL_INFO, "io_uring is not available, falling back to sockets");
+        free_uring(uring);
+        return -1;
+    }
+
+    // the buffer ring is shared with the kernel, so it is mapped rather than allocated
+    uring->bufs_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+    uring->bufs = (struct io_uring_buf_ring *)mmap(NULL, uring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->bufs == MAP_FAILED)
+    {
+        uring->bufs = NULL;
+        free_uring(uring);
+        return -1;
+    }
+    uring->buffer_memory = (unsigned char *)mem_alloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)uring->bufs;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_BUFFER_GROUP;
+    if (sys_io_uring_register(uring->recv_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        logg(LEVEL_INFO, "io_uring lacks provided buffer rings, falling back to sockets");
+        free_uring(uring);
+        return -1;
+    }
+    int ids[RECV_BUFFERS];
+    for (int i = 0; i < RECV_BUFFERS; i++)
+        ids[i] = i;
+    provide_buffers(uring, ids, RECV_BUFFERS);
+
+    uring->socket_fd = open_udp_socket(udp_port, 0);
+    memset(&uring->recv_msg, 0, sizeof(uring->recv_msg));
+    uring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+    // kernels without multishot receives reject it at once
+    arm_receive(uring);
+    sys_io_uring_enter(uring->recv_ring.fd, 1, 0, 0, NULL, 0);
+    struct io_uring_cqe *cqe = peek_cqe(&uring->recv_ring);
+    if (cqe != NULL && cqe->res == -EINVAL)
+    {
+        logg(LEVEL_INFO, "io_uring lacks multishot receives, falling back to sockets");
+        close(uring->socket_fd);
+        free_uring(uring);
+        return -1;
+    }
+
+    transport->ops = &uring_ops;
+    transport->udp_port = udp_port;
+    transport->fd = uring->recv_ring.fd; // readable while completions wait
+    transport->impl = uring;
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <string.h>
+
+#include "wire.h"
+#include "gossip_message.h"
+#include "membership.h"
+
+struct wire_writer
+{
+    unsigned char *buf;
+    int len, pos;
+    int overflow;
+};
+
+struct wire_reader
+{
+    const unsigned char *buf;
+    int len, pos;
+    int malformed;
+};
+
+void wire_put_u8(struct wire_writer *w, unsigned int v)
+{
+    if (w->pos + 1 > w->len)
+    {
+        w->overflow = 1;
+        return;
+    }
+    w->buf[w->pos++] = (unsigned char)v;
+}
+
+void wire_put_u16(struct wire_writer *w, int v)
+{
+    if (v < 0 || v > 0xffff)
+    {
+        w->overflow = 1;
+        return;
+    }
+    wire_put_u8(w, (v >> 8) & 0xff);
+    wire_put_u8(w, v & 0xff);
+}
+
+void wire_put_varint(struct wire_writer *w, int v)
+{
+    if (v < 0)
+    {
+        w->overflow = 1;
+        return;
+    }
+
+    unsigned int u = (unsigned int)v;
+    while (u >= 0x80)
+    {
+        wire_put_u8(w, (u & 0x7f) | 0x80);
+        u >>= 7;
+    }
+    wire_put_u8(w, u);
+}
+
+unsigned int wire_get_u8(struct wire_reader *r)
+{
+    if (r->pos + 1 > r->len)
+    {
+        r->malformed = 1;
+        return 0;
+    }
+    return r->buf[r->pos++];
+}
+
+int wire_get_u16(struct wire_reader *r)
+{
+    int hi = wire_get_u8(r);
+    int lo = wire_get_u8(r);
+    return (hi << 8) | lo;
+}
+
+int wire_get_varint(struct wire_reader *r)
+{
+    unsigned int u = 0;
+    for (int shift = 0; shift < 32; shift += 7)
+    {
+        unsigned int b = wire_get_u8(r);
+        u |= (b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            if (u > 0x7fffffff)
+                r->malformed = 1;
+            return (int)u;
+        }
+    }
+
+    r->malformed = 1;
+    return 0;
+}
+
+int wire_update_size(int incarnation)
+{
+    int size = 2 + 2 + 1 + 1;
+    for (unsigned int u = (unsigned int)incarnation; u >= 0x80; u >>= 7)
+        size++;
+    return size;
+}
+
+int encode_gossip(const struct gossip_message *gossip, unsigned char *buf, int buf_len)
+{
+    struct wire_writer w = {buf, buf_len, 0, 0};
+
+    if (gossip->cnt_updates < 0 || gossip->cnt_updates > UPDATES_PER_MESSAGE)
+        return -1;
+
+    wire_put_u8(&w, WIRE_VERSION);
+    wire_put_u8(&w, gossip->message_type);
+    wire_put_u16(&w, gossip->node_name_tcp);
+    wire_put_u16(&w, gossip->node_name_udp);
+    wire_put_varint(&w, gossip->node_time);
+    if (gossip->message_type == REQUEST_PROBE)
+        wire_put_u16(&w, gossip->target_udp);
+
+    wire_put_varint(&w, gossip->cnt_updates);
+    for (int i = 0; i < gossip->cnt_updates; i++)
+    {
+        wire_put_u16(&w, gossip->tcp_ports[i]);
+        wire_put_u16(&w, gossip->udp_ports[i]);
+        wire_put_u8(&w, gossip->statuses[i]);
+        wire_put_varint(&w, gossip->incarnations[i]);
+    }
+
+    if (w.overflow)
+        return -1;
+    return w.pos;
+}
+
+int decode_gossip(const unsigned char *buf, int len, struct gossip_message *gossip)
+{
+    struct wire_reader r = {buf, len, 0, 0};
+
+    if (wire_get_u8(&r) != WIRE_VERSION)
+        return -1;
+
+    memset(gossip, 0, sizeof(*gossip));
+    gossip->message_type = wire_get_u8(&r);
+    if (gossip->message_type > NOT_A_PEER)
+        return -1;
+    gossip->node_name_tcp = wire_get_u16(&r);
+    gossip->node_name_udp = wire_get_u16(&r);
+    gossip->node_time = wire_get_varint(&r);
+    if (gossip->message_type == REQUEST_PROBE)
+        gossip->target_udp = wire_get_u16(&r);
+
+    gossip->cnt_updates = wire_get_varint(&r);
+    if (r.malformed || gossip->cnt_updates > UPDATES_PER_MESSAGE)
+        return -1;
+
+    for (int i = 0; i < gossip->cnt_updates; i++)
+    {
+        gossip->tcp_ports[i] = wire_get_u16(&r);
+        gossip->udp_ports[i] = wire_get_u16(&r);
+        gossip->statuses[i] = wire_get_u8(&r);
+        gossip->incarnations[i] = wire_get_varint(&r);
+        if (gossip->statuses[i] > MEMBER_SUSPECT)
+            return -1;
+    }
+
+    if (r.malformed || r.pos != r.len)
+        return -1;
+    return 0;
+}
@@ -4,6 +4,7 @@ import os
 import signal
 import argparse
 import socket, errno
+import subprocess
 
 
 # CONSTANTS
@@ -13,20 +14,7 @@ JOINS_ROUND_DEFAULT = 1
 NUM_ROUNDS_DEFAULT = 20
 COOLDOWN_DEFAULT = 5
 GRACE_PERIOD_DEFAULT = 5
-
-
-# UTILS
-def parse_ts(ts):
-    splits = ts.split(":")
-    return int(splits[0]) * 1000000000 + int(splits[1])
-
-
-def parse_peer(peer):
-    splits = peer.split("-")
-    return (
-        int(splits[0]),
-        int(splits[1][:-1]) if splits[1][-1] == "," else int(splits[1]),
-    )
+SCENARIO_FILE = "scenario.txt"
 
 
 class Simulation:
@@ -35,7 +23,8 @@ class Simulation:
         self.peer_to_pid = dict()
         self.history = set()
         self.history_peers = set()
-        self.rounds = []
+        self.rounds = 0
+        self.scenario = []
 
     def in_use(self, port):
         s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
@@ -70,6 +59,7 @@ class Simulation:
     def start_seed(self, seed, peers):
         print(f"Forking seed {seed}")
         self.history_peers.add(seed)
+        self.scenario.append(f"START {time.monotonic_ns()} {seed[0]} {seed[1]}")
 
         pid = os.fork()
         if pid > 0:
@@ -91,6 +81,7 @@ class Simulation:
     def join_peer(self, peer, gateway):
         print(f"Forking peer {peer} to join {gateway}")
         self.history_peers.add(peer)
+        self.scenario.append(f"START {time.monotonic_ns()} {peer[0]} {peer[1]}")
 
         pid = os.fork()
         if pid > 0:
@@ -106,8 +97,10 @@ class Simulation:
         else:
             print("Error forking the process")
 
-    def kill_peer(self, peer):
+    def kill_peer(self, peer, record=True):
         print(f"Killing peer {peer}")
+        if record:
+            self.scenario.append(f"KILL {time.monotonic_ns()} {peer[0]} {peer[1]}")
         os.kill(self.peer_to_pid[peer], signal.SIGINT)
         self.ports.remove(peer[0])
         self.ports.remove(peer[1])
@@ -117,66 +110,25 @@ class Simulation:
         return self.peer_to_pid.keys()
 
     def register_round(self):
-        timestamp = time.monotonic_ns()
-        self.rounds.append((timestamp, list(self.peer_to_pid.keys())))
-
-    def parse_logs(self):
-        peer_state = dict()
-        for peer in self.history_peers:
-            peer_state[peer] = []
-            try:
-                # Parse checkpointed state of given node from the log file
-                with open(f"{peer[0]}_{peer[1]}.log") as f:
-                    for line in f.readlines():
-                        if "[PEERS" not in line:
-                            continue
-                        splits = line.split()
-                        timestamp = parse_ts(splits[1])
-                        peers = [
-                            parse_peer(splits[7 + i]) for i in range(int(splits[5]))
-                        ]
-                        peer_state[peer].append((timestamp, peers))
-            finally:
-                pass
-
-        return peer_state
+        self.rounds += 1
+        self.scenario.append(f"ROUND {time.monotonic_ns()}")
 
     def compile_report(self):
-        print(f"\n\n==========SIMULATION RAPORT==========")
-        print(f"Simulation ran for {len(self.rounds)} rounds")
-
-        peer_state = self.parse_logs()
-        for idx, (round_ts, expected_peers) in enumerate(self.rounds):
-            # get latest state of each expected peer with a ts <= round ts
-            latest_state = dict()
-            for peer in expected_peers:
-                latest_state[peer] = set()
-
-                while True:
-                    if len(peer_state[peer]) == 0 or peer_state[peer][0][0] > round_ts:
-                        break
-                    latest_state[peer] = set(peer_state[peer][0][1])
-                    peer_state[peer].pop(0)
-
-            # for each peer, diff with expected
-            expected_peers_set = set(expected_peers)
-            print(f"\nRound {idx+1}:")
-            for peer in expected_peers:
-                intersection = len(latest_state[peer] & expected_peers_set)
-                diff = len(latest_state[peer] - expected_peers_set)
-                if intersection == len(expected_peers_set) - 1 and diff == 0:
-                    print(f"Node {peer}: OK")
-                else:
-                    print(
-                        f"Node {peer}: not OK, {diff} extra, {len(expected_peers_set)-1-intersection} missing"
-                    )
+        # every node journals its membership changes, the analyzer replays them against the scenario
+        with open(SCENARIO_FILE, "w") as f:
+            f.write("\n".join(self.scenario) + "\n")
+        subprocess.run(["./build/analyze_journals", SCENARIO_FILE])
 
     def cleanup(self):
-        # delete log files
+        # delete log, journal and scenario files
+        files = [SCENARIO_FILE]
         for peer in self.history_peers:
+            files.append(f"{peer[0]}_{peer[1]}.log")
+            files.append(f"{peer[0]}_{peer[1]}.journal")
+        for file in files:
             try:
-                os.remove(f"{peer[0]}_{peer[1]}.log")
-            finally:
+                os.remove(file)
+            except OSError:
                 pass
 
 
@@ -231,7 +183,7 @@ def main():
     time.sleep(GRACE_PERIOD)
     peers = list(simulation.get_peers())
     for peer in peers:
-        simulation.kill_peer(peer)
+        simulation.kill_peer(peer, record=False)
 
     simulation.compile_report()
     simulation.cleanup()
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "broadcast_queue.h"
+#include "wire.h"
+
+#define NUM_NODES 1000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// heap order holds and the index points every node at its own position
+void check_consistent(struct broadcast_queue *queue)
+{
+    for (int i = 0; i < queue->size; i++)
+    {
+        struct broadcast *b = &queue->heap[i];
+        if (port_index_get(&queue->by_node, port_key(b->tcp_port, b->udp_port)) != i)
+        {
+            check(0, "index points at heap position");
+            return;
+        }
+
+        struct broadcast *parent = &queue->heap[(i - 1) / 2];
+        if (i > 0 && (parent->transmits > b->transmits || (parent->transmits == b->transmits && parent->seq < b->seq)))
+        {
+            check(0, "heap order");
+            return;
+        }
+    }
+    check(queue->by_node.size == queue->size, "index size");
+}
+
+int main()
+{
+    struct broadcast_queue queue;
+    init_broadcast_queue(&queue, 1);
+
+    for (int i = 0; i < NUM_NODES; i++)
+        push_broadcast(&queue, 2000 + i, 30000 + i, 1, 0, 3);
+    check(queue.size == NUM_NODES, "push grows the queue");
+    check_consistent(&queue);
+
+    // a newer update about the same node replaces the queued one
+    push_broadcast(&queue, 2010, 30010, 2, 5, 3);
+    check(queue.size == NUM_NODES, "newer update replaces");
+    check_consistent(&queue);
+
+    struct gossip_message gossip;
+    gossip.cnt_updates = 0;
+    check(pack_broadcasts(&queue, &gossip, 4, WIRE_UPDATES_BUDGET) == 4, "pack respects max updates");
+    check(gossip.udp_ports[0] == 30010 && gossip.statuses[0] == 2 && gossip.incarnations[0] == 5, "newest goes first");
+    check(gossip.udp_ports[1] == 30999 && gossip.udp_ports[3] == 30997, "then newest to oldest");
+    check(queue.size == NUM_NODES, "packed broadcasts stay under their limit");
+    check_consistent(&queue);
+
+    // the least transmitted broadcasts are packed before those already sent once
+    gossip.cnt_updates = 0;
+    pack_broadcasts(&queue, &gossip, UPDATES_PER_MESSAGE, WIRE_UPDATES_BUDGET);
+    int fresh = 1;
+    for (int i = 0; i < gossip.cnt_updates; i++)
+        fresh &= gossip.udp_ports[i] != 30010 && gossip.udp_ports[i] < 30997;
+    check(fresh, "least transmitted first");
+
+    // the byte budget bounds the message
+    gossip.cnt_updates = 0;
+    int cnt = pack_broadcasts(&queue, &gossip, UPDATES_PER_MESSAGE, 3 * wire_update_size(0) + 1);
+    check(cnt == 3, "pack respects the byte budget");
+
+    drop_broadcast(&queue, 2500, 30500);
+    drop_broadcast(&queue, 2500, 30500);
+    check(queue.size == NUM_NODES - 1, "drop");
+    check_consistent(&queue);
+
+    // every broadcast leaves after transmit_limit transmits, counting the packs above
+    int total = 4 + UPDATES_PER_MESSAGE + 3;
+    while (queue.size > 0)
+    {
+        gossip.cnt_updates = 0;
+        total += pack_broadcasts(&queue, &gossip, UPDATES_PER_MESSAGE, WIRE_UPDATES_BUDGET);
+        check_consistent(&queue);
+        if (failures > 0)
+            break;
+    }
+    check(total == 3 * (NUM_NODES - 1), "each broadcast sent transmit_limit times");
+
+    clear_broadcast_queue(&queue);
+    check(queue.size == 0, "clear");
+    free_broadcast_queue(&queue);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "log.h"
 
 int main()
@@ -13,6 +14,17 @@ int main()
     puts("This is a plain puts");
     printf("This is a plain printf with integer %d and string %s\n", -10, "Hello!");
 
+    // filtered levels are dropped before formatting
+    set_log_levels(LOG_ALL_LEVELS & ~LOG_MASK(LEVEL_DBG));
+    logg(LEVEL_DBG, "This line must not appear");
+    set_log_levels(LOG_ALL_LEVELS);
+
+    // lines longer than a ring slot bypass the ring
+    char long_msg[2 * LOG_SLOT_SIZE];
+    memset(long_msg, 'x', sizeof(long_msg) - 1);
+    long_msg[sizeof(long_msg) - 1] = 0;
+    logg(LEVEL_INFO, "Long line: %s", long_msg);
+
     logg(LEVEL_INFO, "Test done!");
 
     cleanup_logger();
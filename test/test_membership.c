@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "membership.h"
+
+#define NUM_NODES 2000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// every member must be found at its own position through both indexes
+void check_consistent(struct member_table *members)
+{
+    for (int i = 0; i < members->num_peers; i++)
+    {
+        if (lookup_member(members, members->tcp_ports[i], members->udp_ports[i]) != i ||
+            lookup_member_by_udp(members, members->udp_ports[i]) != i)
+        {
+            check(0, "indexes point at member position");
+            return;
+        }
+        if (members->udp_ports[i] >= 30000 && members->incarnations[i] != members->udp_ports[i] - 30000)
+        {
+            check(0, "incarnation moves with its member");
+            return;
+        }
+    }
+    check(members->by_node.size == members->num_peers, "node index size");
+    check(members->by_udp.size == members->num_peers, "udp index size");
+}
+
+int main()
+{
+    struct member_table members;
+    init_member_table(&members, NUM_NODES);
+
+    for (int i = 0; i < NUM_NODES; i++)
+    {
+        check(insert_member(&members, 2000 + i, 30000 + i) == i, "insert appends");
+        check(members.incarnations[i] == 0 && members.statuses[i] == MEMBER_ALIVE, "new members start alive");
+        members.incarnations[i] = i;
+    }
+    check(insert_member(&members, 2000, 30000) == 0, "insert is idempotent");
+    check(insert_member(&members, 1, 1) == NUM_NODES && members.capacity > NUM_NODES, "insert grows when full");
+    delete_member_at(&members, NUM_NODES);
+    check_consistent(&members);
+
+    check(lookup_member(&members, 2000, 30001) == -1, "mismatched pair is absent");
+    check(lookup_member_by_udp(&members, 12345) == -1, "unknown udp is absent");
+
+    // remove every member with an odd udp port in random order
+    srand(7);
+    int removed = 0;
+    while (removed < NUM_NODES / 2)
+    {
+        int pos = rand() % members.num_peers;
+        if (members.udp_ports[pos] % 2 == 1)
+        {
+            delete_member_at(&members, pos);
+            removed++;
+        }
+    }
+    check(members.num_peers == NUM_NODES / 2, "swap-remove count");
+    check_consistent(&members);
+    for (int i = 0; i < NUM_NODES; i++)
+    {
+        int present = lookup_member(&members, 2000 + i, 30000 + i) != -1;
+        if (present != (i % 2 == 0))
+        {
+            check(0, "only odd members removed");
+            break;
+        }
+    }
+
+    // reinsert a few after removal
+    check(insert_member(&members, 2001, 30001) == NUM_NODES / 2, "reinsert appends");
+    members.incarnations[NUM_NODES / 2] = 1;
+    check_consistent(&members);
+
+    clear_member_table(&members);
+    check(members.num_peers == 0 && lookup_member(&members, 2000, 30000) == -1, "clear");
+    free_member_table(&members);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
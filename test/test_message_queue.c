@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "message_queue.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 20000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int signalled(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
+
+struct message_queue shared;
+
+void *producer(void *params)
+{
+    int id = *(int *)params;
+    struct gossip_message batch[8];
+    memset(batch, 0, sizeof(batch));
+
+    for (int sent = 0; sent < PER_PRODUCER;)
+    {
+        int cnt = PER_PRODUCER - sent < 8 ? PER_PRODUCER - sent : 8;
+        for (int i = 0; i < cnt; i++)
+        {
+            batch[i].node_name_udp = id;
+            batch[i].node_time = sent + i;
+        }
+        // a full queue drops, retry what did not fit
+        sent += push_messages(&shared, batch, cnt);
+    }
+    return NULL;
+}
+
+int main()
+{
+    struct message_queue queue;
+    init_message_queue(&queue, 8);
+
+    struct gossip_message msgs[16], out[16];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < 16; i++)
+        msgs[i].node_time = i;
+
+    // messages come out in order, one signal per batch
+    check(!signalled(queue.event_fd) && pop_messages(&queue, out, 16) == 0, "empty queue");
+    check(push_messages(&queue, msgs, 3) == 3 && signalled(queue.event_fd), "push signals");
+    wait_messages(&queue);
+    check(!signalled(queue.event_fd), "wait consumes the signal");
+    check(pop_messages(&queue, out, 2) == 2 && out[0].node_time == 0 && out[1].node_time == 1, "pop in order");
+    check(pop_messages(&queue, out, 16) == 1 && out[0].node_time == 2, "pop the rest");
+
+    // a full queue drops the newest
+    check(push_messages(&queue, msgs, 16) == 8, "full queue drops");
+    check(push_messages(&queue, msgs, 1) == 0, "nothing fits");
+    int in_order = pop_messages(&queue, out, 16) == 8;
+    for (int i = 0; i < 8; i++)
+        in_order &= out[i].node_time == i;
+    check(in_order, "kept messages are the oldest");
+
+    // slots are reused once popped
+    check(push_messages(&queue, msgs + 8, 4) == 4 && pop_messages(&queue, out, 16) == 4 && out[3].node_time == 11, "wrap around");
+
+    // several producers, one consumer: nothing is lost or reordered per producer
+    init_message_queue(&shared, 64);
+    pthread_t threads[PRODUCERS];
+    int ids[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; i++)
+    {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, producer, &ids[i]);
+    }
+
+    int next[PRODUCERS] = {0};
+    int total = 0, ordered = 1;
+    while (total < PRODUCERS * PER_PRODUCER)
+    {
+        wait_messages(&shared);
+        int cnt;
+        while ((cnt = pop_messages(&shared, out, 16)) > 0)
+        {
+            for (int i = 0; i < cnt; i++)
+                ordered &= out[i].node_time == next[out[i].node_name_udp]++;
+            total += cnt;
+        }
+    }
+    for (int i = 0; i < PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    check(ordered && total == PRODUCERS * PER_PRODUCER, "producers interleave without loss");
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
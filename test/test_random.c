@@ -0,0 +1,77 @@
+#include <stdio.h>
+
+#include "random.h"
+
+#define NUM_DRAWS 600000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main()
+{
+    seed_random(42);
+
+    // every value of a small range is drawn about equally often
+    int hits[6] = {0};
+    for (int i = 0; i < NUM_DRAWS; i++)
+    {
+        int r = random_below(6);
+        if (r < 0 || r >= 6)
+        {
+            check(0, "random_below in range");
+            break;
+        }
+        hits[r]++;
+    }
+    for (int v = 0; v < 6; v++)
+        check(hits[v] > NUM_DRAWS / 6 * 0.97 && hits[v] < NUM_DRAWS / 6 * 1.03, "random_below uniform");
+
+    double u = random_unit();
+    check(u >= 0. && u < 1., "random_unit in range");
+
+    // samples are distinct, in range, and cover every index evenly
+    int picks[3], seen[10] = {0};
+    for (int round = 0; round < NUM_DRAWS / 3; round++)
+    {
+        int cnt = sample_indexes(10, 3, picks);
+        int ok = cnt == 3 && picks[0] != picks[1] && picks[0] != picks[2] && picks[1] != picks[2];
+        for (int i = 0; i < cnt; i++)
+        {
+            ok &= picks[i] >= 0 && picks[i] < 10;
+            if (ok)
+                seen[picks[i]]++;
+        }
+        if (!ok)
+        {
+            check(0, "sample distinct and in range");
+            break;
+        }
+    }
+    for (int v = 0; v < 10; v++)
+        check(seen[v] > NUM_DRAWS / 10 * 0.97 && seen[v] < NUM_DRAWS / 10 * 1.03, "sample uniform");
+
+    // the first pick must be uniform too, Floyd alone would bias it towards high indexes
+    int first[10] = {0};
+    for (int round = 0; round < NUM_DRAWS / 3; round++)
+    {
+        sample_indexes(10, 3, picks);
+        first[picks[0]]++;
+    }
+    for (int v = 0; v < 10; v++)
+        check(first[v] > NUM_DRAWS / 30 * 0.95 && first[v] < NUM_DRAWS / 30 * 1.05, "sample order uniform");
+
+    check(sample_indexes(2, 3, picks) == 2 && picks[0] + picks[1] == 1, "k above n takes everything");
+    check(sample_indexes(0, 3, picks) == 0, "empty range");
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+
+#include "request_table.h"
+
+#define TIMEOUT_NS 375000000LL
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main()
+{
+    struct request_table table;
+    long long ns = 1000000000000LL;
+    init_request_table(&table, TIMEOUT_NS, ns);
+
+    int requestors[REQUESTORS_PER_TARGET];
+
+    // several requestors for one target are answered together
+    check(add_request_probe(&table, 30000, 31000, ns) == 0, "add");
+    check(add_request_probe(&table, 30000, 31001, ns + 1000) == 0, "add second requestor");
+    check(add_request_probe(&table, 30000, 31000, ns + 2000) == 0, "repeat refreshes");
+    check(table.size == 1, "one entry per target");
+    check(take_request_probe(&table, 30000, requestors, ns + 3000) == 2 &&
+              requestors[0] == 31000 && requestors[1] == 31001,
+          "take returns the requestors");
+    check(table.size == 0 && take_request_probe(&table, 30000, requestors, ns) == 0, "take removes the entry");
+
+    // requestor lists are bounded
+    for (int i = 0; i < REQUESTORS_PER_TARGET; i++)
+        add_request_probe(&table, 30001, 32000 + i, ns);
+    check(add_request_probe(&table, 30001, 33000, ns) == -1, "full requestor list rejects");
+    check(add_request_probe(&table, 30001, 32000, ns) == 0, "known requestor still refreshes");
+
+    // a requestor whose own request timed out is not answered
+    add_request_probe(&table, 30002, 31000, ns);
+    add_request_probe(&table, 30002, 31001, ns + TIMEOUT_NS);
+    check(take_request_probe(&table, 30002, requestors, ns + TIMEOUT_NS + 1) == 1 && requestors[0] == 31001,
+          "timed out requestor skipped");
+
+    // the pool is bounded and never grows
+    clear_request_table(&table);
+    for (int i = 0; i < REQUEST_TABLE_CAPACITY; i++)
+        check(add_request_probe(&table, 40000 + i, 31000, ns + i) == 0, "fill pool");
+    check(add_request_probe(&table, 50000, 31000, ns) == -1, "full pool rejects");
+
+    // the wheel frees entries once their deadline passes, and only those
+    expire_request_probes(&table, ns + TIMEOUT_NS + REQUEST_TABLE_CAPACITY / 2 - 1);
+    check(table.size == REQUEST_TABLE_CAPACITY / 2, "expire due entries");
+    check(take_request_probe(&table, 40000, requestors, ns) == 0, "expired entry is gone");
+    check(add_request_probe(&table, 50000, 31000, ns + TIMEOUT_NS) == 0, "freed slot is reused");
+
+    // jumping far ahead visits every slot once
+    expire_request_probes(&table, ns + 100 * TIMEOUT_NS);
+    check(table.size == 0 && table.by_target.size == 0, "expire everything");
+
+    // entries due within the current tick expire on a later call in the same tick
+    ns += 100 * TIMEOUT_NS;
+    add_request_probe(&table, 30003, 31000, ns);
+    expire_request_probes(&table, ns + TIMEOUT_NS - 1);
+    check(table.size == 1, "not yet due");
+    expire_request_probes(&table, ns + TIMEOUT_NS);
+    check(table.size == 0, "due within the same tick");
+
+    free_request_table(&table);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+
+#include "rtt.h"
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main()
+{
+    struct rtt_estimator rtt;
+    init_rtt(&rtt);
+    check(rtt_timeout_ns(&rtt, 123) == 123, "fallback without samples");
+
+    // first sample: srtt = r, rttvar = r / 2, timeout = 3r
+    rtt_sample(&rtt, 1000000);
+    check(rtt.srtt_ns == 1000000 && rtt.rttvar_ns == 500000, "first sample");
+    check(rtt_timeout_ns(&rtt, 0) == 3000000, "first timeout");
+
+    // a steady RTT converges and the variance decays
+    for (int i = 0; i < 100; i++)
+        rtt_sample(&rtt, 200000);
+    printf("After 100 samples of 200us: srtt %lld ns, rttvar %lld ns\n", rtt.srtt_ns, rtt.rttvar_ns);
+    check(rtt.srtt_ns > 190000 && rtt.srtt_ns < 210000, "srtt converges");
+    check(rtt.rttvar_ns < 10000, "rttvar decays");
+
+    // one outlier raises the timeout well above it
+    long long before = rtt_timeout_ns(&rtt, 0);
+    rtt_sample(&rtt, 5000000);
+    check(rtt_timeout_ns(&rtt, 0) > 3 * before, "outlier widens timeout");
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
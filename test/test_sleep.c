@@ -1,8 +1,11 @@
 #include "time_utils.h"
+#include "scheduler.h"
 #include "log.h"
 
 int main()
 {
+    init_logger(8080, 12001);
+
     logg(LEVEL_INFO, "Sleeping for 5 seconds");
     sleep_(5);
 
@@ -15,5 +18,26 @@ int main()
     logg(LEVEL_INFO, "Sleeping for 0.625 seconds");
     sleep_(0.625);
 
+    // 20 ticks of 50ms must take ~1s in total, however late each wakeup is
+    struct periodic_timer timer;
+    long long start = now_ns();
+    init_periodic_timer(&timer, 0.05, start);
+    long long first = timer.next_ns;
+    for (int i = 0; i < 20; i++)
+        wait_periodic_timer(&timer);
+
+    logg(LEVEL_INFO, "20 ticks of 50ms took %.3f ms after the first deadline (drift %.3f ms)",
+         (now_ns() - first) / 1000000., (now_ns() - first - 19 * 50000000ll) / 1000000.);
+    log_timer_lag("Test", &timer);
+
+    // stretching the period applies from the next tick on
+    set_timer_period(&timer, 100000000ll);
+    long long stretched = now_ns();
+    for (int i = 0; i < 5; i++)
+        wait_periodic_timer(&timer);
+    logg(LEVEL_INFO, "5 ticks of 100ms took %.3f ms", (now_ns() - stretched) / 1000000.);
+
+    cleanup_logger();
+
     return 0;
 }
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "state.h"
+#include "alloc.h"
+#include "constants.h"
+#include "time_utils.h"
+
+// members are never started, datagrams to them are simply lost
+#define NUM_MEMBERS 48
+#define OWN_TCP_PORT 47000
+#define OWN_UDP_PORT 47001
+#define FIRST_MEMBER_PORT 48000
+
+#define NUM_READERS 3
+
+#define WARMUP_ROUNDS 500
+#define MEASURED_ROUNDS 2000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int tcp_ports[NUM_MEMBERS], udp_ports[NUM_MEMBERS], incarnations[NUM_MEMBERS];
+
+void add_update(struct gossip_message *gossip, int m, int status, int incarnation)
+{
+    int i = gossip->cnt_updates++;
+    gossip->tcp_ports[i] = tcp_ports[m];
+    gossip->udp_ports[i] = udp_ports[m];
+    gossip->statuses[i] = status;
+    gossip->incarnations[i] = incarnation;
+}
+
+atomic_int stop_readers;
+atomic_llong cnt_reads, cnt_torn_reads;
+
+// Reads views the way the receive workers do, while the rounds publish new ones
+void *read_views(void *arg)
+{
+    struct node_state *state = (struct node_state *)arg;
+    while (!atomic_load(&stop_readers))
+    {
+        struct member_view *view = enter_member_view(state);
+        int torn = 0;
+        for (int i = 0; i < view->num_peers; i++)
+            torn |= view->tcp_ports[i] != view->udp_ports[i] - 1 || port_index_get(&view->by_udp, view->udp_ports[i]) != i;
+        leave_member_view(view);
+        atomic_fetch_add(&cnt_reads, 1);
+        atomic_fetch_add(&cnt_torn_reads, torn);
+    }
+    return NULL;
+}
+
+// One probe round with everything a node does in it: probing with acks and escalations,
+// gossiping, applying updates that suspect, refute, kill and revive members, and serving
+// probes and request-probes for others
+void run_round(struct node_state *state, int round)
+{
+    start_probe_round(state);
+
+    struct probe_session sessions[MAX_CONCURRENT_PROBES];
+    int cnt_sessions = state->cnt_probes;
+    memcpy(sessions, state->probes, sizeof(struct probe_session) * cnt_sessions);
+    lock_members(state);
+    for (int i = 0; i < cnt_sessions; i += 2)
+        check_ack(state, sessions[i].tcp_port, sessions[i].udp_port);
+    unlock_members(state);
+    request_probes_if_no_ack(state, LLONG_MAX);
+    run_probe_deadlines(state);
+
+    for (int i = 0; i < (int)(PROBE_PERIOD / GOSSIP_PERIOD); i++)
+        gossip_changes(state);
+
+    int m = round % NUM_MEMBERS;
+    struct gossip_message gossip;
+    memset(&gossip, 0, sizeof(gossip));
+    gossip.message_type = GOSSIP_UPDATE;
+    add_update(&gossip, m, MEMBER_SUSPECT, incarnations[m]);
+    add_update(&gossip, m, MEMBER_ALIVE, incarnations[m] + 1);
+    add_update(&gossip, (m + 1) % NUM_MEMBERS, MEMBER_SUSPECT, incarnations[(m + 1) % NUM_MEMBERS]);
+    add_update(&gossip, m, MEMBER_DEAD, incarnations[m] + 1);
+    add_update(&gossip, m, MEMBER_ALIVE, incarnations[m] + 2);
+    incarnations[m] += 2;
+    lock_members(state);
+    process_updates(state, &gossip);
+    unlock_members(state);
+
+    int target = (round * 7) % NUM_MEMBERS, requestor = (round * 11 + 1) % NUM_MEMBERS;
+    struct reply_outbox outbox;
+    outbox.cnt = 0;
+    reply_probe(state, udp_ports[requestor]);
+    append_request_probe(state, udp_ports[target], udp_ports[requestor], &outbox);
+    if (round % 3 != 0)
+        fulfil_request_probes(state, udp_ports[target], &outbox);
+    send_replies(state, &outbox);
+
+    check_suspicions(state);
+}
+
+int main()
+{
+    struct node_state state;
+    memset(&state, 0, sizeof(state));
+    init_node_state(&state, OWN_TCP_PORT, OWN_UDP_PORT);
+    init_loopback_transport(&state.transport, OWN_UDP_PORT);
+    init_periodic_timer(&state.probe_timer, PROBE_PERIOD, now_ns());
+    init_periodic_timer(&state.gossip_timer, GOSSIP_PERIOD, now_ns());
+
+    for (int m = 0; m < NUM_MEMBERS; m++)
+    {
+        tcp_ports[m] = FIRST_MEMBER_PORT + 2 * m;
+        udp_ports[m] = FIRST_MEMBER_PORT + 2 * m + 1;
+        incarnations[m] = 0;
+    }
+    populate_peers(&state, NUM_MEMBERS, tcp_ports, udp_ports, NULL);
+    state.grace_period_until = 0;
+
+    pthread_t readers[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; i++)
+        pthread_create(&readers[i], NULL, read_views, &state);
+
+    // growable structures reach their high-water marks during warm-up, the view pool is
+    // filled up to what the readers can hold
+    for (int round = 0; round < WARMUP_ROUNDS; round++)
+        run_round(&state, round);
+    reserve_member_views(&state, NUM_READERS + 2);
+
+    long long before = mem_allocations();
+    for (int round = WARMUP_ROUNDS; round < WARMUP_ROUNDS + MEASURED_ROUNDS; round++)
+        run_round(&state, round);
+    long long allocations = mem_allocations() - before;
+
+    atomic_store(&stop_readers, 1);
+    for (int i = 0; i < NUM_READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    printf("%lld allocations in %d steady-state rounds\n", allocations, MEASURED_ROUNDS);
+    check(allocations == 0, "steady state does not allocate");
+    check(state.members.num_peers == NUM_MEMBERS, "every member revived");
+    check(blocking_under_lock() == 0, "nothing sends while holding a lock");
+    check(atomic_load(&cnt_reads) > 0 && atomic_load(&cnt_torn_reads) == 0, "readers see whole views");
+    check(state.cnt_views <= NUM_READERS + 2, "views in use stay bounded");
+
+    struct member_view *view = enter_member_view(&state);
+    check(view->num_peers == NUM_MEMBERS && view_has_peer(view, udp_ports[0]) && view->own_incarnation == state.incarnation, "view follows the table");
+    leave_member_view(view);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
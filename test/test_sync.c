@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "state.h"
+#include "sync.h"
+#include "alloc.h"
+#include "constants.h"
+#include "time_utils.h"
+
+#define NUM_MEMBERS 200
+#define FIRST_MEMBER_PORT 48000
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int same_digest(const struct sync_digest *a, const struct sync_digest *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+// One push-pull exchange, as the join server runs it over TCP
+void run_sync(struct node_state *initiator, struct node_state *responder, struct arena *scratch)
+{
+    struct sync_digest initiator_digest, responder_digest, unused;
+    struct sync_entry *pulled, *pushed;
+
+    sync_digest(initiator, &initiator_digest);
+    int cnt_pulled = collect_sync_entries(responder, &initiator_digest, &responder_digest, scratch, &pulled);
+    int cnt_pushed = collect_sync_entries(initiator, &responder_digest, &unused, scratch, &pushed);
+    apply_sync_entries(initiator, pulled, cnt_pulled);
+    apply_sync_entries(responder, pushed, cnt_pushed);
+}
+
+int main()
+{
+    // digests ignore order
+    struct sync_digest a, b;
+    clear_digest(&a);
+    clear_digest(&b);
+    for (int i = 0; i < NUM_MEMBERS; i++)
+        add_to_digest(&a, FIRST_MEMBER_PORT + 2 * i, FIRST_MEMBER_PORT + 2 * i + 1, MEMBER_ALIVE, i);
+    for (int i = NUM_MEMBERS - 1; i >= 0; i--)
+        add_to_digest(&b, FIRST_MEMBER_PORT + 2 * i, FIRST_MEMBER_PORT + 2 * i + 1, MEMBER_ALIVE, i);
+    check(same_digest(&a, &b), "digest is order independent");
+
+    // a changed incarnation only changes its own bucket
+    add_to_digest(&b, FIRST_MEMBER_PORT, FIRST_MEMBER_PORT + 1, MEMBER_ALIVE, 0);
+    add_to_digest(&b, FIRST_MEMBER_PORT, FIRST_MEMBER_PORT + 1, MEMBER_ALIVE, 1);
+    int cnt_differing = 0;
+    for (int i = 0; i < SYNC_BUCKETS; i++)
+        cnt_differing += a.buckets[i] != b.buckets[i];
+    check(cnt_differing == 1 && a.buckets[sync_bucket(FIRST_MEMBER_PORT, FIRST_MEMBER_PORT + 1)] != b.buckets[sync_bucket(FIRST_MEMBER_PORT, FIRST_MEMBER_PORT + 1)],
+          "update changes only its bucket");
+
+    // two nodes that each missed different updates converge after one sync
+    struct node_state first, second;
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    init_node_state(&first, 47000, 47001);
+    init_node_state(&second, 47002, 47003);
+    init_loopback_transport(&first.transport, 47001);
+    init_loopback_transport(&second.transport, 47003);
+
+    int tcp_ports[NUM_MEMBERS], udp_ports[NUM_MEMBERS];
+    for (int i = 0; i < NUM_MEMBERS; i++)
+    {
+        tcp_ports[i] = FIRST_MEMBER_PORT + 2 * i;
+        udp_ports[i] = FIRST_MEMBER_PORT + 2 * i + 1;
+    }
+    populate_peers(&first, NUM_MEMBERS / 2, tcp_ports, udp_ports, NULL);
+    populate_peers(&second, NUM_MEMBERS, tcp_ports, udp_ports, NULL);
+    append_member(&first, 47002, 47003, 0);
+    append_member(&second, 47000, 47001, 0);
+
+    struct gossip_message gossip;
+    memset(&gossip, 0, sizeof(gossip));
+    gossip.cnt_updates = 1;
+    gossip.tcp_ports[0] = tcp_ports[3];
+    gossip.udp_ports[0] = udp_ports[3];
+    gossip.statuses[0] = MEMBER_DEAD;
+    gossip.incarnations[0] = 0;
+    lock_members(&first);
+    process_updates(&first, &gossip);
+    unlock_members(&first);
+
+    struct arena scratch;
+    init_arena(&scratch, 1024);
+    run_sync(&first, &second, &scratch);
+
+    check(first.members.num_peers == NUM_MEMBERS, "initiator pulled the members it missed");
+    check(lookup_member(&second.members, tcp_ports[3], udp_ports[3]) == -1, "responder learned of the death");
+    check(lookup_member(&first.members, tcp_ports[3], udp_ports[3]) == -1, "buried member is not revived");
+
+    struct sync_digest first_digest, second_digest;
+    sync_digest(&first, &first_digest);
+    sync_digest(&second, &second_digest);
+    check(same_digest(&first_digest, &second_digest), "digests agree after the sync");
+
+    // once the digests agree there is nothing left to send
+    struct sync_entry *entries;
+    arena_reset(&scratch);
+    sync_digest(&first, &first_digest);
+    int cnt = collect_sync_entries(&second, &first_digest, &second_digest, &scratch, &entries);
+    check(cnt == 0, "agreeing buckets are not sent");
+
+    // an entry with an unknown status neither removes nor buries anyone
+    struct sync_entry garbage = {tcp_ports[0], udp_ports[0], MEMBER_SUSPECT + 1, 100};
+    apply_sync_entries(&first, &garbage, 1);
+    check(lookup_member(&first.members, tcp_ports[0], udp_ports[0]) != -1 && port_index_get(&first.graveyard, port_key(tcp_ports[0], udp_ports[0])) == -1,
+          "unknown status is ignored");
+
+    // the graveyard is capped, the oldest burials go first, and all of them expire
+    struct sync_entry deaths[MAX_GRAVES + 10];
+    for (int i = 0; i < MAX_GRAVES + 10; i++)
+    {
+        deaths[i].tcp_port = 30000 + i;
+        deaths[i].udp_port = 1;
+        deaths[i].status = MEMBER_DEAD;
+        deaths[i].incarnation = 0;
+    }
+    apply_sync_entries(&second, deaths, MAX_GRAVES + 10);
+    check(second.graveyard.size <= MAX_GRAVES && port_index_get(&second.graveyard, port_key(30000, 1)) == -1 &&
+              port_index_get(&second.graveyard, port_key(30000 + MAX_GRAVES + 9, 1)) == 0,
+          "graveyard keeps the newest burials");
+    lock_members(&second);
+    expire_graves(&second, now_ns() + 1000000000000ll);
+    unlock_members(&second);
+    check(second.graveyard.size == 0, "graves expire");
+
+    free_arena(&scratch);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
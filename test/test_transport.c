@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+
+#include "transport.h"
+#include "time_utils.h"
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int readable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
+
+int main()
+{
+    struct transport a, b;
+    init_loopback_transport(&a, 50001);
+    init_loopback_transport(&b, 50003);
+
+    struct datagram received[MAX_RECV_BATCH];
+
+    // datagrams arrive in order, tagged with the sender's port
+    check(!readable(b.fd), "empty queue is not readable");
+    send_datagram(&a, 50003, "first", 6);
+    send_datagram(&a, 50003, "second", 7);
+    check(readable(b.fd), "waiting datagrams make the fd readable");
+    int cnt = recv_datagrams(&b, received, MAX_RECV_BATCH, 0);
+    check(cnt == 2 && received[0].udp_port == 50001 && received[0].len == 6 && strcmp(received[0].buf, "first") == 0 &&
+              strcmp(received[1].buf, "second") == 0,
+          "loopback delivers in order");
+    check(!readable(b.fd), "drained queue is not readable");
+
+    // nothing waits: polls return at once, timeouts expire
+    check(recv_datagrams(&b, received, MAX_RECV_BATCH, 0) == 0, "poll of an empty queue");
+    long long before = now_ns();
+    check(recv_datagrams(&b, received, MAX_RECV_BATCH, 20) == 0 && now_ns() - before >= 20000000ll, "timeout expires");
+
+    // unknown ports and full queues drop silently
+    check(send_datagram(&a, 50005, "lost", 5) == 0, "send to an unknown port");
+    int in_order = 0;
+    for (int i = 0; i < 300; i++)
+        send_datagram(&a, 50003, &i, sizeof(i));
+    int total = 0;
+    while ((cnt = recv_datagrams(&b, received, MAX_RECV_BATCH, 0)) > 0)
+    {
+        for (int i = 0; i < cnt; i++)
+            in_order += *(const int *)received[i].buf == total + i;
+        total += cnt;
+    }
+    check(total == 256 && in_order == 256, "full queue drops the newest");
+
+    // streams are local sockets
+    int listener = listen_stream(&a, 50000);
+    int client = connect_stream(&b, 50000, 0);
+    int server = accept_stream(&a, listener);
+    check(listener >= 0 && client >= 0 && server >= 0, "streams connect");
+    char buf[6];
+    check(send_all(client, "hello", 6) == 0 && recv_all(server, buf, 6) == 0 && strcmp(buf, "hello") == 0, "streams carry data");
+    check(connect_stream(&b, 50002, 0) < 0, "nobody listens");
+
+    // faults: partitioned senders are dropped, others delayed
+    struct transport c, faulty;
+    init_loopback_transport(&c, 50007);
+    struct fault_config config;
+    memset(&config, 0, sizeof(config));
+    check(parse_fault_config("delay=30-30,partition=50007,partition_at=0-100", &config) == 0 && config.min_delay_ms == 30 &&
+              config.max_delay_ms == 30 && config.cnt_partitioned == 1 && config.partitioned_ports[0] == 50007 &&
+              config.partition_until == 100,
+          "parse");
+    struct fault_config untimed;
+    memset(&untimed, 0, sizeof(untimed));
+    check(parse_fault_config("partition=21001", &untimed) == 0 && untimed.cnt_partitioned == 1 && untimed.partition_from == 0 &&
+              untimed.partition_until < 0,
+          "partition without a window lasts for good");
+    struct transport inner = b;
+    init_fault_injector(&faulty, &inner, &config);
+
+    send_datagram(&a, 50003, "late", 5);
+    send_datagram(&c, 50003, "cut", 4);
+    check(recv_datagrams(&faulty, received, MAX_RECV_BATCH, 0) == 0, "delayed datagram is held");
+    check(send_datagram(&faulty, 50007, "cut", 4) == 0 && recv_datagrams(&c, received, MAX_RECV_BATCH, 0) == 0, "partition drops sends");
+    before = now_ns();
+    cnt = recv_datagrams(&faulty, received, MAX_RECV_BATCH, 1000);
+    check(cnt == 1 && strcmp(received[0].buf, "late") == 0 && now_ns() - before >= 20000000ll, "delayed datagram is released");
+    check(recv_datagrams(&faulty, received, MAX_RECV_BATCH, 50) == 0, "partitioned sender is dropped");
+
+    // held datagrams make the fd readable once due
+    send_datagram(&a, 50003, "due", 4);
+    check(recv_datagrams(&faulty, received, MAX_RECV_BATCH, 0) == 0 && !readable(faulty.fd), "fd quiet while held");
+    sleep_(0.05);
+    check(readable(faulty.fd) && recv_datagrams(&faulty, received, MAX_RECV_BATCH, 0) == 1, "fd readable once due");
+
+    // loss drops everything
+    struct transport lossy, d;
+    init_loopback_transport(&d, 50009);
+    memset(&config, 0, sizeof(config));
+    check(parse_fault_config("loss=1", &config) == 0, "parse loss");
+    inner = d;
+    init_fault_injector(&lossy, &inner, &config);
+    send_datagram(&a, 50009, "lost", 5);
+    check(recv_datagrams(&lossy, received, MAX_RECV_BATCH, 20) == 0, "loss drops");
+
+    check(parse_fault_config("loss=2", &config) < 0 && parse_fault_config("delay=5-1", &config) < 0 &&
+              parse_fault_config("jitter=1", &config) < 0 && parse_fault_config("partition=1+x", &config) < 0,
+          "malformed specs are rejected");
+
+    // sockets receive whole batches, waiting only for the first datagram
+    struct transport udp_a, udp_b;
+    init_udp_transport(&udp_a, 50015);
+    init_udp_transport(&udp_b, 50017);
+    int numbers[100];
+    struct datagram numbered[100];
+    for (int i = 0; i < 100; i++)
+    {
+        numbers[i] = i;
+        numbered[i].udp_port = 50017;
+        numbered[i].buf = &numbers[i];
+        numbered[i].len = sizeof(int);
+    }
+    check(send_datagrams(&udp_a, numbered, 100) == 100, "udp sends a batch");
+    check(recv_datagrams(&udp_b, received, MAX_RECV_BATCH, -1) == MAX_RECV_BATCH, "udp receives a full batch");
+    total = MAX_RECV_BATCH;
+    in_order = 0;
+    for (int i = 0; i < MAX_RECV_BATCH; i++)
+        in_order += received[i].udp_port == 50015 && *(const int *)received[i].buf == i;
+    while ((cnt = recv_datagrams(&udp_b, received, MAX_RECV_BATCH, 100)) > 0)
+    {
+        for (int i = 0; i < cnt; i++)
+            in_order += received[i].udp_port == 50015 && *(const int *)received[i].buf == total + i;
+        total += cnt;
+    }
+    check(total == 100 && in_order == 100, "udp batches arrive in order");
+    check(open_shard(&udp_b, &udp_a) < 0, "unshared port has no shards");
+    close_transport(&udp_a);
+    close_transport(&udp_b);
+
+    // shards of a shared port split what arrives between them
+    struct transport sharded, shard;
+    init_sharded_udp_transport(&sharded, 50019);
+    check(open_shard(&sharded, &shard) == 0 && shard.udp_port == 50019, "open a shard");
+    init_udp_transport(&udp_a, 50015);
+    for (int i = 0; i < 100; i++)
+        numbered[i].udp_port = 50019;
+    send_datagrams(&udp_a, numbered, 100);
+    total = 0;
+    while ((cnt = recv_datagrams(&sharded, received, MAX_RECV_BATCH, 50)) > 0 || (cnt = recv_datagrams(&shard, received, MAX_RECV_BATCH, 0)) > 0)
+        total += cnt;
+    check(total == 100, "shards receive everything");
+    close_transport(&udp_a);
+    close_transport(&shard);
+    close_transport(&sharded);
+
+#ifdef IO_URING
+    // io_uring talks to plain UDP sockets, in batches larger than one submission
+    struct transport uring, udp;
+    if (init_uring_transport(&uring, 50011) == 0)
+    {
+        init_udp_transport(&udp, 50013);
+        struct datagram batch[100];
+        int values[100];
+        for (int i = 0; i < 100; i++)
+        {
+            values[i] = i;
+            batch[i].udp_port = 50013;
+            batch[i].buf = &values[i];
+            batch[i].len = sizeof(int);
+        }
+        check(send_datagrams(&uring, batch, 100) == 100, "uring sends a batch");
+        total = in_order = 0;
+        while ((cnt = recv_datagrams(&udp, received, MAX_RECV_BATCH, 100)) > 0)
+        {
+            for (int i = 0; i < cnt; i++)
+                in_order += received[i].udp_port == 50011 && *(const int *)received[i].buf == total + i;
+            total += cnt;
+        }
+        check(total == 100 && in_order == 100, "uring sends arrive");
+
+        // more datagrams than receive buffers: the multishot receive is rearmed
+        int sent = 0;
+        total = in_order = 0;
+        for (int round = 0; round < 6; round++)
+        {
+            for (int i = 0; i < 100; i++)
+            {
+                values[i] = sent++;
+                batch[i].udp_port = 50011;
+            }
+            send_datagrams(&udp, batch, 100);
+            if (round % 3 != 2)
+                continue;
+            while ((cnt = recv_datagrams(&uring, received, MAX_RECV_BATCH, 0)) > 0)
+            {
+                for (int i = 0; i < cnt; i++)
+                    in_order += received[i].udp_port == 50013 && *(const int *)received[i].buf == total + i;
+                total += cnt;
+            }
+        }
+        check(total == 600 && in_order == 600, "uring receives everything");
+        check(!readable(uring.fd) && recv_datagrams(&uring, received, MAX_RECV_BATCH, 20) == 0, "uring times out");
+
+        close_transport(&uring);
+        close_transport(&udp);
+    }
+    else
+        puts("io_uring is not available, skipped");
+#endif
+
+    close_transport(&a);
+    close_transport(&faulty);
+    close_transport(&c);
+    close_transport(&lossy);
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wire.h"
+#include "gossip_message.h"
+#include "membership.h"
+
+int failures = 0;
+
+void check(int cond, const char *what)
+{
+    if (!cond)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main()
+{
+    unsigned char buf[MAX_DATAGRAM_SIZE];
+    struct gossip_message in, out;
+
+    // a probe carries no updates and should be tiny
+    memset(&in, 0, sizeof(in));
+    in.message_type = PROBE;
+    in.node_name_tcp = 40000;
+    in.node_name_udp = 65535;
+    int len = encode_gossip(&in, buf, sizeof(buf));
+    printf("PROBE encodes to %d bytes (struct is %d bytes)\n", len, (int)sizeof(in));
+    check(len > 0 && len <= 8, "probe size");
+    check(decode_gossip(buf, len, &out) == 0, "probe decode");
+    check(out.message_type == PROBE && out.node_name_tcp == 40000 && out.node_name_udp == 65535, "probe fields");
+
+    // request probe carries its target
+    in.message_type = REQUEST_PROBE;
+    in.target_udp = 12001;
+    in.node_time = 300;
+    len = encode_gossip(&in, buf, sizeof(buf));
+    check(decode_gossip(buf, len, &out) == 0, "request decode");
+    check(out.target_udp == 12001 && out.node_time == 300, "request fields");
+
+    // a full update list round trips
+    memset(&in, 0, sizeof(in));
+    in.message_type = GOSSIP_UPDATE;
+    in.cnt_updates = UPDATES_PER_MESSAGE;
+    for (int i = 0; i < UPDATES_PER_MESSAGE; i++)
+    {
+        in.tcp_ports[i] = 2000 + i;
+        in.udp_ports[i] = 60000 + i;
+        in.statuses[i] = i % 3;
+        in.incarnations[i] = i * 1000;
+    }
+    len = encode_gossip(&in, buf, sizeof(buf));
+    printf("GOSSIP_UPDATE with %d updates encodes to %d bytes\n", UPDATES_PER_MESSAGE, len);
+    check(len > 0 && len <= WIRE_HEADER_MAX_SIZE + UPDATES_PER_MESSAGE * WIRE_UPDATE_SIZE, "gossip size");
+    check(decode_gossip(buf, len, &out) == 0, "gossip decode");
+    check(memcmp(in.tcp_ports, out.tcp_ports, sizeof(in.tcp_ports)) == 0, "gossip tcp ports");
+    check(memcmp(in.udp_ports, out.udp_ports, sizeof(in.udp_ports)) == 0, "gossip udp ports");
+    check(memcmp(in.statuses, out.statuses, sizeof(in.statuses)) == 0, "gossip statuses");
+    check(memcmp(in.incarnations, out.incarnations, sizeof(in.incarnations)) == 0, "gossip incarnations");
+
+    // unknown statuses and message types are rejected
+    unsigned char bad[sizeof(buf)];
+    in.statuses[5] = MEMBER_SUSPECT + 1;
+    int bad_len = encode_gossip(&in, bad, sizeof(bad));
+    check(bad_len > 0 && decode_gossip(bad, bad_len, &out) == -1, "unknown status rejected");
+    in.statuses[5] = MEMBER_ALIVE;
+    in.message_type = NOT_A_PEER + 1;
+    bad_len = encode_gossip(&in, bad, sizeof(bad));
+    check(bad_len > 0 && decode_gossip(bad, bad_len, &out) == -1, "unknown message type rejected");
+    in.message_type = GOSSIP_UPDATE;
+
+    // truncated, padded and foreign datagrams are rejected
+    check(decode_gossip(buf, len - 1, &out) == -1, "truncated rejected");
+    check(decode_gossip(buf, len + 1, &out) == -1, "trailing bytes rejected");
+    buf[0] = WIRE_VERSION + 1;
+    check(decode_gossip(buf, len, &out) == -1, "version rejected");
+
+    // ports outside 16 bits cannot be encoded
+    in.tcp_ports[0] = 70000;
+    check(encode_gossip(&in, buf, sizeof(buf)) == -1, "port range");
+
+    if (failures == 0)
+        puts("Test done!");
+    return failures != 0;
+}